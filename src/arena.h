@@ -0,0 +1,123 @@
+//To include the definitions before including the header define the macro ARENA_IMPLEMENTATION
+#ifndef ARENA_H_
+#define ARENA_H_
+
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <assert.h>
+#include <stdbool.h>
+
+#define ARENA_REGION_DEFAULT_CAP (64 * 1024)
+#define ARENA_DA_INIT_CAP (256)
+
+/*Bump allocator: allocations are carved out of large regions and released all at once*/
+typedef struct Arena_Region Arena_Region;
+
+struct Arena_Region {
+    Arena_Region *next;
+    size_t size;
+    size_t capacity;
+    max_align_t data[];
+};
+
+typedef struct {
+    Arena_Region *begin;
+    Arena_Region *end;
+} Arena;
+
+void arena_reserve(Arena *a, size_t size);
+void *arena_alloc(Arena *a, size_t size);
+void *arena_realloc(Arena *a, void *old, size_t old_size, size_t new_size);
+void arena_free(Arena *a);
+
+/*Same growth policy as da_append, but the items live in the arena and are never freed one by one*/
+#define arena_da_reserve(a, da, n) do {                                                           \
+    if((da)->size + (n) > (da)->capacity){                                                        \
+        size_t new_capacity = (da)->capacity == 0 ? ARENA_DA_INIT_CAP : (da)->capacity;               \
+        while(new_capacity < (da)->size + (n)) new_capacity *= 2;                                  \
+        (da)->items = arena_realloc((a), (da)->items, (da)->capacity * sizeof(*(da)->items),      \
+                                    new_capacity * sizeof(*(da)->items));                          \
+        (da)->capacity = new_capacity;                                                            \
+    }                                                                                             \
+} while(0)
+
+#define arena_da_append(a, da, item) do {                                                         \
+    if((da)->size >= (da)->capacity) arena_da_reserve((a), (da), 1);                              \
+    (da)->items[(da)->size++] = (item);                                                           \
+} while(0)
+
+#ifdef ARENA_IMPLEMENTATION
+
+static size_t arena_align(size_t size)
+{
+    return (size + sizeof(max_align_t) - 1) / sizeof(max_align_t) * sizeof(max_align_t);
+}
+
+static Arena_Region *arena_new_region(size_t capacity)
+{
+    Arena_Region *r = malloc(sizeof(*r) + capacity);
+    assert(r != NULL && "arena: OUT OF MEMORY");
+    r->next = NULL;
+    r->size = 0;
+    r->capacity = capacity;
+    return r;
+}
+
+/**Makes sure the next `size` bytes can be allocated without starting another region.
+  Call it up front when the total is known to get a single allocation*/
+void arena_reserve(Arena *a, size_t size)
+{
+    size = arena_align(size);
+    if(a->end != NULL && a->end->capacity - a->end->size >= size) return;
+
+    Arena_Region *r = arena_new_region(size > ARENA_REGION_DEFAULT_CAP ? size : ARENA_REGION_DEFAULT_CAP);
+    if(a->end == NULL) a->begin = r;
+    else a->end->next = r;
+    a->end = r;
+}
+
+void *arena_alloc(Arena *a, size_t size)
+{
+    size = arena_align(size);
+    arena_reserve(a, size);
+    void *res = (uint8_t *) a->end->data + a->end->size;
+    a->end->size += size;
+    return res;
+}
+
+/**Grows in place when `old` is the last allocation of the current region, copies otherwise*/
+void *arena_realloc(Arena *a, void *old, size_t old_size, size_t new_size)
+{
+    old_size = arena_align(old_size);
+    new_size = arena_align(new_size);
+    if(new_size <= old_size) return old;
+
+    Arena_Region *r = a->end;
+    if(old != NULL && r != NULL && (uint8_t *) old + old_size == (uint8_t *) r->data + r->size &&
+       r->capacity - r->size >= new_size - old_size){
+        r->size += new_size - old_size;
+        return old;
+    }
+
+    void *res = arena_alloc(a, new_size);
+    if(old != NULL) memcpy(res, old, old_size);
+    return res;
+}
+
+void arena_free(Arena *a)
+{
+    Arena_Region *r = a->begin;
+    while(r != NULL){
+        Arena_Region *next = r->next;
+        free(r);
+        r = next;
+    }
+    a->begin = NULL;
+    a->end = NULL;
+}
+
+#endif // ARENA_IMPLEMENTATION
+
+#endif //ARENA_H_
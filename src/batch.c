@@ -0,0 +1,584 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+
+#include "batch.h"
+#include "simd.h"
+
+#define BATCH_ON (~(Data) 0)    /*mask word of a lane the current step runs on*/
+
+struct Evm_Batch {
+    Evm_Insts program;
+    uint8_t *data;
+    size_t data_size;
+    size_t lanes;
+    size_t memory_size;     /*per lane*/
+    Data *stack;            /*EVM_BATCH_STACK_MAX rows of `lanes` slots*/
+    Data *calls;            /*EVM_BATCH_CALL_STACK_MAX rows of return addresses*/
+    Addr *ip;               /*per lane state, only up to date while the lanes are apart*/
+    size_t *sp;
+    size_t *csp;
+    Data *mask;
+    uint8_t *memory;        /*lane l owns memory_size bytes from l * memory_size*/
+    size_t dirty;           /*bytes from address 0 a run may have written, the next one resets only those*/
+    Evm_Err *err;           /*EVM_ERR_BUDGET while the lane runs*/
+    Data *out;
+    size_t running;
+    size_t masked;          /*lanes the current step runs on*/
+    Evm_Batch_Stats stats;
+};
+
+/*The lanes in [lo, hi) under the mask: all at `ip` with the same stack depths*/
+typedef struct {
+    Addr ip;
+    size_t sp;
+    size_t csp;
+    size_t lo;
+    size_t hi;
+    bool split;     /*the step sent the lanes to different ips, Evm_Batch.ip has them*/
+} Batch_Group;
+
+#define ROW(b, s) ((b)->stack + (size_t) (s) * (b)->lanes)
+#define CALL_ROW(b, s) ((b)->calls + (size_t) (s) * (b)->lanes)
+
+static Data batch_alu(Evm_Inst op, Data b, Data a)
+{
+    switch(op){
+        case EVM_INST_ADD:   return b + a;
+        case EVM_INST_SUB:   return b - a;
+        case EVM_INST_MULTU: return b * a;
+        case EVM_INST_GT:    return a > b;
+        case EVM_INST_LT:    return a < b;
+        case EVM_INST_EQ:    return a == b;
+        case EVM_INST_GE:    return a >= b;
+        case EVM_INST_LE:    return a <= b;
+        default:             UNREACHABLE;
+    }
+}
+
+static Data batch_select(Data mask, Data yes, Data no)
+{
+    return (yes & mask) | (no & ~mask);
+}
+
+#if defined(__AVX2__)
+#define BATCH_VEC (4)
+typedef __m256i Batch_Vec;
+
+static Batch_Vec vec_load(const Data *p) { return _mm256_loadu_si256((const __m256i *) p); }
+static void vec_store(Data *p, Batch_Vec v) { _mm256_storeu_si256((__m256i *) p, v); }
+static Batch_Vec vec_set1(Data v) { return _mm256_set1_epi64x((long long) v); }
+static Batch_Vec vec_select(Batch_Vec m, Batch_Vec yes, Batch_Vec no) { return _mm256_blendv_epi8(no, yes, m); }
+
+static bool vec_has(Evm_Inst op)
+{
+    return op == EVM_INST_ADD || op == EVM_INST_SUB || op == EVM_INST_MULTU || op == EVM_INST_GT
+        || op == EVM_INST_LT || op == EVM_INST_EQ || op == EVM_INST_GE || op == EVM_INST_LE;
+}
+
+static Batch_Vec vec_alu(Evm_Inst op, Batch_Vec b, Batch_Vec a)
+{
+    //64 bit compares are signed, flipping the sign bits makes them unsigned
+    const Batch_Vec flip = _mm256_set1_epi64x(INT64_MIN);
+    const Batch_Vec ones = _mm256_set1_epi64x(-1);
+    Batch_Vec sa = _mm256_xor_si256(a, flip);
+    Batch_Vec sb = _mm256_xor_si256(b, flip);
+    Batch_Vec r;
+    switch(op){
+        case EVM_INST_ADD: return _mm256_add_epi64(b, a);
+        case EVM_INST_SUB: return _mm256_sub_epi64(b, a);
+        case EVM_INST_MULTU: return mul64x4(a, b);
+        case EVM_INST_GT: r = _mm256_cmpgt_epi64(sa, sb);                          break;
+        case EVM_INST_LT: r = _mm256_cmpgt_epi64(sb, sa);                          break;
+        case EVM_INST_EQ: r = _mm256_cmpeq_epi64(a, b);                            break;
+        case EVM_INST_GE: r = _mm256_xor_si256(_mm256_cmpgt_epi64(sb, sa), ones);  break;
+        case EVM_INST_LE: r = _mm256_xor_si256(_mm256_cmpgt_epi64(sa, sb), ones);  break;
+        default: UNREACHABLE;
+    }
+    return _mm256_and_si256(r, _mm256_set1_epi64x(1));
+}
+#elif defined(__SSE2__)
+#define BATCH_VEC (2)
+typedef __m128i Batch_Vec;
+
+static Batch_Vec vec_load(const Data *p) { return _mm_loadu_si128((const __m128i *) p); }
+static void vec_store(Data *p, Batch_Vec v) { _mm_storeu_si128((__m128i *) p, v); }
+static Batch_Vec vec_set1(Data v) { return _mm_set1_epi64x((long long) v); }
+static Batch_Vec vec_select(Batch_Vec m, Batch_Vec yes, Batch_Vec no)
+{
+    return _mm_or_si128(_mm_and_si128(m, yes), _mm_andnot_si128(m, no));
+}
+
+static bool vec_has(Evm_Inst op)
+{
+    return op == EVM_INST_ADD || op == EVM_INST_SUB || op == EVM_INST_MULTU || op == EVM_INST_GT
+        || op == EVM_INST_LT || op == EVM_INST_EQ || op == EVM_INST_GE || op == EVM_INST_LE;
+}
+
+//SSE2 only compares 32 bit halves: equal lanes have both halves equal
+static Batch_Vec vec_eq64(Batch_Vec a, Batch_Vec b)
+{
+    Batch_Vec eq = _mm_cmpeq_epi32(a, b);
+    return _mm_and_si128(eq, _mm_shuffle_epi32(eq, _MM_SHUFFLE(2, 3, 0, 1)));
+}
+
+//unsigned a > b: the high halves decide unless they are equal, then the low halves do.
+//Flipping the sign bit of every half makes the signed 32 bit compare unsigned
+static Batch_Vec vec_gtu64(Batch_Vec a, Batch_Vec b)
+{
+    const Batch_Vec flip = _mm_set1_epi32(INT32_MIN);
+    Batch_Vec gt = _mm_cmpgt_epi32(_mm_xor_si128(a, flip), _mm_xor_si128(b, flip));
+    Batch_Vec eq = _mm_cmpeq_epi32(a, b);
+    Batch_Vec gt_hi = _mm_shuffle_epi32(gt, _MM_SHUFFLE(3, 3, 1, 1));
+    Batch_Vec gt_lo = _mm_shuffle_epi32(gt, _MM_SHUFFLE(2, 2, 0, 0));
+    Batch_Vec eq_hi = _mm_shuffle_epi32(eq, _MM_SHUFFLE(3, 3, 1, 1));
+    return _mm_or_si128(gt_hi, _mm_and_si128(eq_hi, gt_lo));
+}
+
+static Batch_Vec vec_alu(Evm_Inst op, Batch_Vec b, Batch_Vec a)
+{
+    const Batch_Vec ones = _mm_set1_epi64x(-1);
+    Batch_Vec r;
+    switch(op){
+        case EVM_INST_ADD: return _mm_add_epi64(b, a);
+        case EVM_INST_SUB: return _mm_sub_epi64(b, a);
+        case EVM_INST_MULTU: return mul64x2(a, b);
+        case EVM_INST_GT: r = vec_gtu64(a, b);                         break;
+        case EVM_INST_LT: r = vec_gtu64(b, a);                         break;
+        case EVM_INST_EQ: r = vec_eq64(a, b);                          break;
+        case EVM_INST_GE: r = _mm_xor_si128(vec_gtu64(b, a), ones);    break;
+        case EVM_INST_LE: r = _mm_xor_si128(vec_gtu64(a, b), ones);    break;
+        default: UNREACHABLE;
+    }
+    return _mm_and_si128(r, _mm_set1_epi64x(1));
+}
+#endif
+
+/*Row kernels: every one only touches the lanes in [lo, hi) whose mask word is set*/
+
+static void batch_fill(Data *dst, Data v, const Data *mask, size_t lo, size_t hi)
+{
+    size_t i = lo;
+#ifdef BATCH_VEC
+    Batch_Vec vv = vec_set1(v);
+    for(; i + BATCH_VEC <= hi; i += BATCH_VEC){
+        vec_store(dst + i, vec_select(vec_load(mask + i), vv, vec_load(dst + i)));
+    }
+#endif
+    for(; i < hi; ++i) dst[i] = batch_select(mask[i], v, dst[i]);
+}
+
+static void batch_copy(Data *dst, const Data *src, const Data *mask, size_t lo, size_t hi)
+{
+    size_t i = lo;
+#ifdef BATCH_VEC
+    for(; i + BATCH_VEC <= hi; i += BATCH_VEC){
+        vec_store(dst + i, vec_select(vec_load(mask + i), vec_load(src + i), vec_load(dst + i)));
+    }
+#endif
+    for(; i < hi; ++i) dst[i] = batch_select(mask[i], src[i], dst[i]);
+}
+
+static void batch_swap(Data *x, Data *y, const Data *mask, size_t lo, size_t hi)
+{
+    size_t i = lo;
+#ifdef BATCH_VEC
+    for(; i + BATCH_VEC <= hi; i += BATCH_VEC){
+        Batch_Vec m = vec_load(mask + i), vx = vec_load(x + i), vy = vec_load(y + i);
+        vec_store(x + i, vec_select(m, vy, vx));
+        vec_store(y + i, vec_select(m, vx, vy));
+    }
+#endif
+    for(; i < hi; ++i){
+        Data t = x[i];
+        x[i] = batch_select(mask[i], y[i], t);
+        y[i] = batch_select(mask[i], t, y[i]);
+    }
+}
+
+/**dst = dst `op` a, dst is the lower of the two rows*/
+static void batch_binop(Evm_Inst op, Data *dst, const Data *a, const Data *mask, size_t lo, size_t hi)
+{
+    size_t i = lo;
+#ifdef BATCH_VEC
+    if(vec_has(op)){
+        for(; i + BATCH_VEC <= hi; i += BATCH_VEC){
+            Batch_Vec vb = vec_load(dst + i);
+            vec_store(dst + i, vec_select(vec_load(mask + i), vec_alu(op, vb, vec_load(a + i)), vb));
+        }
+    }
+#endif
+    for(; i < hi; ++i) dst[i] = batch_select(mask[i], batch_alu(op, dst[i], a[i]), dst[i]);
+}
+
+Evm_Batch *evm_batch_create(Evm_Insts program, Evm_Segment data, size_t lanes, size_t memory)
+{
+    if(memory == 0) memory = EVM_BATCH_MEMORY;
+    if(lanes == 0 || data.size > memory || lanes > SIZE_MAX / memory
+       || lanes > SIZE_MAX / (EVM_BATCH_STACK_MAX * sizeof(Data))) return NULL;
+    Evm_Batch *b = calloc(1, sizeof(*b));
+    if(b == NULL) return NULL;
+    b->program = program;
+    b->lanes = lanes;
+    b->memory_size = memory;
+    b->data_size = data.size;
+    b->data = malloc(data.size + 1);
+    b->stack = malloc(EVM_BATCH_STACK_MAX * lanes * sizeof(*b->stack));
+    b->calls = malloc(EVM_BATCH_CALL_STACK_MAX * lanes * sizeof(*b->calls));
+    b->ip = malloc(lanes * sizeof(*b->ip));
+    b->sp = malloc(lanes * sizeof(*b->sp));
+    b->csp = malloc(lanes * sizeof(*b->csp));
+    b->mask = malloc(lanes * sizeof(*b->mask));
+    b->memory = calloc(lanes, memory);
+    b->err = malloc(lanes * sizeof(*b->err));
+    b->out = malloc(lanes * sizeof(*b->out));
+    if(b->data == NULL || b->stack == NULL || b->calls == NULL || b->ip == NULL || b->sp == NULL
+       || b->csp == NULL || b->mask == NULL || b->memory == NULL || b->err == NULL || b->out == NULL){
+        evm_batch_destroy(b);
+        return NULL;
+    }
+    if(data.size > 0) memcpy(b->data, data.items, data.size);
+    return b;
+}
+
+void evm_batch_destroy(Evm_Batch *b)
+{
+    if(b == NULL) return;
+    free(b->data);
+    free(b->stack);
+    free(b->calls);
+    free(b->ip);
+    free(b->sp);
+    free(b->csp);
+    free(b->mask);
+    free(b->memory);
+    free(b->err);
+    free(b->out);
+    free(b);
+}
+
+size_t evm_batch_lanes(const Evm_Batch *b)
+{
+    return b->lanes;
+}
+
+void evm_batch_stats(const Evm_Batch *b, Evm_Batch_Stats *stats)
+{
+    *stats = b->stats;
+}
+
+static void batch_end(Evm_Batch *b, size_t l, Evm_Err err)
+{
+    b->err[l] = err;
+    b->mask[l] = 0;
+    b->running--;
+    b->masked--;
+}
+
+static void batch_fault(Evm_Batch *b, const Batch_Group *g, Evm_Err err)
+{
+    for(size_t l = g->lo; l < g->hi; ++l){
+        if(b->mask[l]) batch_end(b, l, err);
+    }
+}
+
+static bool batch_mem_ok(const Evm_Batch *b, Addr addr, size_t n)
+{
+    return addr <= b->memory_size && n <= b->memory_size - addr;
+}
+
+/**The lanes have their targets in Evm_Batch.ip, they stay a group if they all agree*/
+static void batch_jump(Evm_Batch *b, Batch_Group *g)
+{
+    bool first = true;
+    for(size_t l = g->lo; l < g->hi; ++l){
+        if(!b->mask[l]) continue;
+        if(first){
+            g->ip = b->ip[l];
+            first = false;
+        } else if(b->ip[l] != g->ip){
+            g->split = true;
+            b->stats.divergences++;
+            return;
+        }
+    }
+}
+
+/**Runs the instruction at g->ip on the group and advances it*/
+static void batch_step(Evm_Batch *b, Batch_Group *g)
+{
+    #define FAULT(e) do { batch_fault(b, g, (e)); return; } while(0)
+    #define NEED(n) do { if(g->sp < (n)) FAULT(EVM_ERR_STACK_UNDERFLOW); } while(0)
+    #define ROOM(n) do { if(EVM_BATCH_STACK_MAX - g->sp < (n)) FAULT(EVM_ERR_STACK_OVERFLOW); } while(0)
+    #define EACH_LANE(l) for(size_t l = g->lo; l < g->hi; ++l) if(b->mask[l])
+
+    if(g->ip >= b->program.size) FAULT(EVM_ERR_IP_OUT_OF_BOUNDS);
+    Evm_Inst inst = b->program.items[g->ip];
+    Addr next = g->ip + 1;
+    Data imm = 0;
+    if(evm_has_immediate(inst)){
+        if(next >= b->program.size) FAULT(EVM_ERR_IP_OUT_OF_BOUNDS);
+        imm = b->program.items[next++];
+    }
+
+    switch((Evm_Opcode) inst){
+        case EVM_INST_PUSH:
+        case EVM_INST_PUSHR:
+            ROOM(1);
+            batch_fill(ROW(b, g->sp), inst == EVM_INST_PUSHR ? next + imm : imm, b->mask, g->lo, g->hi);
+            g->sp++;
+        break;
+        case EVM_INST_DUP:
+            if(imm >= g->sp) FAULT(EVM_ERR_STACK_UNDERFLOW);
+            ROOM(1);
+            batch_copy(ROW(b, g->sp), ROW(b, g->sp - 1 - imm), b->mask, g->lo, g->hi);
+            g->sp++;
+        break;
+        case EVM_INST_SWAP:
+            NEED(2);
+            batch_swap(ROW(b, g->sp - 1), ROW(b, g->sp - 2), b->mask, g->lo, g->hi);
+        break;
+        case EVM_INST_ADD:
+        case EVM_INST_SUB:
+        case EVM_INST_MULTU:
+        case EVM_INST_GT:
+        case EVM_INST_LT:
+        case EVM_INST_EQ:
+        case EVM_INST_GE:
+        case EVM_INST_LE:
+            NEED(2);
+            batch_binop(inst, ROW(b, g->sp - 2), ROW(b, g->sp - 1), b->mask, g->lo, g->hi);
+            g->sp--;
+        break;
+        case EVM_INST_DIVU:
+        case EVM_INST_MODU: {
+            NEED(2);
+            Data *a = ROW(b, g->sp - 1), *dst = ROW(b, g->sp - 2);
+            EACH_LANE(l){
+                if(a[l] == 0) batch_end(b, l, EVM_ERR_DIV_BY_ZERO);
+                else dst[l] = inst == EVM_INST_DIVU ? dst[l] / a[l] : dst[l] % a[l];
+            }
+            g->sp--;
+        }
+        break;
+        case EVM_INST_READ8:
+        case EVM_INST_READ64: {
+            NEED(1);
+            size_t n = inst == EVM_INST_READ64 ? sizeof(Data) : 1;
+            Data *top = ROW(b, g->sp - 1);
+            EACH_LANE(l){
+                if(!batch_mem_ok(b, top[l], n)){
+                    batch_end(b, l, EVM_ERR_MEMORY_OUT_OF_BOUNDS);
+                    continue;
+                }
+                const uint8_t *p = b->memory + l * b->memory_size + top[l];
+                if(n == 1) top[l] = *p;
+                else memcpy(&top[l], p, n);
+            }
+        }
+        break;
+        case EVM_INST_WRITE8:
+        case EVM_INST_WRITE64: {
+            NEED(2);
+            size_t n = inst == EVM_INST_WRITE64 ? sizeof(Data) : 1;
+            Data *addr = ROW(b, g->sp - 1), *value = ROW(b, g->sp - 2);
+            EACH_LANE(l){
+                if(!batch_mem_ok(b, addr[l], n)){
+                    batch_end(b, l, EVM_ERR_MEMORY_OUT_OF_BOUNDS);
+                    continue;
+                }
+                uint8_t *p = b->memory + l * b->memory_size + addr[l];
+                if(n == 1) *p = (uint8_t) value[l];
+                else memcpy(p, &value[l], n);
+                if(addr[l] + n > b->dirty) b->dirty = addr[l] + n;
+            }
+            g->sp -= 2;
+        }
+        break;
+        case EVM_INST_JP:
+        case EVM_INST_JR: {
+            NEED(1);
+            Data *target = ROW(b, --g->sp);
+            Addr base = inst == EVM_INST_JR ? next : 0;
+            EACH_LANE(l) b->ip[l] = base + target[l];
+            batch_jump(b, g);
+        }
+        return;
+        case EVM_INST_JPC:
+        case EVM_INST_JRC: {
+            NEED(2);
+            g->sp -= 2;
+            Data *cond = ROW(b, g->sp + 1), *target = ROW(b, g->sp);
+            Addr base = inst == EVM_INST_JRC ? next : 0;
+            EACH_LANE(l) b->ip[l] = cond[l] ? base + target[l] : next;
+            batch_jump(b, g);
+        }
+        return;
+        case EVM_INST_CALL:
+        case EVM_INST_CALLR: {
+            NEED(1);
+            if(g->csp >= EVM_BATCH_CALL_STACK_MAX) FAULT(EVM_ERR_STACK_OVERFLOW);
+            Data *target = ROW(b, --g->sp);
+            Addr base = inst == EVM_INST_CALLR ? next : 0;
+            batch_fill(CALL_ROW(b, g->csp++), next, b->mask, g->lo, g->hi);
+            EACH_LANE(l) b->ip[l] = base + target[l];
+            batch_jump(b, g);
+        }
+        return;
+        case EVM_INST_RET: {
+            if(g->csp == 0) FAULT(EVM_ERR_CALL_STACK_UNDERFLOW);
+            Data *ret = CALL_ROW(b, --g->csp);
+            EACH_LANE(l) b->ip[l] = ret[l];
+            batch_jump(b, g);
+        }
+        return;
+        case EVM_INST_HALT: {
+            Data *top = g->sp > 0 ? ROW(b, g->sp - 1) : NULL;
+            EACH_LANE(l){
+                b->out[l] = top != NULL ? top[l] : 0;
+                batch_end(b, l, EVM_ERR_OK);
+            }
+        }
+        return;
+        //they reach outside the lane
+        case EVM_INST_PRINTU:
+        case EVM_INST_PUTS:
+        case EVM_INST_NATIVE:
+        case EVM_INST_MULW:
+        case EVM_INST_ADDC:
+        case EVM_INST_VADD:
+        case EVM_INST_VMUL:
+        case EVM_INST_VSUM:
+        case EVM_INST_FDREAD:
+        case EVM_INST_FDWRITE:
+        case EVM_INST_SPAWN:
+        case EVM_INST_JOIN:
+        case EVM_INST_ALOAD:
+        case EVM_INST_ASTORE:
+        case EVM_INST_CAS:
+        case EVM_INST_FADD:
+        case EVM_INST_ALLOC:
+        case EVM_INST_FREE:
+        case EVM_INST_REALLOC:
+        case EVM_INST_ENTER:
+        case EVM_INST_LEAVE:
+        case EVM_INST_LOAD_LOCAL:
+        case EVM_INST_STORE_LOCAL:
+        case EVM_INST_COUNT:
+        default:
+            FAULT(EVM_ERR_ILLEGAL_INST);
+    }
+    g->ip = next;
+
+    #undef EACH_LANE
+    #undef ROOM
+    #undef NEED
+    #undef FAULT
+}
+
+/**Masks the running lanes at the lowest ip and sets `g` up for them. `limit` receives the lowest ip
+   of the other running lanes and `shared` is cleared if the group's stack depths differ.
+   True when every running lane is in the group: the lanes converged*/
+static bool batch_schedule(Evm_Batch *b, Batch_Group *g, Addr *limit, bool *shared)
+{
+    Addr min = UINT64_MAX;
+    for(size_t l = 0; l < b->lanes; ++l){
+        if(b->err[l] == EVM_ERR_BUDGET && b->ip[l] < min) min = b->ip[l];
+    }
+    *g = (Batch_Group) {.ip = min};
+    *limit = UINT64_MAX;
+    *shared = true;
+    b->masked = 0;
+    for(size_t l = 0; l < b->lanes; ++l){
+        bool on = b->err[l] == EVM_ERR_BUDGET && b->ip[l] == min;
+        b->mask[l] = on ? BATCH_ON : 0;
+        if(!on){
+            if(b->err[l] == EVM_ERR_BUDGET && b->ip[l] < *limit) *limit = b->ip[l];
+            continue;
+        }
+        if(b->masked == 0){
+            g->sp = b->sp[l];
+            g->csp = b->csp[l];
+            g->lo = l;
+        } else if(b->sp[l] != g->sp || b->csp[l] != g->csp){
+            *shared = false;
+        }
+        g->hi = l + 1;
+        b->masked++;
+    }
+    return *limit == UINT64_MAX && *shared;
+}
+
+/**Stores the state of the group back into the lanes*/
+static void batch_leave(Evm_Batch *b, const Batch_Group *g)
+{
+    for(size_t l = g->lo; l < g->hi; ++l){
+        if(!b->mask[l]) continue;
+        if(!g->split) b->ip[l] = g->ip;
+        b->sp[l] = g->sp;
+        b->csp[l] = g->csp;
+    }
+}
+
+static void batch_dispatch(Evm_Batch *b, Batch_Group *g)
+{
+    b->stats.steps++;
+    b->stats.lane_insts += b->masked;
+    if(b->masked > 1) b->stats.simd_steps++;
+    g->split = false;
+    batch_step(b, g);
+}
+
+size_t evm_batch_run(Evm_Batch *b, const Data *inputs, Data *outputs, Evm_Err *errs, uint64_t budget)
+{
+    Data *bottom = ROW(b, 0);
+    for(size_t l = 0; l < b->lanes; ++l){
+        bottom[l] = inputs[l];
+        b->mask[l] = BATCH_ON;
+        b->err[l] = EVM_ERR_BUDGET;
+        b->out[l] = 0;
+        uint8_t *memory = b->memory + l * b->memory_size;
+        if(b->data_size > 0) memcpy(memory, b->data, b->data_size);
+        if(b->dirty > b->data_size) memset(memory + b->data_size, 0, b->dirty - b->data_size);
+    }
+    b->running = b->masked = b->lanes;
+    b->dirty = 0;
+
+    //A group keeps running, its state only in `g`, while it is the one at the lowest ip: until it
+    //splits, ends or reaches `limit`, where other lanes are waiting
+    Batch_Group g = {.ip = 0, .sp = 1, .csp = 0, .lo = 0, .hi = b->lanes};
+    Addr limit = UINT64_MAX;
+    bool shared = true;
+    bool converged = true;
+    while(b->running > 0 && budget > 0){
+        if(shared){
+            budget--;
+            batch_dispatch(b, &g);
+            if(!g.split && g.ip < limit && b->masked > 0) continue;
+            batch_leave(b, &g);
+        } else {
+            //the lanes at this ip have no common stack rows: one step each, one at a time
+            for(size_t l = g.lo; l < g.hi && budget > 0; ++l){
+                if(!b->mask[l]) continue;
+                Batch_Group one = {.ip = g.ip, .sp = b->sp[l], .csp = b->csp[l], .lo = l, .hi = l + 1};
+                b->masked = 1;
+                budget--;
+                batch_dispatch(b, &one);
+                batch_leave(b, &one);
+            }
+        }
+        if(b->running == 0) break;
+        bool was = converged;
+        converged = batch_schedule(b, &g, &limit, &shared);
+        if(converged && !was) b->stats.reconvergences++;
+    }
+
+    size_t halted = 0;
+    for(size_t l = 0; l < b->lanes; ++l){
+        outputs[l] = b->out[l];
+        if(errs != NULL) errs[l] = b->err[l];
+        halted += b->err[l] == EVM_ERR_OK;
+    }
+    return halted;
+}
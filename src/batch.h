@@ -0,0 +1,46 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "evm.h"
+
+/* SPMD batch executor: one word program run over many inputs at once.
+   Every lane has its own stack, call stack and memory slice; the stacks are stored lane-major
+   (slot s of every lane is one contiguous row), so an instruction the lanes share is one SIMD
+   pass over the lanes. Each step runs the instruction at the lowest ip of any running lane on
+   the lanes that sit there (the mask), so lanes that split on a branch wait for each other at
+   the first address they meet again. Lanes under the mask that do not share a stack depth run
+   one at a time.
+   Only instructions that stay inside a lane are supported: stack, arithmetic, memory, jumps and
+   calls. Anything else (I/O, natives, threads, atomics, heap, frames) faults the lane with
+   EVM_ERR_ILLEGAL_INST */
+
+#define EVM_BATCH_STACK_MAX (256)       /*data stack slots per lane*/
+#define EVM_BATCH_CALL_STACK_MAX (64)   /*nested calls per lane*/
+#define EVM_BATCH_MEMORY (4096)         /*memory bytes per lane when evm_batch_create is given 0*/
+
+typedef struct {
+    uint64_t steps;             /*instructions dispatched, each one runs on every lane under the mask*/
+    uint64_t lane_insts;        /*instructions retired, summed over the lanes*/
+    uint64_t simd_steps;        /*steps whose lanes shared stack rows. The rest ran lane by lane*/
+    uint64_t divergences;       /*branches and returns that sent the lanes under the mask apart*/
+    uint64_t reconvergences;    /*times every running lane met at one ip again*/
+} Evm_Batch_Stats;
+
+typedef struct Evm_Batch Evm_Batch;
+
+/**`data` is copied to address 0 of every lane's memory of `memory` bytes. NULL if `data` does
+   not fit or out of memory. `program` must outlive the batch*/
+Evm_Batch *evm_batch_create(Evm_Insts program, Evm_Segment data, size_t lanes, size_t memory);
+void evm_batch_destroy(Evm_Batch *batch);
+/**Runs every lane from address 0 with inputs[lane] alone on its stack, for at most `budget` steps.
+   outputs[lane] receives the stack top of a lane that halted (0 on an empty stack) and errs[lane],
+   if not NULL, how the lane ended: EVM_ERR_BUDGET if it was still running. Returns the lanes that halted*/
+size_t evm_batch_run(Evm_Batch *batch, const Data *inputs, Data *outputs, Evm_Err *errs, uint64_t budget);
+size_t evm_batch_lanes(const Evm_Batch *batch);
+/**Accumulated over every run. Lane utilisation is lane_insts / (steps * lanes)*/
+void evm_batch_stats(const Evm_Batch *batch, Evm_Batch_Stats *stats);
+
+#endif //BATCH_H_
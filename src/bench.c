@@ -0,0 +1,370 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <time.h>
+
+#include <inttypes.h>
+#include "evm.h"
+#include "perf.h"
+#include "pgo.h"
+#include "batch.h"
+
+/* Benchmark kernels: large generated programs run with both encodings.
+   Every result is printed as one line of space separated key=value pairs.
+   With --pgo every kernel is also profiled, rewritten by evm_pgo_optimize and run again.
+   With --batch small per input programs run once per input on one VM and on the batch executor */
+
+typedef struct {
+    size_t *items;
+    size_t size;
+    size_t capacity;
+} Relocs;
+
+typedef struct {
+    const char *name;
+    void (*generate)(Evm_Insts *program, Relocs *relocs, size_t n);
+} Kernel;
+
+#define COUNTER_ADDR (8)
+
+static void emit(Evm_Insts *program, Evm_Inst inst)
+{
+    da_append(program, inst);
+}
+
+static void emit_imm(Evm_Insts *program, Evm_Inst inst, Data imm)
+{
+    da_append(program, inst);
+    da_append(program, imm);
+}
+
+static void emit_addr(Evm_Insts *program, Relocs *relocs, Addr addr)
+{
+    da_append(program, EVM_INST_PUSH);
+    da_append(relocs, program->size);
+    da_append(program, addr);
+}
+
+/**counter = iterations; head: <body> counter -= 1; jpc head while counter > 0; halt*/
+static Addr emit_loop_head(Evm_Insts *program, Data iterations)
+{
+    emit_imm(program, EVM_INST_PUSH, iterations);
+    emit_imm(program, EVM_INST_PUSH, COUNTER_ADDR);
+    emit(program, EVM_INST_WRITE64);
+    return program->size;
+}
+
+static void emit_loop_tail(Evm_Insts *program, Relocs *relocs, Addr head)
+{
+    emit_imm(program, EVM_INST_PUSH, COUNTER_ADDR);
+    emit(program, EVM_INST_READ64);
+    emit_imm(program, EVM_INST_PUSH, 1);
+    emit(program, EVM_INST_SUB);
+    emit_imm(program, EVM_INST_DUP, 0);
+    emit_imm(program, EVM_INST_PUSH, COUNTER_ADDR);
+    emit(program, EVM_INST_WRITE64);
+    emit_imm(program, EVM_INST_PUSH, 0);
+    emit(program, EVM_INST_LT);
+    emit_addr(program, relocs, head);
+    emit(program, EVM_INST_SWAP);
+    emit(program, EVM_INST_JPC);
+    emit(program, EVM_INST_HALT);
+}
+
+/**n blocks of straight-line arithmetic with small immediates*/
+static void gen_straight(Evm_Insts *program, Relocs *relocs, size_t n)
+{
+    emit_imm(program, EVM_INST_PUSH, 0);
+    Addr head = emit_loop_head(program, 16);
+    for(size_t i = 0; i < n; ++i){
+        emit_imm(program, EVM_INST_PUSH, i & 0x3f);
+        emit(program, EVM_INST_ADD);
+        emit_imm(program, EVM_INST_DUP, 0);
+        emit_imm(program, EVM_INST_PUSH, 7);
+        emit(program, EVM_INST_MULTU);
+        emit(program, EVM_INST_ADD);
+    }
+    emit_loop_tail(program, relocs, head);
+}
+
+/**n tiny functions, each called once per iteration*/
+static void gen_calls(Evm_Insts *program, Relocs *relocs, size_t n)
+{
+    Relocs calls = {0};
+    emit_imm(program, EVM_INST_PUSH, 0);
+    Addr head = emit_loop_head(program, 16);
+    for(size_t i = 0; i < n; ++i){
+        emit_addr(program, relocs, 0);
+        da_append(&calls, program->size - 1);
+        emit(program, EVM_INST_CALL);
+    }
+    emit_loop_tail(program, relocs, head);
+    for(size_t i = 0; i < n; ++i){
+        program->items[calls.items[i]] = program->size;
+        emit_imm(program, EVM_INST_PUSH, i & 0x3f);
+        emit(program, EVM_INST_ADD);
+        emit(program, EVM_INST_RET);
+    }
+    free(calls.items);
+}
+
+/**one small hot loop, dominated by dispatch rather than program size*/
+static void gen_loop(Evm_Insts *program, Relocs *relocs, size_t n)
+{
+    emit_imm(program, EVM_INST_PUSH, 0);
+    Addr head = emit_loop_head(program, n * 4);
+    emit_imm(program, EVM_INST_PUSH, 1);
+    emit(program, EVM_INST_ADD);
+    emit_loop_tail(program, relocs, head);
+}
+
+static const Kernel kernels[] = {
+    {.name = "straight", .generate = gen_straight},
+    {.name = "calls",    .generate = gen_calls},
+    {.name = "loop",     .generate = gen_loop},
+};
+
+/**acc = acc * x + k, 32 times: no branches, the lanes never split*/
+static void gen_poly(Evm_Insts *program, Relocs *relocs)
+{
+    (void) relocs;
+    emit_imm(program, EVM_INST_PUSH, 0);
+    for(Data k = 0; k < 32; ++k){
+        emit_imm(program, EVM_INST_DUP, 1);
+        emit(program, EVM_INST_MULTU);
+        emit_imm(program, EVM_INST_PUSH, k);
+        emit(program, EVM_INST_ADD);
+    }
+    emit(program, EVM_INST_HALT);
+}
+
+/**Collatz steps of x: the lanes split on every parity test and loop a different number of times*/
+static void gen_collatz(Evm_Insts *program, Relocs *relocs)
+{
+    emit_imm(program, EVM_INST_PUSH, 0);
+    emit(program, EVM_INST_SWAP);                   //steps x
+    Addr head = program->size;
+    emit_imm(program, EVM_INST_DUP, 0);
+    emit_imm(program, EVM_INST_PUSH, 1);
+    emit(program, EVM_INST_LT);                     //1 < x
+    emit_addr(program, relocs, 0);
+    size_t to_step = program->size - 1;
+    emit(program, EVM_INST_SWAP);
+    emit(program, EVM_INST_JPC);
+    emit(program, EVM_INST_SWAP);
+    emit(program, EVM_INST_HALT);
+    program->items[to_step] = program->size;
+    emit(program, EVM_INST_SWAP);
+    emit_imm(program, EVM_INST_PUSH, 1);
+    emit(program, EVM_INST_ADD);
+    emit(program, EVM_INST_SWAP);
+    emit_imm(program, EVM_INST_DUP, 0);
+    emit_imm(program, EVM_INST_PUSH, 2);
+    emit(program, EVM_INST_MODU);
+    emit_addr(program, relocs, 0);
+    size_t to_odd = program->size - 1;
+    emit(program, EVM_INST_SWAP);
+    emit(program, EVM_INST_JPC);
+    emit_imm(program, EVM_INST_PUSH, 2);
+    emit(program, EVM_INST_DIVU);
+    emit_addr(program, relocs, head);
+    emit(program, EVM_INST_JP);
+    program->items[to_odd] = program->size;
+    emit_imm(program, EVM_INST_PUSH, 3);
+    emit(program, EVM_INST_MULTU);
+    emit_imm(program, EVM_INST_PUSH, 1);
+    emit(program, EVM_INST_ADD);
+    emit_addr(program, relocs, head);
+    emit(program, EVM_INST_JP);
+}
+
+static const struct {
+    const char *name;
+    void (*generate)(Evm_Insts *program, Relocs *relocs);
+} batch_kernels[] = {
+    {.name = "poly",    .generate = gen_poly},
+    {.name = "collatz", .generate = gen_collatz},
+};
+
+#define BATCH_INPUTS (64 * 1024)
+static const size_t batch_lanes[] = {64, 1024};  //fewer lanes lose less to divergence
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static bool perf_stats = false;
+static bool pgo = false;
+static bool batch = false;
+
+static Evm *create_evm(void)
+{
+    Evm *evm = evm_create(NULL);
+    assert(evm != NULL && "bench: could not create a VM");
+    return evm;
+}
+
+static void run(const char *kernel, const char *encoding, Evm *evm, size_t program_bytes)
+{
+    Evm_Perf perf;
+    if(perf_stats) evm_perf_begin(&perf);
+    uint64_t start = now_ns();
+    Evm_Err err = evm_run_ex(evm);
+    uint64_t ns = now_ns() - start;
+    if(perf_stats) evm_perf_end(&perf);
+    if(err != EVM_ERR_OK){
+        fprintf(stderr, "bench: %s/%s: %s at ip %zu\n", kernel, encoding, evm_err_to_str(err), evm_ip(evm));
+        exit(1);
+    }
+    printf("kernel=%s encoding=%s program_bytes=%zu insts=%" PRIu64 " ns=%" PRIu64 " ns_per_inst=%.3f\n",
+           kernel, encoding, program_bytes, evm_retired(evm), ns, (double) ns / evm_retired(evm));
+    if(perf_stats){
+        char name[256];
+        snprintf(name, sizeof(name), "%s/%s", kernel, encoding);
+        evm_perf_report(&perf, name, evm_retired(evm), stdout);
+    }
+}
+
+static void run_pgo(const char *kernel, Evm_Insts program, Relocs relocs)
+{
+    Evm *evm = create_evm();
+    evm_attach(evm, program, 0);
+    uint64_t *profile = calloc(program.size, sizeof(*profile));
+    evm_set_profile(evm, profile);
+    Evm_Err err = evm_run_ex(evm);
+    if(err != EVM_ERR_OK){
+        fprintf(stderr, "bench: %s/profile: %s at ip %zu\n", kernel, evm_err_to_str(err), evm_ip(evm));
+        exit(1);
+    }
+
+    Evm_Insts optimized;
+    size_t *opt_relocs;
+    size_t opt_relocs_count;
+    Evm_Pgo_Stats stats;
+    bool ok = evm_pgo_optimize(program, relocs.items, relocs.size, profile,
+                               &optimized, &opt_relocs, &opt_relocs_count, &stats);
+    evm_set_profile(evm, NULL);
+    free(profile);
+    if(!ok){
+        fprintf(stderr, "bench: %s: evm_pgo_optimize refused the kernel\n", kernel);
+        exit(1);
+    }
+    printf("kernel=%s pgo_blocks=%zu inlined=%zu jumps_removed=%zu jumps_added=%zu insts_before=%" PRIu64
+           " insts_predicted=%" PRIu64 "\n", kernel, stats.blocks, stats.inlined, stats.jumps_removed,
+           stats.jumps_added, stats.insts_before, stats.insts_after);
+
+    evm_attach(evm, optimized, 0);
+    run(kernel, "words+pgo", evm, optimized.size * sizeof(Evm_Inst));
+
+    Evm_Bytecode code = {0};
+    ok = evm_encode_compact(optimized, opt_relocs, opt_relocs_count, &code);
+    assert(ok && "bench: could not encode the optimized kernel");
+    evm_attach_compact(evm, code);
+    run(kernel, "compact+pgo", evm, code.size);
+    evm_destroy(evm);
+
+    free(code.items);
+    free(opt_relocs);
+    free(optimized.items);
+}
+
+static void run_batch(const char *kernel, Evm_Insts program, size_t inputs)
+{
+    Data *expected = malloc(inputs * sizeof(*expected));
+    Evm *evm = create_evm();
+    evm_attach(evm, program, 0);
+    uint64_t retired = 0;
+    uint64_t start = now_ns();
+    for(size_t i = 0; i < inputs; ++i){
+        evm_reset(evm);
+        evm_push(evm, i);
+        Evm_Err err = evm_run_ex(evm);
+        if(err != EVM_ERR_OK || evm_pop(evm, &expected[i]) != EVM_ERR_OK){
+            fprintf(stderr, "bench: %s/scalar: %s at ip %zu\n", kernel, evm_err_to_str(err), evm_ip(evm));
+            exit(1);
+        }
+        retired += evm_retired(evm);
+    }
+    uint64_t ns = now_ns() - start;
+    evm_destroy(evm);
+    printf("kernel=%s impl=scalar inputs=%zu insts=%" PRIu64 " ns=%" PRIu64 " ns_per_input=%.3f\n",
+           kernel, inputs, retired, ns, (double) ns / inputs);
+
+    for(size_t k = 0; k < ARRAY_LEN(batch_lanes); ++k){
+        size_t lanes = batch_lanes[k];
+        Evm_Batch *b = evm_batch_create(program, (Evm_Segment) {0}, lanes, 0);
+        Data *in = malloc(lanes * sizeof(*in));
+        Data *out = malloc(lanes * sizeof(*out));
+        assert(b != NULL && in != NULL && out != NULL && "bench: could not create the batch");
+        start = now_ns();
+        for(size_t base = 0; base < inputs; base += lanes){
+            for(size_t l = 0; l < lanes; ++l) in[l] = base + l;
+            size_t halted = evm_batch_run(b, in, out, NULL, UINT64_MAX);
+            for(size_t l = 0; l < lanes && base + l < inputs; ++l){
+                if(halted != lanes || out[l] != expected[base + l]){
+                    fprintf(stderr, "bench: %s/batch: lane %zu differs from the scalar run\n", kernel, base + l);
+                    exit(1);
+                }
+            }
+        }
+        ns = now_ns() - start;
+        Evm_Batch_Stats st;
+        evm_batch_stats(b, &st);
+        printf("kernel=%s impl=batch inputs=%zu lanes=%zu steps=%" PRIu64 " simd_steps=%" PRIu64 " divergences=%" PRIu64
+               " utilisation=%.3f ns=%" PRIu64 " ns_per_input=%.3f\n", kernel, inputs, lanes, st.steps, st.simd_steps,
+               st.divergences, (double) st.lane_insts / ((double) st.steps * lanes), ns, (double) ns / inputs);
+        evm_batch_destroy(b);
+        free(in);
+        free(out);
+    }
+    free(expected);
+}
+
+int main(int argc, char **argv)
+{
+    size_t n = 200000;
+    for(int i = 1; i < argc; ++i){
+        if(strcmp(argv[i], "--perf-stats") == 0) perf_stats = true;
+        else if(strcmp(argv[i], "--pgo") == 0) pgo = true;
+        else if(strcmp(argv[i], "--batch") == 0) batch = true;
+        else n = strtoull(argv[i], NULL, 0);
+    }
+
+    for(size_t k = 0; k < ARRAY_LEN(kernels); ++k){
+        Evm_Insts program = {0};
+        Relocs relocs = {0};
+        Evm_Bytecode code = {0};
+        kernels[k].generate(&program, &relocs, n);
+        bool ok = evm_encode_compact(program, relocs.items, relocs.size, &code);
+        assert(ok && "bench: could not encode kernel");
+        (void) ok;
+
+        Evm *evm = create_evm();
+        evm_attach(evm, program, 0);
+        run(kernels[k].name, "words", evm, program.size * sizeof(Evm_Inst));
+        evm_attach_compact(evm, code);
+        run(kernels[k].name, "compact", evm, code.size);
+        evm_destroy(evm);
+
+        if(pgo) run_pgo(kernels[k].name, program, relocs);
+
+        free(code.items);
+        free(relocs.items);
+        free(program.items);
+    }
+
+    for(size_t k = 0; batch && k < ARRAY_LEN(batch_kernels); ++k){
+        Evm_Insts program = {0};
+        Relocs relocs = {0};
+        batch_kernels[k].generate(&program, &relocs);
+        run_batch(batch_kernels[k].name, program, BATCH_INPUTS);
+        free(relocs.items);
+        free(program.items);
+    }
+    return 0;
+}
@@ -0,0 +1,223 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "cache.h"
+
+#define FNV_OFFSET (0xcbf29ce484222325ull)
+#define FNV_PRIME  (0x100000001b3ull)
+#define CACHE_EXT ".evmi"
+#define CACHE_MAGIC "EACE"
+
+/*Front of every entry file, followed by the source (padded to 8 bytes) and then the image*/
+typedef struct {
+    char magic[4];
+    uint32_t options;
+    uint64_t source_size;
+} Cache_Header;
+
+static size_t source_span(uint64_t source_size)
+{
+    return (source_size + 7) & ~(uint64_t) 7;
+}
+
+static uint64_t fnv1a(uint64_t h, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    for(size_t i = 0; i < size; ++i){
+        h ^= p[i];
+        h *= FNV_PRIME;
+    }
+    return h;
+}
+
+uint64_t easm_cache_key(const void *src, size_t size, uint32_t options)
+{
+    uint64_t h = fnv1a(FNV_OFFSET, EASM_CACHE_VERSION, sizeof(EASM_CACHE_VERSION));
+    h = fnv1a(h, &options, sizeof(options));
+    return fnv1a(h, src, size);
+}
+
+/**mkdir -p*/
+static bool make_dirs(char *path)
+{
+    for(char *p = path + 1; ; ++p){
+        if(*p != '/' && *p != '\0') continue;
+        char c = *p;
+        *p = '\0';
+        bool ok = mkdir(path, 0755) == 0 || errno == EEXIST;
+        *p = c;
+        if(!ok) return false;
+        if(c == '\0') return true;
+    }
+}
+
+bool easm_cache_open(Easm_Cache *cache)
+{
+    cache->enabled = false;
+    const char *dir = getenv("EASM_CACHE_DIR");
+    const char *xdg = getenv("XDG_CACHE_HOME");
+    const char *home = getenv("HOME");
+    int n;
+    if(dir != NULL) n = snprintf(cache->dir, sizeof(cache->dir), "%s", dir);
+    else if(xdg != NULL && *xdg != '\0') n = snprintf(cache->dir, sizeof(cache->dir), "%s/easm", xdg);
+    else if(home != NULL && *home != '\0') n = snprintf(cache->dir, sizeof(cache->dir), "%s/.cache/easm", home);
+    else return false;
+    if(n <= 0 || (size_t) n >= sizeof(cache->dir)) return false;  //an empty $EASM_CACHE_DIR disables the cache
+    cache->enabled = make_dirs(cache->dir);
+    return cache->enabled;
+}
+
+static bool entry_path(const Easm_Cache *cache, uint64_t key, char *out, size_t out_size)
+{
+    int n = snprintf(out, out_size, "%s/%016" PRIx64 CACHE_EXT, cache->dir, key);
+    return n > 0 && (size_t) n < out_size;
+}
+
+/**The entry was written for exactly this source and options, not just for its hash*/
+static bool entry_matches(const uint8_t *map, size_t map_size, const void *src, size_t src_size, uint32_t options)
+{
+    Cache_Header header;
+    if(map_size < sizeof(header)) return false;
+    memcpy(&header, map, sizeof(header));
+    if(memcmp(header.magic, CACHE_MAGIC, sizeof(header.magic)) != 0) return false;
+    if(header.options != options || header.source_size != src_size) return false;
+    if(source_span(src_size) > map_size - sizeof(header)) return false;
+    return memcmp(map + sizeof(header), src, src_size) == 0;
+}
+
+bool easm_cache_get(const Easm_Cache *cache, uint64_t key, const void *src, size_t src_size, uint32_t options,
+                    Easm_Cache_Entry *entry)
+{
+    char path[EASM_CACHE_PATH_MAX + 32];
+    if(!cache->enabled || !entry_path(cache, key, path, sizeof(path))) return false;
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return false;
+    struct stat st;
+    void *map = MAP_FAILED;
+    if(fstat(fd, &st) == 0 && st.st_size > 0){
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    }
+    close(fd);
+    if(map == MAP_FAILED) return false;
+    if(!entry_matches(map, st.st_size, src, src_size, options)){
+        munmap(map, st.st_size);
+        return false;
+    }
+
+    utimensat(AT_FDCWD, path, NULL, 0); //eviction goes by mtime, so a hit counts as a use
+    size_t offset = sizeof(Cache_Header) + source_span(src_size);
+    *entry = (Easm_Cache_Entry) {
+        .image = (const uint8_t *) map + offset,
+        .size = st.st_size - offset,
+        .map = map,
+        .map_size = st.st_size,
+    };
+    return true;
+}
+
+void easm_cache_release(Easm_Cache_Entry *entry)
+{
+    munmap(entry->map, entry->map_size);
+    *entry = (Easm_Cache_Entry) {0};
+}
+
+typedef struct {
+    char name[256];
+    off_t size;
+    time_t mtime;
+} Cache_Entry;
+
+static int by_mtime(const void *a, const void *b)
+{
+    time_t ta = ((const Cache_Entry *) a)->mtime, tb = ((const Cache_Entry *) b)->mtime;
+    return (ta > tb) - (ta < tb);
+}
+
+/**Removes the least recently used entries until the directory fits EASM_CACHE_MAX_BYTES*/
+static void evict(const Easm_Cache *cache)
+{
+    DIR *dir = opendir(cache->dir);
+    if(dir == NULL) return;
+
+    Cache_Entry *entries = NULL;
+    size_t count = 0, capacity = 0;
+    unsigned long long total = 0;
+    char path[EASM_CACHE_PATH_MAX + 256];
+    struct dirent *ent;
+    while((ent = readdir(dir)) != NULL){
+        size_t len = strlen(ent->d_name);
+        if(len <= strlen(CACHE_EXT) || len >= sizeof(entries->name)) continue;
+        if(strcmp(ent->d_name + len - strlen(CACHE_EXT), CACHE_EXT) != 0) continue;
+        struct stat st;
+        snprintf(path, sizeof(path), "%s/%s", cache->dir, ent->d_name);
+        if(stat(path, &st) != 0) continue;
+        if(count == capacity){
+            capacity = capacity ? capacity * 2 : 64;
+            Cache_Entry *grown = realloc(entries, capacity * sizeof(*entries));
+            if(grown == NULL) break;
+            entries = grown;
+        }
+        memcpy(entries[count].name, ent->d_name, len + 1);
+        entries[count].size = st.st_size;
+        entries[count].mtime = st.st_mtime;
+        total += st.st_size;
+        count++;
+    }
+    closedir(dir);
+
+    if(total > EASM_CACHE_MAX_BYTES){
+        qsort(entries, count, sizeof(*entries), by_mtime);
+        for(size_t i = 0; i < count && total > EASM_CACHE_MAX_BYTES; ++i){
+            snprintf(path, sizeof(path), "%s/%s", cache->dir, entries[i].name);
+            if(unlink(path) == 0) total -= entries[i].size;
+        }
+    }
+    free(entries);
+}
+
+static bool write_all(int fd, const void *data, size_t size)
+{
+    const uint8_t *p = data;
+    size_t done = 0;
+    while(done < size){
+        ssize_t n = write(fd, p + done, size - done);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return false;
+        done += n;
+    }
+    return true;
+}
+
+void easm_cache_put(const Easm_Cache *cache, uint64_t key, const void *src, size_t src_size, uint32_t options,
+                    const void *image, size_t size)
+{
+    char path[EASM_CACHE_PATH_MAX + 32];
+    char tmp[EASM_CACHE_PATH_MAX + 64];
+    if(!cache->enabled || !entry_path(cache, key, path, sizeof(path))) return;
+    snprintf(tmp, sizeof(tmp), "%s.%ld.tmp", path, (long) getpid());
+
+    //readers never see a partial entry: the file only appears under its name once complete
+    int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return;
+    Cache_Header header = {.options = options, .source_size = src_size};
+    memcpy(header.magic, CACHE_MAGIC, sizeof(header.magic));
+    static const uint8_t pad[8] = {0};
+    bool ok = write_all(fd, &header, sizeof(header)) && write_all(fd, src, src_size)
+              && write_all(fd, pad, source_span(src_size) - src_size) && write_all(fd, image, size);
+    ok = close(fd) == 0 && ok;
+    if(!ok || rename(tmp, path) != 0){
+        unlink(tmp);
+        return;
+    }
+    evict(cache);
+}
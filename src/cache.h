@@ -0,0 +1,44 @@
+#ifndef CACHE_H_
+#define CACHE_H_
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <inttypes.h>
+
+/* Content-addressed cache of assembled program images.
+   An entry is named by the FNV-1a 64 hash of the assembler version, the options that change the
+   image and the source text, so a hit needs no tokenizing or code generation: the image is mapped
+   and handed to evm_load_image. The hash only finds the entry: each one also holds the options and
+   the full source it was built from, and a hit whose copy differs is a miss. Entries are written
+   to a temporary file and renamed into place, and the least recently used ones are evicted once
+   the directory exceeds EASM_CACHE_MAX_BYTES.
+   The directory is $EASM_CACHE_DIR, else $XDG_CACHE_HOME/easm, else $HOME/.cache/easm */
+
+#define EASM_CACHE_VERSION "easm 5"     /*bump when the generator output changes*/
+#define EASM_CACHE_MAX_BYTES (256ull * 1024 * 1024)
+#define EASM_CACHE_PATH_MAX (4096)
+
+typedef struct {
+    bool enabled;
+    char dir[EASM_CACHE_PATH_MAX];
+} Easm_Cache;
+
+typedef struct {
+    const void *image;
+    size_t size;
+    void *map;          /*the whole entry file*/
+    size_t map_size;
+} Easm_Cache_Entry;
+
+/**Resolves and creates the directory. A cache that cannot be opened stays disabled*/
+bool easm_cache_open(Easm_Cache *cache);
+uint64_t easm_cache_key(const void *src, size_t size, uint32_t options);
+/**Maps the entry for `key` read-only. False on a miss, including an entry built from another
+   source or with other options. Release a hit with easm_cache_release*/
+bool easm_cache_get(const Easm_Cache *cache, uint64_t key, const void *src, size_t src_size, uint32_t options,
+                    Easm_Cache_Entry *entry);
+void easm_cache_release(Easm_Cache_Entry *entry);
+void easm_cache_put(const Easm_Cache *cache, uint64_t key, const void *src, size_t src_size, uint32_t options,
+                    const void *image, size_t size);
+
+#endif //CACHE_H_
@@ -3,28 +3,59 @@
 #include <string.h>
 #include <assert.h>
 #include <errno.h>
+#include <ctype.h>
 
 #include <inttypes.h>
+#include <unistd.h>
 
 #define SV_IMPLEMENTATION
+#define ARENA_IMPLEMENTATION
 
 #include "sv.h"
+#include "arena.h"
 #include "evm.h"
+#include "perf.h"
+#include "loop.h"
+#include "cache.h"
+#include "pgo.h"
+#include "batch.h"
+#include "metrics.h"
 
 #define EASM_COMMENT ";"
+#define EASM_ASYNC_SLICE (4096) //instructions a VM runs before the loop moves on
 
 char *easm_instrunctions[] = {
     "push", "dup", "swap", 
     "add", "sub","multu", 
     "printu64", "halt", 
-    "jp", "jpc", "jc", 
-    "jcr", "eq" ,"gt", 
+    "jp", "jpc", "jr", 
+    "jrc", "eq" ,"gt", 
     "ge", "lt", "le", 
     "write8", "write64", 
     "read8","read64", "puts",
-    "call", "ret",
+    "call", "ret", "native",
+    "mulw", "addc", "divu", "modu",
+    "vadd", "vmul", "vsum",
+    "fdread", "fdwrite",
+    "spawn", "join", "aload", "astore", "cas", "fadd",
+    "alloc", "free", "realloc",
+    "enter", "leave", "load_local", "store_local",
 };
 
+//Data directives, they fill the data segment instead of emitting instructions
+char *easm_directives[] = {
+    "db", "dq", "string", "reserve",
+};
+
+int is_easm_directive(Sv name)
+{
+    for(size_t i = 0; i < ARRAY_LEN(easm_directives); ++i){
+        if(sv_eq(name, sv_from_cstr(easm_directives[i]))) return true;
+    }
+
+    return false;
+}
+
 int is_easm_opcode(Sv name) 
 {
     for(size_t i = 0; i < ARRAY_LEN(easm_instrunctions); ++i){
@@ -49,7 +80,9 @@ typedef struct {
         int64_t offset;
         uint64_t address;
         Sv label;
+        Sv bytes;       //contents of db/dq/string, allocated in the arena
     } get;
+    bool label_operand; //`push <label>`, `jr <label>` or `jrc <label>`, the operand is in get.label
     const char *filepath;
     size_t row;
     size_t col;
@@ -68,6 +101,12 @@ typedef struct {
     size_t capacity;
 } Indices;
 
+typedef struct {
+    Evm_Rel_Reloc *items;
+    size_t size;
+    size_t capacity;
+} Rel_Relocs;
+
 typedef struct {
     Sv *items;
     size_t size;
@@ -100,10 +139,96 @@ static void log_error_and_exit(const char *msg, const char *filepath, size_t row
     fprintf(stderr, "%s:%zu:%zu %s\n", filepath, row, col, msg);
     exit(1);
 }
+static size_t count_lines(Sv src)
+{
+    size_t lines = 1;
+    const char *end = src.data + src.size;
+    for(const char *p = src.data; (p = memchr(p, '\n', end - p)) != NULL; ++p) lines++;
+    return lines;
+}
+
+/**Upper bound of the arena space the assembler needs for `src`: one token per line,
+  at most four program words per token (jpc) and one label/fixup record per token*/
+size_t easm_arena_estimate(Sv src)
+{
+    size_t lines = count_lines(src);
+    return lines * (3 * sizeof(Easm_Token) + 4 * sizeof(Evm_Inst) + sizeof(size_t)) + 16 * sizeof(max_align_t);
+}
+
+/**Parses `v, v, ...` into `width` byte little-endian values allocated in the arena*/
+static Sv parse_values(Arena *arena, Sv *line, size_t width, const char *filepath, size_t row, const char *line_start)
+{
+    size_t commas = 0;
+    for(size_t i = 0; i < line->size; ++i) commas += line->data[i] == ',';
+    uint8_t *bytes = arena_alloc(arena, (commas + 1) * width);
+    size_t size = 0;
+    while(true){
+        sv_trim_left(line);
+        char *end;
+        uint64_t value = strtoull(line->data, &end, 0);
+        if(line->size == 0 || end == line->data){
+            log_error_and_exit("tokenizer: Expected a numeric value", filepath, row, line->data - line_start + 1);
+        }
+        if(width == 1 && value > UINT8_MAX){
+            log_error_and_exit("tokenizer: Value does not fit in a byte", filepath, row, line->data - line_start + 1);
+        }
+        for(size_t i = 0; i < width; ++i) bytes[size++] = (uint8_t) (value >> (8 * i));
+        sv_take(line, end - line->data);
+        sv_trim_left(line);
+        if(line->size == 0 || *line->data != ',') break;
+        sv_take(line, 1);
+    }
+    return sv_from_parts((const char *) bytes, size);
+}
+
+/**Parses a double quoted string with \n \t \r \0 \\ \" and \xNN escapes. No terminator is added*/
+static Sv parse_string(Arena *arena, Sv *line, const char *filepath, size_t row, const char *line_start)
+{
+    if(line->size == 0 || *line->data != '"'){
+        log_error_and_exit("tokenizer: Expected a string", filepath, row, line->data - line_start + 1);
+    }
+    sv_take(line, 1);
+    char *bytes = arena_alloc(arena, line->size + 1);
+    size_t size = 0;
+    while(line->size > 0 && *line->data != '"'){
+        char c = *line->data;
+        sv_take(line, 1);
+        if(c == '\\' && line->size > 0){
+            char e = *line->data;
+            sv_take(line, 1);
+            switch(e){
+                case 'n': c = '\n'; break;
+                case 't': c = '\t'; break;
+                case 'r': c = '\r'; break;
+                case '0': c = '\0'; break;
+                case '\\': c = '\\'; break;
+                case '"': c = '"'; break;
+                case 'x': {
+                    char hex[3] = {0};
+                    for(size_t i = 0; i < 2 && line->size > 0 && isxdigit((unsigned char) *line->data); ++i){
+                        hex[i] = *line->data;
+                        sv_take(line, 1);
+                    }
+                    if(hex[0] == '\0') log_error_and_exit("tokenizer: Expected hex digits after \\x", filepath, row, line->data - line_start + 1);
+                    c = (char) strtoul(hex, NULL, 16);
+                }
+                break;
+                default:
+                    log_error_and_exit("tokenizer: Unknown escape sequence", filepath, row, line->data - line_start);
+            }
+        }
+        bytes[size++] = c;
+    }
+    if(line->size == 0) log_error_and_exit("tokenizer: Unterminated string", filepath, row, line->data - line_start + 1);
+    sv_take(line, 1);
+    return sv_from_parts(bytes, size);
+}
+
 //TODO: Add a string builder for better error reports building
-void easm_tokenize(Sv src, Easm_Tokens *tokens, const char *filepath) 
+void easm_tokenize(Arena *arena, Sv src, Easm_Tokens *tokens, const char *filepath) 
 {
     if(tokens == NULL) return;
+    arena_da_reserve(arena, tokens, count_lines(src));
     size_t row = 0;
     const char *line_start = NULL;
     while(src.size > 0) {
@@ -124,23 +249,48 @@ void easm_tokenize(Sv src, Easm_Tokens *tokens, const char *filepath)
             token.name = opcode;
             //Instructions with opernads
             if(sv_eq(opcode, sv_from_cstr("push")) || sv_eq(opcode, sv_from_cstr("dup")) ||
+            sv_eq(opcode, sv_from_cstr("native")) ||
+            sv_eq(opcode, sv_from_cstr("enter")) ||
+            sv_eq(opcode, sv_from_cstr("load_local")) ||
+            sv_eq(opcode, sv_from_cstr("store_local")) ||
             sv_eq(opcode, sv_from_cstr("jr")) ||
             sv_eq(opcode, sv_from_cstr("jrc"))){
 
                 uint64_t num_operand;
                 Sv operand = sv_chop_left(&line);
                 expect_comment_or_empty(line, filepath, row, line.data - line_start);
-                if(!strtou64(operand.data, &num_operand)){
+                if(strtou64(operand.data, &num_operand)){
+                    token.get.data = num_operand;
+                } else if((sv_eq(opcode, sv_from_cstr("push")) || sv_eq(opcode, sv_from_cstr("jr")) ||
+                           sv_eq(opcode, sv_from_cstr("jrc"))) &&
+                          operand.size > 0 && !isdigit((unsigned char) *operand.data)){
+                    token.label_operand = true;
+                    token.get.label = operand;
+                } else {
                     log_error_and_exit("tokenizer: Expected a numeric operand", filepath, row, operand.data - line_start + 1);
-                } 
-                token.get.data = num_operand; 
+                }
             } else if ( sv_eq(opcode, sv_from_cstr("jp"))   ||
                         sv_eq(opcode, sv_from_cstr("jpc"))  ||
-                        sv_eq(opcode, sv_from_cstr("call"))) {
+                        sv_eq(opcode, sv_from_cstr("call")) ||
+                        sv_eq(opcode, sv_from_cstr("spawn"))) {
                             
                 token.get.label = sv_chop_left(&line);
                 expect_comment_or_empty(line, filepath, row, line.data - line_start);
             } 
+        } else if(is_easm_directive(opcode)){
+            token.type = EASM_TYPE_BYTES;
+            token.name = opcode;
+            if(sv_eq(opcode, sv_from_cstr("reserve"))){
+                Sv operand = sv_chop_left(&line);
+                if(!strtou64(operand.data, &token.get.data)){
+                    log_error_and_exit("tokenizer: Expected a numeric operand", filepath, row, operand.data - line_start + 1);
+                }
+            } else if(sv_eq(opcode, sv_from_cstr("string"))){
+                token.get.bytes = parse_string(arena, &line, filepath, row, line_start);
+            } else {
+                size_t width = sv_eq(opcode, sv_from_cstr("dq")) ? sizeof(uint64_t) : 1;
+                token.get.bytes = parse_values(arena, &line, width, filepath, row, line_start);
+            }
         } else if (sv_ends_with(opcode, sv_from_cstr(":"))){
             if(opcode.size < 2) log_error_and_exit("tokeniner: Unexpected empty label", token.filepath, token.row, token.col);
             opcode.size--;
@@ -157,86 +307,200 @@ void easm_tokenize(Sv src, Easm_Tokens *tokens, const char *filepath)
         //Handling comments after instructions
         sv_trim_left(&line);
         expect_comment_or_empty(line, filepath, row, line.data - line_start + 1);
-        da_append(tokens, token);
+        arena_da_append(arena, tokens, token);
     }
 }
 
-//Tokens here must be all corresponding to instructions
-void easm_generate(Easm_Tokens tokens, Evm_Insts *program)
+/**A label names the data address of a following directive or the code address of a following
+  instruction, never both. The end of data is named by a label in front of `reserve 0`, one at the
+  end of the file belongs to the segment before it. Labels in front of dq are aligned*/
+static void place_label(Arena *arena, Easm_Token label, Easm_Token *next, bool after_data, Evm_Insts *program,
+                        Evm_Segment *data, Easm_Tokens *labels, Easm_Tokens *data_labels)
+{
+    bool next_data = next != NULL && next->type == EASM_TYPE_BYTES;
+    if(next_data && sv_eq(next->name, sv_from_cstr("dq"))){
+        while(data->size % sizeof(uint64_t) != 0) arena_da_append(arena, data, 0);
+    }
+    if(next_data || (next == NULL && after_data)){
+        label.get.address = data->size;
+        arena_da_append(arena, data_labels, label);
+    } else {
+        label.get.address = program->size;
+        arena_da_append(arena, labels, label);
+    }
+}
+
+#define EASM_ABSOLUTE SIZE_MAX //base of a label reference that takes the address itself
+
+/**Emits `push <label>` (or `pushr` with a relative base) with a placeholder for the second pass.
+  `base` is the word a relative operand is measured from: the one after the instruction consuming it*/
+static void emit_label_ref(Arena *arena, Easm_Token token, Evm_Opcode push, size_t base, Evm_Insts *program,
+                           Easm_Tokens *names, Indices *unresolved, Indices *bases)
+{
+    arena_da_append(arena, names, token);
+    arena_da_append(arena, unresolved, program->size + 1);
+    arena_da_append(arena, bases, base);
+    arena_da_append(arena, program, push);
+    arena_da_append(arena, program, UINT32_MAX); //placeholder (check it later)
+}
+
+//Tokens here must be all corresponding to instructions or data directives
+//`relocs` receives the indices of the program words that hold code addresses, `rel_relocs` the
+//ones that hold code distances, `data` the data segment that is loaded at address 0.
+//With `pic` jumps, calls and code addresses are all relative to the instruction using them
+void easm_generate(Arena *arena, Easm_Tokens tokens, bool pic, Evm_Insts *program, Evm_Segment *data,
+                   Indices *relocs, Rel_Relocs *rel_relocs)
 {
     Easm_Tokens labels = {0};
+    Easm_Tokens data_labels = {0};
     Indices unresolved = {0};
+    Indices bases = {0};
     Easm_Tokens names = {0};
+    Indices code_relocs = {0};
+    Rel_Relocs code_rel_relocs = {0};
+    bool in_data = false;
+    arena_da_reserve(arena, program, 4 * tokens.size);
+    arena_da_reserve(arena, &labels, tokens.size);
+    arena_da_reserve(arena, &data_labels, tokens.size);
+    arena_da_reserve(arena, &unresolved, tokens.size);
+    arena_da_reserve(arena, &bases, tokens.size);
+    arena_da_reserve(arena, &names, tokens.size);
+    arena_da_reserve(arena, &code_relocs, tokens.size);
+    arena_da_reserve(arena, &code_rel_relocs, tokens.size);
     
     for(size_t i = 0; i < tokens.size ; ++i){
         //printf(SV_FMT"\n", SV_ARG(tokens.items[i].name));
         Easm_Token token = tokens.items[i];
         switch(token.type){
             case EASM_TYPE_INST:{
-                if(sv_eq(token.name, sv_from_cstr("push"))){
-                    da_append(program, EVM_INST_PUSH);
-                    da_append(program, token.get.data);
+                in_data = false;
+                size_t at = program->size;
+                if(sv_eq(token.name, sv_from_cstr("push")) && token.label_operand){
+                    if(pic) emit_label_ref(arena, token, EVM_INST_PUSHR, at + 2, program, &names, &unresolved, &bases);
+                    else emit_label_ref(arena, token, EVM_INST_PUSH, EASM_ABSOLUTE, program, &names, &unresolved, &bases);
+                } else if(sv_eq(token.name, sv_from_cstr("push"))){
+                    arena_da_append(arena, program, EVM_INST_PUSH);
+                    arena_da_append(arena, program, token.get.data);
                 } else if(sv_eq(token.name, sv_from_cstr("dup"))) {
-                    da_append(program, EVM_INST_DUP);
-                    da_append(program, token.get.data);
+                    arena_da_append(arena, program, EVM_INST_DUP);
+                    arena_da_append(arena, program, token.get.data);
                 } else if(sv_eq(token.name, sv_from_cstr("swap"))) {
-                    da_append(program, EVM_INST_SWAP);
+                    arena_da_append(arena, program, EVM_INST_SWAP);
                     
                 } else if(sv_eq(token.name, sv_from_cstr("add"))) {
-                    da_append(program, EVM_INST_ADD);
+                    arena_da_append(arena, program, EVM_INST_ADD);
                 } else if(sv_eq(token.name, sv_from_cstr("sub"))) {
-                    da_append(program, EVM_INST_SUB);
+                    arena_da_append(arena, program, EVM_INST_SUB);
                 } else if(sv_eq(token.name, sv_from_cstr("multu"))) {
-                    da_append(program, EVM_INST_MULTU);
+                    arena_da_append(arena, program, EVM_INST_MULTU);
                 } else if(sv_eq(token.name, sv_from_cstr("eq"))) {
-                    da_append(program, EVM_INST_EQ);
+                    arena_da_append(arena, program, EVM_INST_EQ);
                 }  else if(sv_eq(token.name, sv_from_cstr("gt"))) {
-                    da_append(program, EVM_INST_GT);
+                    arena_da_append(arena, program, EVM_INST_GT);
                 }  else if(sv_eq(token.name, sv_from_cstr("ge"))) {
-                    da_append(program, EVM_INST_GE);
+                    arena_da_append(arena, program, EVM_INST_GE);
                 } else if(sv_eq(token.name, sv_from_cstr("lt"))) {
-                    da_append(program, EVM_INST_LT);
+                    arena_da_append(arena, program, EVM_INST_LT);
                 }  else if(sv_eq(token.name, sv_from_cstr("le"))) {
-                    da_append(program, EVM_INST_LE);
+                    arena_da_append(arena, program, EVM_INST_LE);
                 } else if(sv_eq(token.name, sv_from_cstr("printu64"))) {
-                    da_append(program, EVM_INST_PRINTU);
+                    arena_da_append(arena, program, EVM_INST_PRINTU);
                 } else if(sv_eq(token.name, sv_from_cstr("ret"))) {
-                    da_append(program, EVM_INST_RET);
+                    arena_da_append(arena, program, EVM_INST_RET);
                 } else if ( sv_eq(token.name, sv_from_cstr("call"))){
-                    da_append(&names, token);
-                    da_append(&unresolved, program->size + 1);
-                    da_append(program, EVM_INST_PUSH);
-                    da_append(program, UINT32_MAX); //placeholder (check it later)
-                    da_append(program, EVM_INST_CALL);
-                } else if ( sv_eq(token.name, sv_from_cstr("jp"))){
-                    da_append(&names, token);
-                    da_append(&unresolved, program->size + 1);
-                    da_append(program, EVM_INST_PUSH);
-                    da_append(program, UINT32_MAX); //placeholder (check it later)
-                    da_append(program, EVM_INST_JP);
-                } else if ( sv_eq(token.name, sv_from_cstr("jpc"))){
-                    da_append(&names, token);
-                    da_append(&unresolved, program->size + 1);
-                    da_append(program, EVM_INST_PUSH);
-                    da_append(program, UINT32_MAX); //placeholder (check it later)
-                    da_append(program, EVM_INST_SWAP);
-                    da_append(program, EVM_INST_JPC);
-                } else if ( sv_eq(token.name, sv_from_cstr("jr"))){
-                    UNIMPLEMENTED;
-                } else if ( sv_eq(token.name, sv_from_cstr("jrc"))){
-                    UNIMPLEMENTED;
+                    emit_label_ref(arena, token, EVM_INST_PUSH, pic ? at + 3 : EASM_ABSOLUTE, program, &names, &unresolved, &bases);
+                    arena_da_append(arena, program, pic ? EVM_INST_CALLR : EVM_INST_CALL);
+                } else if ( sv_eq(token.name, sv_from_cstr("spawn"))){
+                    if(pic) emit_label_ref(arena, token, EVM_INST_PUSHR, at + 2, program, &names, &unresolved, &bases);
+                    else emit_label_ref(arena, token, EVM_INST_PUSH, EASM_ABSOLUTE, program, &names, &unresolved, &bases);
+                    arena_da_append(arena, program, EVM_INST_SPAWN);
+                } else if ( sv_eq(token.name, sv_from_cstr("jp")) && !pic){
+                    emit_label_ref(arena, token, EVM_INST_PUSH, EASM_ABSOLUTE, program, &names, &unresolved, &bases);
+                    arena_da_append(arena, program, EVM_INST_JP);
+                } else if ( sv_eq(token.name, sv_from_cstr("jpc")) && !pic){
+                    emit_label_ref(arena, token, EVM_INST_PUSH, EASM_ABSOLUTE, program, &names, &unresolved, &bases);
+                    arena_da_append(arena, program, EVM_INST_SWAP);
+                    arena_da_append(arena, program, EVM_INST_JPC);
+                } else if ( sv_eq(token.name, sv_from_cstr("jp")) || sv_eq(token.name, sv_from_cstr("jr"))){
+                    //the offset counts words from the instruction after jr
+                    if(token.label_operand || sv_eq(token.name, sv_from_cstr("jp"))){
+                        emit_label_ref(arena, token, EVM_INST_PUSH, at + 3, program, &names, &unresolved, &bases);
+                    } else {
+                        arena_da_append(arena, &code_rel_relocs, ((Evm_Rel_Reloc) {.index = at + 1, .base = at + 3}));
+                        arena_da_append(arena, program, EVM_INST_PUSH);
+                        arena_da_append(arena, program, token.get.data);
+                    }
+                    arena_da_append(arena, program, EVM_INST_JR);
+                } else if ( sv_eq(token.name, sv_from_cstr("jpc")) || sv_eq(token.name, sv_from_cstr("jrc"))){
+                    if(token.label_operand || sv_eq(token.name, sv_from_cstr("jpc"))){
+                        emit_label_ref(arena, token, EVM_INST_PUSH, at + 4, program, &names, &unresolved, &bases);
+                    } else {
+                        arena_da_append(arena, &code_rel_relocs, ((Evm_Rel_Reloc) {.index = at + 1, .base = at + 4}));
+                        arena_da_append(arena, program, EVM_INST_PUSH);
+                        arena_da_append(arena, program, token.get.data);
+                    }
+                    arena_da_append(arena, program, EVM_INST_SWAP);
+                    arena_da_append(arena, program, EVM_INST_JRC);
                 } else if(sv_eq(token.name, sv_from_cstr("puts"))) {
-                    da_append(program, EVM_INST_PUTS);
+                    arena_da_append(arena, program, EVM_INST_PUTS);
                 } else if(sv_eq(token.name, sv_from_cstr("write8"))) {
-                    da_append(program, EVM_INST_WRITE8);
+                    arena_da_append(arena, program, EVM_INST_WRITE8);
                 }else if(sv_eq(token.name, sv_from_cstr("write64"))) {
-                    da_append(program, EVM_INST_WRITE64);
+                    arena_da_append(arena, program, EVM_INST_WRITE64);
                 }  else if(sv_eq(token.name, sv_from_cstr("read8"))) {
-                    da_append(program, EVM_INST_READ8);
+                    arena_da_append(arena, program, EVM_INST_READ8);
                 } else if(sv_eq(token.name, sv_from_cstr("read64"))) {
-                    da_append(program, EVM_INST_READ64);
+                    arena_da_append(arena, program, EVM_INST_READ64);
                 } else if(sv_eq(token.name, sv_from_cstr("halt"))) {
-                    da_append(program, EVM_INST_HALT);
+                    arena_da_append(arena, program, EVM_INST_HALT);
+                } else if(sv_eq(token.name, sv_from_cstr("mulw"))) {
+                    arena_da_append(arena, program, EVM_INST_MULW);
+                } else if(sv_eq(token.name, sv_from_cstr("addc"))) {
+                    arena_da_append(arena, program, EVM_INST_ADDC);
+                } else if(sv_eq(token.name, sv_from_cstr("divu"))) {
+                    arena_da_append(arena, program, EVM_INST_DIVU);
+                } else if(sv_eq(token.name, sv_from_cstr("modu"))) {
+                    arena_da_append(arena, program, EVM_INST_MODU);
+                } else if(sv_eq(token.name, sv_from_cstr("vadd"))) {
+                    arena_da_append(arena, program, EVM_INST_VADD);
+                } else if(sv_eq(token.name, sv_from_cstr("vmul"))) {
+                    arena_da_append(arena, program, EVM_INST_VMUL);
+                } else if(sv_eq(token.name, sv_from_cstr("vsum"))) {
+                    arena_da_append(arena, program, EVM_INST_VSUM);
+                } else if(sv_eq(token.name, sv_from_cstr("fdread"))) {
+                    arena_da_append(arena, program, EVM_INST_FDREAD);
+                } else if(sv_eq(token.name, sv_from_cstr("fdwrite"))) {
+                    arena_da_append(arena, program, EVM_INST_FDWRITE);
+                } else if(sv_eq(token.name, sv_from_cstr("join"))) {
+                    arena_da_append(arena, program, EVM_INST_JOIN);
+                } else if(sv_eq(token.name, sv_from_cstr("aload"))) {
+                    arena_da_append(arena, program, EVM_INST_ALOAD);
+                } else if(sv_eq(token.name, sv_from_cstr("astore"))) {
+                    arena_da_append(arena, program, EVM_INST_ASTORE);
+                } else if(sv_eq(token.name, sv_from_cstr("cas"))) {
+                    arena_da_append(arena, program, EVM_INST_CAS);
+                } else if(sv_eq(token.name, sv_from_cstr("fadd"))) {
+                    arena_da_append(arena, program, EVM_INST_FADD);
+                } else if(sv_eq(token.name, sv_from_cstr("alloc"))) {
+                    arena_da_append(arena, program, EVM_INST_ALLOC);
+                } else if(sv_eq(token.name, sv_from_cstr("free"))) {
+                    arena_da_append(arena, program, EVM_INST_FREE);
+                } else if(sv_eq(token.name, sv_from_cstr("realloc"))) {
+                    arena_da_append(arena, program, EVM_INST_REALLOC);
+                } else if(sv_eq(token.name, sv_from_cstr("enter"))) {
+                    arena_da_append(arena, program, EVM_INST_ENTER);
+                    arena_da_append(arena, program, token.get.data);
+                } else if(sv_eq(token.name, sv_from_cstr("leave"))) {
+                    arena_da_append(arena, program, EVM_INST_LEAVE);
+                } else if(sv_eq(token.name, sv_from_cstr("load_local"))) {
+                    arena_da_append(arena, program, EVM_INST_LOAD_LOCAL);
+                    arena_da_append(arena, program, token.get.data);
+                } else if(sv_eq(token.name, sv_from_cstr("store_local"))) {
+                    arena_da_append(arena, program, EVM_INST_STORE_LOCAL);
+                    arena_da_append(arena, program, token.get.data);
+                } else if(sv_eq(token.name, sv_from_cstr("native"))) {
+                    arena_da_append(arena, program, EVM_INST_NATIVE);
+                    arena_da_append(arena, program, token.get.data);
                 } else {
                     char message[1024] = {0};
                     char *start = "generator: Unknown opcode: ";
@@ -248,9 +512,26 @@ void easm_generate(Easm_Tokens tokens, Evm_Insts *program)
             } 
             break;
             case EASM_TYPE_LABEL: {
-                token.get.address = program->size;
-                da_append(&labels, token);
-                //printf("%zu\n", token.get.address);
+                size_t next = i + 1;
+                while(next < tokens.size && tokens.items[next].type == EASM_TYPE_LABEL) next++;
+                place_label(arena, token, next < tokens.size ? &tokens.items[next] : NULL, in_data,
+                            program, data, &labels, &data_labels);
+            }
+            break;
+            case EASM_TYPE_BYTES: {
+                bool reserve = sv_eq(token.name, sv_from_cstr("reserve"));
+                size_t n = reserve ? token.get.data : token.get.bytes.size;
+                if(sv_eq(token.name, sv_from_cstr("dq"))){
+                    while(data->size % sizeof(uint64_t) != 0) arena_da_append(arena, data, 0);
+                }
+                if(n > EVM_MEM_CAP - data->size){
+                    log_error_and_exit("generator: Data segment does not fit in the VM memory", token.filepath, token.row, token.col);
+                }
+                arena_da_reserve(arena, data, n);
+                if(reserve) memset(data->items + data->size, 0, n);
+                else memcpy(data->items + data->size, token.get.bytes.data, n);
+                data->size += n;
+                in_data = true;
             }
             break;
             default:{
@@ -262,16 +543,34 @@ void easm_generate(Easm_Tokens tokens, Evm_Insts *program)
     //Second pass
     for(size_t i = 0; i < unresolved.size; ++i){
         size_t replacement_idx = unresolved.items[i];
+        size_t base = bases.items[i];
         Easm_Token token = names.items[i]; // for name and localtion
         
         assert(program->items[replacement_idx] == UINT32_MAX); 
         bool found = false;
-        for(size_t j = 0; j < labels.size; ++j){
+        //data addresses are plain numbers, they are not relocated by the compact encoding
+        bool push = sv_eq(token.name, sv_from_cstr("push"));
+        for(size_t j = 0; push && token.label_operand && j < data_labels.size; ++j){
+            Easm_Token label = data_labels.items[j];
+            if(sv_eq(token.get.label, label.name)){
+                found = true;
+                program->items[replacement_idx - 1] = EVM_INST_PUSH; //data does not move with the code
+                program->items[replacement_idx] = label.get.address;
+                break;
+            }
+        }
+        for(size_t j = 0; !found && j < labels.size; ++j){
             Easm_Token label = labels.items[j];
             assert(label.type == EASM_TYPE_LABEL); 
             if(sv_eq(token.get.label, label.name)){
                 found = true;
-                program->items[replacement_idx] = label.get.address;
+                if(base == EASM_ABSOLUTE){
+                    program->items[replacement_idx] = label.get.address;
+                    arena_da_append(arena, &code_relocs, replacement_idx);
+                } else {
+                    program->items[replacement_idx] = label.get.address - base;
+                    arena_da_append(arena, &code_rel_relocs, ((Evm_Rel_Reloc) {.index = replacement_idx, .base = base}));
+                }
                 break;
             }
         }
@@ -281,9 +580,8 @@ void easm_generate(Easm_Tokens tokens, Evm_Insts *program)
         } 
     }
 
-    free(labels.items);
-    free(unresolved.items);
-    free(names.items);
+    if(relocs) *relocs = code_relocs;
+    if(rel_relocs) *rel_relocs = code_rel_relocs;
 }
 
 // Helpers
@@ -296,8 +594,8 @@ char *shift_args(int *argc, char ***argv){
 }
 
 
-/**allocates memory and returns the content of the file, returning the pointer to the memory*/
-Sv slurp_file(const char *filepath)
+/**allocates memory in the arena and returns the content of the file*/
+Sv slurp_file(Arena *arena, const char *filepath)
 {
     FILE *f = fopen(filepath, "r");
 
@@ -315,7 +613,7 @@ Sv slurp_file(const char *filepath)
     }
 
     fseek(f, 0, SEEK_SET);
-    char *data = malloc(n + 1);
+    char *data = arena_alloc(arena, n + 1);
     data[n] = '\0';
     assert(data != NULL);
 
@@ -329,32 +627,425 @@ Sv slurp_file(const char *filepath)
     return sv_from_parts(data, n);
 }
 
+void write_image(const char *filepath, const void *image, size_t size)
+{
+    FILE *f = fopen(filepath, "wb");
+    if(f == NULL || fwrite(image, size, 1, f) != 1){
+        fprintf(stderr, "Could not write image %s: %s\n", filepath, strerror(errno));
+        exit(1);
+    }
+    fclose(f);
+}
+
+/**Rewrites the program with the profile recorded by `--profile-out` from the same source*/
+static void apply_profile(Arena *arena, const char *filepath, Sv src, const char *profile, Evm_Insts *program, Indices *relocs)
+{
+    uint64_t *counts = evm_pgo_load(profile, easm_cache_key(src.data, src.size, 0), program->size);
+    if(counts == NULL){
+        fprintf(stderr, "%s: %s is not a profile of this source\n", filepath, profile);
+        exit(1);
+    }
+    Evm_Insts optimized;
+    size_t *opt_relocs;
+    size_t opt_relocs_count;
+    Evm_Pgo_Stats stats;
+    bool ok = evm_pgo_optimize(*program, relocs->items, relocs->size, counts,
+                               &optimized, &opt_relocs, &opt_relocs_count, &stats);
+    free(counts);
+    if(!ok){
+        fprintf(stderr, "%s: the profile could not be applied, the program is left as is\n", filepath);
+        return;
+    }
+    fprintf(stderr, "%s: pgo blocks=%zu inlined=%zu jumps_removed=%zu jumps_added=%zu insts_before=%" PRIu64
+            " insts_predicted=%" PRIu64 "\n", filepath, stats.blocks, stats.inlined, stats.jumps_removed,
+            stats.jumps_added, stats.insts_before, stats.insts_after);
+
+    program->items = arena_alloc(arena, optimized.size * sizeof(*program->items));
+    memcpy(program->items, optimized.items, optimized.size * sizeof(*program->items));
+    program->size = program->capacity = optimized.size;
+    relocs->items = arena_alloc(arena, opt_relocs_count * sizeof(*relocs->items) + 1);
+    memcpy(relocs->items, opt_relocs, opt_relocs_count * sizeof(*relocs->items));
+    relocs->size = relocs->capacity = opt_relocs_count;
+    free(optimized.items);
+    free(opt_relocs);
+}
+
+/**Assembles one source file for the image `flags`. The program lives in the arena, compact code
+   (if asked for) on the heap. `profile`, if not NULL, is applied before encoding*/
+void assemble(Arena *arena, const char *filepath, Sv src, uint32_t flags, const char *profile,
+              Evm_Insts *program, Evm_Bytecode *code, Evm_Segment *data)
+{
+    arena_reserve(arena, easm_arena_estimate(src));
+
+    Easm_Tokens easm_tokens = {0};
+    Indices relocs = {0};
+    Rel_Relocs rel_relocs = {0};
+    easm_tokenize(arena, src, &easm_tokens, filepath);
+    easm_generate(arena, easm_tokens, flags & EVM_IMAGE_PIC, program, data, &relocs, &rel_relocs);
+    if(profile != NULL) apply_profile(arena, filepath, src, profile, program, &relocs);
+
+    if((flags & EVM_IMAGE_COMPACT) &&
+       !evm_encode_compact_ex(*program, relocs.items, relocs.size, rel_relocs.items, rel_relocs.size, code)){
+        fprintf(stderr, "%s: could not encode the program as compact bytecode\n", filepath);
+        exit(1);
+    }
+}
+
+typedef struct {
+    const void *data;
+    size_t size;
+    bool mapped;    /*points into `entry`, released with easm_cache_release*/
+    Easm_Cache_Entry entry;
+    uint64_t source;    /*names the source in profiles, its cache key for the word encoding*/
+} Image;
+
+static bool image_usable(const void *data, size_t size)
+{
+    Evm_Image_Header header;
+    if(size < sizeof(header)) return false;
+    memcpy(&header, data, sizeof(header));
+    return memcmp(header.magic, EVM_IMAGE_MAGIC, sizeof(header.magic)) == 0 && header.version == EVM_IMAGE_VERSION;
+}
+
+/**The program image of `filepath`. Sources assembled before with the same options come from the cache,
+   unless a profile is applied*/
+Image build_image(Arena *arena, const Easm_Cache *cache, const char *filepath, uint32_t flags, const char *profile)
+{
+    Sv src = slurp_file(arena, filepath);
+    uint64_t key = easm_cache_key(src.data, src.size, flags);
+    Image image = {0};
+    image.source = easm_cache_key(src.data, src.size, 0);
+    if(profile == NULL && easm_cache_get(cache, key, src.data, src.size, flags, &image.entry)){
+        if(image_usable(image.entry.image, image.entry.size)){
+            image.data = image.entry.image;
+            image.size = image.entry.size;
+            image.mapped = true;
+            return image;
+        }
+        easm_cache_release(&image.entry);
+    }
+
+    Evm_Insts program = {0};
+    Evm_Bytecode code = {0};
+    Evm_Segment data = {0};
+    assemble(arena, filepath, src, flags, profile, &program, &code, &data);
+    bool compact = flags & EVM_IMAGE_COMPACT;
+    image.size = compact ? evm_write_compact_image_ex(code, data, flags, NULL, 0) : evm_write_image_ex(program, data, flags, NULL, 0);
+    void *buf = malloc(image.size);
+    assert(buf != NULL);
+    if(compact) evm_write_compact_image_ex(code, data, flags, buf, image.size);
+    else evm_write_image_ex(program, data, flags, buf, image.size);
+    free(code.items);
+
+    if(profile == NULL) easm_cache_put(cache, key, src.data, src.size, flags, buf, image.size);
+    image.data = buf;
+    return image;
+}
+
+void release_image(Image image)
+{
+    if(image.mapped) easm_cache_release(&image.entry);
+    else free((void *) image.data);
+}
+
+/**A VM that can reach stdin, stdout and stderr (handles 0, 1 and 2) and no other fd*/
+static Evm *create_evm(void)
+{
+    Evm *evm = evm_create(NULL);
+    if(evm == NULL || evm_register_fd(evm, 0, STDIN_FILENO) != EVM_ERR_OK
+       || evm_register_fd(evm, 1, STDOUT_FILENO) != EVM_ERR_OK || evm_register_fd(evm, 2, STDERR_FILENO) != EVM_ERR_OK){
+        fprintf(stderr, "Could not create a VM: out of memory\n");
+        exit(1);
+    }
+    return evm;
+}
+
+/**Builds the image of `filepath` and loads it into a new VM, exits on a malformed image.
+   `source` (if not NULL) receives Image.source*/
+Evm *load_program(Arena *arena, const Easm_Cache *cache, const char *filepath, uint32_t flags, const char *profile,
+                  uint64_t *source)
+{
+    Image image = build_image(arena, cache, filepath, flags, profile);
+    Evm *evm = create_evm();
+    Evm_Err err = evm_load_image(evm, image.data, image.size);
+    release_image(image);
+    if(err != EVM_ERR_OK){
+        fprintf(stderr, "%s: could not load the program: %s\n", filepath, evm_err_to_str(err));
+        exit(1);
+    }
+    if(source != NULL) *source = image.source;
+    return evm;
+}
+
+typedef struct {
+    Evm *evm;   /*its evm_user points back here*/
+    const char *filepath;
+} Async_Vm;
+
+static void async_exit(Evm *evm, Evm_Err err, void *user)
+{
+    Async_Vm *vm = evm_user(evm);
+    if(err != EVM_ERR_OK){
+        fprintf(stderr, "%s: runtime error: %s at ip %zu\n", vm->filepath, evm_err_to_str(err), evm_ip(evm));
+        *(int *) user = 1;
+    }
+}
+
+/**Loads the PIC images of all `files` into one code region and attaches every VM to its part of it*/
+static Evm_Insts attach_region(Arena *arena, const Easm_Cache *cache, const char **files, size_t count, Async_Vm *vms)
+{
+    Evm_Insts region = {0};
+    Addr *entries = malloc(count * sizeof(*entries));
+    assert(entries != NULL);
+    for(size_t i = 0; i < count; ++i){
+        Image image = build_image(arena, cache, files[i], EVM_IMAGE_PIC, NULL);
+        const uint8_t *data;
+        size_t data_size;
+        Evm_Err err = evm_region_add(&region, image.data, image.size, &entries[i], &data, &data_size);
+        vms[i].evm = create_evm();
+        if(err == EVM_ERR_OK) err = evm_set_data(vms[i].evm, data, data_size);
+        release_image(image);
+        if(err != EVM_ERR_OK){
+            fprintf(stderr, "%s: could not load the program: %s\n", files[i], evm_err_to_str(err));
+            exit(1);
+        }
+    }
+    //only now the region stops moving
+    for(size_t i = 0; i < count; ++i) evm_attach(vms[i].evm, region, entries[i]);
+    free(entries);
+    return region;
+}
+
+static void attach_metrics(Evm_Metrics *metrics, Evm *evm, const char *filepath)
+{
+    if(!evm_metrics_attach(metrics, evm, filepath)){
+        fprintf(stderr, "%s: no free metrics slot, the run is not published\n", filepath);
+    }
+}
+
+/**Runs every file as its own VM on one event loop, the VMs interleave while waiting on I/O.
+   PIC programs all run from one shared code region*/
+int run_async(Arena *arena, const Easm_Cache *cache, const char **files, size_t count, bool tiered, uint32_t flags,
+              Evm_Metrics *metrics)
+{
+    int status = 0;
+    Evm_Loop *loop = evm_loop_create(EASM_ASYNC_SLICE, async_exit, &status);
+    Async_Vm *vms = calloc(count, sizeof(*vms));
+    if(loop == NULL || vms == NULL){
+        fprintf(stderr, "Could not create the event loop: %s\n", strerror(errno));
+        exit(1);
+    }
+
+    bool shared = (flags & EVM_IMAGE_PIC) && !(flags & EVM_IMAGE_COMPACT);
+    Evm_Insts region = {0};
+    if(shared) region = attach_region(arena, cache, files, count, vms);
+    for(size_t i = 0; i < count; ++i){
+        vms[i].filepath = files[i];
+        if(!shared) vms[i].evm = load_program(arena, cache, files[i], flags, NULL, NULL);
+        evm_set_user(vms[i].evm, &vms[i]);
+        evm_set_tiered(vms[i].evm, tiered);
+        if(metrics != NULL) attach_metrics(metrics, vms[i].evm, files[i]);
+        if(!evm_loop_add(loop, vms[i].evm)){
+            fprintf(stderr, "Could not add %s to the event loop\n", files[i]);
+            exit(1);
+        }
+    }
+
+    if(!evm_loop_run(loop)){
+        fprintf(stderr, "event loop failed: %s\n", strerror(errno));
+        status = 1;
+    }
+    evm_loop_destroy(loop);
+
+    for(size_t i = 0; i < count; ++i) evm_destroy(vms[i].evm);
+    free(vms);
+    free(region.items);
+    return status;
+}
+
+/**One line of key=value pairs, like the perf report*/
+static void report_heap(Evm *evm, const char *filepath)
+{
+    Evm_Heap_Stats st;
+    evm_heap_stats(evm, &st);
+    fprintf(stderr, "%s: heap allocs=%" PRIu64 " frees=%" PRIu64 " reallocs=%" PRIu64 " failed=%" PRIu64
+            " live_bytes=%" PRIu64 " peak_bytes=%" PRIu64 " requested_bytes=%" PRIu64 " free_bytes=%" PRIu64
+            " heap_bytes=%" PRIu64 " internal_frag=%.3f external_frag=%.3f\n",
+            filepath, st.allocs, st.frees, st.reallocs, st.failed, st.live_bytes, st.peak_bytes,
+            st.requested_bytes, st.free_bytes, st.heap_bytes,
+            st.live_bytes ? 1.0 - (double) st.requested_bytes / st.live_bytes : 0.0,
+            st.heap_bytes ? (double) st.free_bytes / st.heap_bytes : 0.0);
+}
+
+/**Runs `lanes` copies of the program in lockstep, lane i starting with i on its stack, and prints
+   the value every lane halted with*/
+static int run_batch(Arena *arena, const Easm_Cache *cache, const char *filepath, uint32_t flags, size_t lanes)
+{
+    Evm *evm = load_program(arena, cache, filepath, flags, NULL, NULL);
+    Evm_Batch *batch = evm_batch_create(evm_program(evm), evm_data(evm), lanes, 0);
+    Data *inputs = malloc(lanes * sizeof(*inputs));
+    Data *outputs = malloc(lanes * sizeof(*outputs));
+    Evm_Err *errs = malloc(lanes * sizeof(*errs));
+    if(batch == NULL || inputs == NULL || outputs == NULL || errs == NULL){
+        fprintf(stderr, "%s: could not create a batch of %zu lanes\n", filepath, lanes);
+        exit(1);
+    }
+    for(size_t l = 0; l < lanes; ++l) inputs[l] = l;
+    evm_batch_run(batch, inputs, outputs, errs, UINT64_MAX);
+
+    int status = 0;
+    for(size_t l = 0; l < lanes; ++l){
+        if(errs[l] == EVM_ERR_OK){
+            printf("%" PRIu64 "\n", outputs[l]);
+        } else {
+            fprintf(stderr, "%s: lane %zu: runtime error: %s\n", filepath, l, evm_err_to_str(errs[l]));
+            status = 1;
+        }
+    }
+    Evm_Batch_Stats st;
+    evm_batch_stats(batch, &st);
+    fprintf(stderr, "%s: batch lanes=%zu steps=%" PRIu64 " lane_insts=%" PRIu64 " simd_steps=%" PRIu64
+            " divergences=%" PRIu64 " reconvergences=%" PRIu64 " utilisation=%.3f\n", filepath, lanes, st.steps,
+            st.lane_insts, st.simd_steps, st.divergences, st.reconvergences,
+            st.steps ? (double) st.lane_insts / ((double) st.steps * lanes) : 0.0);
+    evm_batch_destroy(batch);
+    free(inputs);
+    free(outputs);
+    free(errs);
+    evm_destroy(evm);
+    return status;
+}
+
 int main(int argc, char **argv)
 {
     const char *program = shift_args(&argc, &argv);
-    if(argc < 1){
+    const char **files = malloc((argc + 1) * sizeof(*files));
+    size_t files_count = 0;
+    const char *output = NULL;
+    bool tiered = false;
+    bool compact = false;
+    bool pic = false;
+    bool perf_stats = false;
+    bool async = false;
+    bool use_cache = true;
+    bool heap_stats = false;
+    const char *profile_in = NULL;
+    const char *profile_out = NULL;
+    const char *metrics_path = NULL;
+    size_t lanes = 0;
+    assert(files != NULL);
+    while(argc > 0){
+        const char *arg = shift_args(&argc, &argv);
+        if(strcmp(arg, "--tiered") == 0) tiered = true;
+        else if(strcmp(arg, "--compact") == 0) compact = true;
+        else if(strcmp(arg, "--pic") == 0) pic = true;
+        else if(strcmp(arg, "--perf-stats") == 0) perf_stats = true;
+        else if(strcmp(arg, "--async") == 0) async = true;
+        else if(strcmp(arg, "--no-cache") == 0) use_cache = false;
+        else if(strcmp(arg, "--heap-stats") == 0) heap_stats = true;
+        else if(strcmp(arg, "-o") == 0 && argc > 0) output = shift_args(&argc, &argv);
+        else if(strcmp(arg, "--profile-in") == 0 && argc > 0) profile_in = shift_args(&argc, &argv);
+        else if(strcmp(arg, "--profile-out") == 0 && argc > 0) profile_out = shift_args(&argc, &argv);
+        else if(strcmp(arg, "--batch") == 0 && argc > 0) lanes = strtoull(shift_args(&argc, &argv), NULL, 0);
+        else if(strcmp(arg, "--metrics") == 0 && argc > 0) metrics_path = shift_args(&argc, &argv);
+        else files[files_count++] = arg;
+    }
+
+    bool profiling = profile_in != NULL || profile_out != NULL;
+    if(files_count == 0 || (!async && files_count > 1) || (async && (output != NULL || profiling))
+       || (profile_out != NULL && (compact || output != NULL || profile_in != NULL))
+       || (lanes > 0 && (async || compact || output != NULL || profiling || metrics_path != NULL))
+       || (metrics_path != NULL && output != NULL)){
         fprintf(stderr, "Usage:\n");
-        fprintf(stderr, "    %s <file>\n", program);
+        fprintf(stderr, "    %s [--tiered] [--compact] [--pic] [--perf-stats] [--heap-stats] [--no-cache] [--metrics <file>] [--profile-in <profile>] [-o <image>] <file>\n", program);
+        fprintf(stderr, "    %s --profile-out <profile> [--tiered] [--pic] [--no-cache] <file>\n", program);
+        fprintf(stderr, "    %s --async [--tiered] [--compact] [--pic] [--no-cache] [--metrics <file>] <file>...\n", program);
+        fprintf(stderr, "    %s --batch <lanes> [--pic] [--no-cache] <file>\n", program);
+        fprintf(stderr, "    --tiered    record hot loops and run them as specialized traces\n");
+        fprintf(stderr, "    --compact   encode the program as compact bytecode (1-byte opcodes, LEB128 immediates)\n");
+        fprintf(stderr, "    --pic       position independent code: relative jumps, calls and code addresses only.\n");
+        fprintf(stderr, "                with --async (and without --compact) all VMs share one code region\n");
+        fprintf(stderr, "    --perf-stats  report hardware counters for the run on stderr\n");
+        fprintf(stderr, "    --heap-stats  report alloc/free counts and heap fragmentation on stderr\n");
+        fprintf(stderr, "    --async     run every file as a VM on one event loop, I/O never blocks the others\n");
+        fprintf(stderr, "    --no-cache  always assemble, bypassing the cache of assembled images. Without it images\n");
+        fprintf(stderr, "                are cached in $EASM_CACHE_DIR (default ~/.cache/easm, empty disables)\n");
+        fprintf(stderr, "    --batch <lanes>  run the program once per lane in lockstep, lane i gets i on its stack.\n");
+        fprintf(stderr, "                     prints what every lane halted with, lane utilisation on stderr\n");
+        fprintf(stderr, "    --metrics <file>  publish live counters of every VM to <file>, read them with evmstat\n");
+        fprintf(stderr, "    -o <image>  write the assembled program image instead of running it\n");
+        fprintf(stderr, "    --profile-out <profile>  count the executions of every instruction word of the run\n");
+        fprintf(stderr, "    --profile-in <profile>   inline hot calls and lay out hot paths as fall throughs (not cached)\n");
         exit(1);
     }
-    
-    const char *filepath = shift_args(&argc, &argv);
-    Sv src = slurp_file(filepath);
-    
-    Addr heap_base = 0;
-    Easm_Tokens easm_tokens = {0};
-    Evm_Insts evm_program = {0};
-    easm_tokenize(src, &easm_tokens, filepath);
-    easm_generate(easm_tokens, &evm_program);// &heap_base);
+
+    Easm_Cache cache = {0};
+    if(use_cache) easm_cache_open(&cache);
+    uint32_t flags = (compact ? EVM_IMAGE_COMPACT : 0) | (pic ? EVM_IMAGE_PIC : 0);
+
+    Evm_Metrics *metrics = NULL;
+    if(metrics_path != NULL && (metrics = evm_metrics_create(metrics_path)) == NULL){
+        fprintf(stderr, "Could not create metrics file %s: %s\n", metrics_path, strerror(errno));
+        exit(1);
+    }
+
+    Arena arena = {0};
+    if(async){
+        int status = run_async(&arena, &cache, files, files_count, tiered, flags, metrics);
+        evm_metrics_close(metrics);
+        arena_free(&arena);
+        free(files);
+        return status;
+    }
+
+    const char *filepath = files[0];
+    free(files);
+
+    if(lanes > 0){
+        int status = run_batch(&arena, &cache, filepath, flags, lanes);
+        arena_free(&arena);
+        return status;
+    }
+
+    if(output != NULL){
+        Image image = build_image(&arena, &cache, filepath, flags, profile_in);
+        write_image(output, image.data, image.size);
+        release_image(image);
+        arena_free(&arena);
+        return 0;
+    }
 
     //Heap_base by default is 0
-    Evm evm = {0};
-    evm_init(&evm, evm_program);
-    evm_run(&evm);
-    evm_free(&evm);
-    free(evm_program.items);
-    free(easm_tokens.items);
-    free((char *) src.data);
-
-   return 0;
-}
\ No newline at end of file
+    uint64_t source;
+    Evm *evm = load_program(&arena, &cache, filepath, flags, profile_in, &source);
+    evm_set_tiered(evm, tiered);
+    if(metrics != NULL) attach_metrics(metrics, evm, filepath);
+    uint64_t *profile = NULL;
+    if(profile_out != NULL){
+        profile = calloc(evm_program(evm).size + 1, sizeof(*profile));
+        assert(profile != NULL);
+        evm_set_profile(evm, profile);
+    }
+    Evm_Perf perf;
+    if(perf_stats) evm_perf_begin(&perf);
+    Evm_Err err = evm_run_ex(evm);
+    if(perf_stats){
+        evm_perf_end(&perf);
+        evm_perf_report(&perf, filepath, evm_retired(evm) + evm_children_retired(evm), stderr);
+    }
+    if(heap_stats) report_heap(evm, filepath);
+    if(err != EVM_ERR_OK){
+        fprintf(stderr, "%s: runtime error: %s at ip %zu\n", filepath, evm_err_to_str(err), evm_ip(evm));
+    }
+    if(profile_out != NULL){
+        if(!evm_pgo_save(profile_out, source, profile, evm_program(evm).size)){
+            fprintf(stderr, "Could not write profile %s: %s\n", profile_out, strerror(errno));
+        }
+        free(profile);
+    }
+    evm_destroy(evm);
+    evm_metrics_close(metrics);
+    arena_free(&arena);
+
+   return err == EVM_ERR_OK ? 0 : 1;
+}
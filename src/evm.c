@@ -1,378 +1,2351 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <assert.h>
-#include <stdbool.h>
-
-#include <inttypes.h>
-#include "evm.h"
-
-char *inst_to_str[EVM_INST_COUNT] = {
-    [EVM_INST_PUSH]    = "EVM_INST_PUSH",
-    [EVM_INST_DUP]     = "EVM_INST_DUP",
-    [EVM_INST_SWAP]    = "EVM_INST_SWAP",
-    [EVM_INST_ADD]    = "EVM_INST_ADD",
-    [EVM_INST_SUB]    = "EVM_INST_SUB",
-    [EVM_INST_MULTU]   = "EVM_INST_MULTU",
-    [EVM_INST_GT]      = "EVM_INST_GT",
-    [EVM_INST_LT]      = "EVM_INST_LT",
-    [EVM_INST_EQ]      = "EVM_INST_EQ",
-    [EVM_INST_GE]      = "EVM_INST_GE",
-    [EVM_INST_LE]      = "EVM_INST_LE",
-    [EVM_INST_READ64]  = "EVM_INST_READ64",
-    [EVM_INST_WRITE64] = "EVM_INST_WRITE64",
-    [EVM_INST_PRINTU]  = "EVM_INST_PRINTU",
-    [EVM_INST_JP]      = "EVM_INST_JP",
-    [EVM_INST_JPC]      = "EVM_INST_JPC",
-    [EVM_INST_JR]      = "EVM_INST_JR",
-    [EVM_INST_JRC]     = "EVM_INST_JRC",
-    [EVM_INST_HALT]    = "EVM_INST_HALT"
-};
-
-void dump_stack(const Stack *s)
-{
-    for(size_t i = 0; i < s->size; ++i){
-        printf ("index: %zu value: %zu   ", i, s->items[i]);
-    }
-    printf("\n");
-}
-
-void stack_push(Stack *s, Data d)
-{
-    da_append(s, d);
-}
-
-Data stack_pop(Stack *s)
-{
-    assert(s->size > 0 && "stack_pop:  STACK UNDERFLOW");
-    return s->items[--s->size];
-}
-
-Data stack_peek(Stack *s, size_t offset)
-{
-    assert(s->size > 0 && "stack_peek: STACK UNDERFLOW");
-    assert(s->size - offset - 1 <= s->size && "stack_peek: STACK ACCESS OUT OF BOUNDS");
-    return s->items[s->size - offset - 1];
-}
-
-
-
-void evm_init(Evm *evm, Evm_Insts program)
-{
-    memset(evm, 0, sizeof(*evm));
-    evm->program = program;
-    evm->memory_capacity = EVM_MEM_CAP;
-    evm->memory = malloc(evm->memory_capacity);
-    memset(evm->memory, 0, evm->memory_capacity);
-}
-
-/**Won't free the program, because it's from external source*/
-void evm_free(Evm* evm)
-{
-    free(evm->memory);
-    free(evm->stack.items);
-    free(evm->call_stack.items);
-}
-
-Evm_Inst evm_next_inst(Evm *evm)
-{
-    assert(evm->ip < evm->program.size && "PROGRAM MEMORY ACCESS OUT OF BOUNDS");
-    return evm->program.items[evm->ip++];
-}
-
-void evm_call(Evm *evm, Addr func_addr){
-    stack_push(&evm->call_stack, evm->ip);
-    evm->ip = func_addr;
-}
-
-void evm_ret(Evm *evm){
-    evm->ip = (Addr) stack_pop(&evm->call_stack); 
-}
-
-void evm_push(Evm *evm, Data d)
-{
-    stack_push(&evm->stack, d);
-}
-
-Data evm_pop(Evm *evm)
-{
-    return stack_pop(&evm->stack);
-}
-
-Data evm_peek(Evm *evm, size_t offset)
-{
-    return stack_peek(&evm->stack, offset);
-}
-
-void evm_write8(Evm *evm, Addr dst, Data a)
-{
-    assert(dst < evm->memory_capacity && "DATA MEMEORY ACCESS OUT OF BOUNDS");
-    uint8_t *dst8 = (uint8_t *)evm->memory + dst;
-    *dst8 = a;
-}
-
-void evm_write64(Evm *evm, Addr dst, Data a)
-{
-    assert(dst < evm->memory_capacity && "DATA MEMEORY ACCESS OUT OF BOUNDS");
-    evm->memory[dst] = a;
-}
-
-Data evm_read64(Evm *evm, Addr src)
-{
-    assert(src < evm->memory_capacity && "DATA MEMEORY ACCESS OUT OF BOUNDS");
-    return evm->memory[src];
-}
-
-Data evm_read8(Evm *evm, Addr src)
-{
-    assert(src < evm->memory_capacity && "DATA MEMEORY ACCESS OUT OF BOUNDS");
-    return *((uint8_t *)evm->memory + src);
-}
-
-
-void evm_run(Evm *evm){  
-    while(true){
-        Evm_Inst inst = evm_next_inst(evm);
-        switch(inst){
-            case EVM_INST_PUSH: {
-                Data a = evm_next_inst(evm); 
-                evm_push(evm, a);
-            }
-            break;
-            case EVM_INST_DUP: { 
-                Data offset = evm_next_inst(evm);
-                Data a = evm_peek(evm, offset);
-                evm_push(evm, a);
-            }
-            break;
-            case EVM_INST_SWAP: { 
-                Data a = evm_pop(evm);
-                Data b = evm_pop(evm);
-                evm_push(evm, a);
-                evm_push(evm, b);
-            }
-            break;
-            case EVM_INST_ADD:{
-                Data a = evm_pop(evm);
-                Data b = evm_pop(evm);  
-                Data s = b + a;
-                evm_push(evm, s);
-            }
-            break;
-            case EVM_INST_SUB:{
-                Data a = evm_pop(evm);
-                Data b = evm_pop(evm);  
-                Data s = b - a;
-                evm_push(evm, s);
-            } 
-            break;
-            case EVM_INST_MULTU: {
-                Data a = evm_pop(evm);
-                Data b = evm_pop(evm);  
-                Data s = b * a;
-                evm_push(evm, s);
-            } 
-            break;
-            case EVM_INST_GT: {
-                Data a = evm_pop(evm);
-                Data b = evm_pop(evm);
-                evm_push(evm, a > b);
-            }
-            break;
-            case EVM_INST_LT: {
-                Data a = evm_pop(evm);
-                Data b = evm_pop(evm);
-                evm_push(evm, a < b);
-            }
-            break;
-            case EVM_INST_EQ: {
-                Data a = evm_pop(evm);
-                Data b = evm_pop(evm);
-                evm_push(evm, a == b);
-            }
-            break;
-            case EVM_INST_GE: {
-                Data a = evm_pop(evm);
-                Data b = evm_pop(evm);
-                evm_push(evm, a >= b);
-            }
-            break;
-            case EVM_INST_LE: {
-                Data a = evm_pop(evm);
-                Data b = evm_pop(evm);
-                evm_push(evm, a <= b);
-            }
-            break;
-            case EVM_INST_READ8: {
-                Addr src = (Addr) evm_pop(evm);
-                Data a = evm_read8(evm, src);
-                evm_push(evm, a);
-            } 
-            break;
-            case EVM_INST_READ64: {
-                Addr src = (Addr) evm_pop(evm);
-                Data a = evm_read64(evm, src);
-                evm_push(evm, a);
-            } 
-            break;
-            case EVM_INST_WRITE8: {
-                Addr dst = (Addr) evm_pop(evm);
-                Data a = evm_pop(evm);
-                evm_write8(evm, dst, a);
-            } 
-            break;
-            case EVM_INST_WRITE64:{
-                Addr dst = (Addr) evm_pop(evm);
-                Data a = evm_pop(evm);
-                evm_write64(evm, dst, a);
-            } 
-            break;
-            case EVM_INST_PRINTU: {
-                Data a = evm_pop(evm);
-                printf("%zu", a);
-            }
-            break;
-            case EVM_INST_PUTS: {
-                Addr ptr = (Addr) evm_pop(evm);
-                Data size = evm_pop(evm);
-                fwrite(&evm->memory[ptr], size, 1, stdout);
-                fflush(stdout);
-            }
-            break;
-            case EVM_INST_CALL: {
-               Addr func_addr = (Addr) evm_pop(evm); 
-               evm_call(evm, func_addr);
-            }
-            break;
-            case EVM_INST_RET:{
-               evm_ret(evm);
-            }
-            break;
-            case EVM_INST_JP: {
-                evm->ip = evm_pop(evm);
-            }
-            break;
-            case EVM_INST_JPC: {
-                Data cond = evm_pop(evm);
-                Addr new_ip = (Addr) evm_pop(evm);
-                if(cond){
-                    evm->ip = new_ip;
-                }
-            }
-            break;
-            case EVM_INST_JR: {
-                evm->ip += evm_pop(evm);
-            }
-            break;
-            case EVM_INST_JRC: {
-                Data cond = evm_pop(evm);
-                long offset = evm_pop(evm);
-                if(cond){
-                    evm->ip += offset;
-                }
-            }
-            break;
-            case EVM_INST_HALT: 
-                return;
-
-            case EVM_INST_COUNT: 
-            default:
-                UNREACHABLE;
-        }
-        //printf("Ip: %zu Inst: %s Size: %zu\n", evm->ip, inst_to_str[inst], evm->stack.size);
-    }
-}
-
-
-#ifdef EVM_DEBUG
-
-static void testFib(void) 
-{
-    Evm evm = {0};
-    Evm_Insts program = {0};
-
-    //push 'newline'
-    da_append(&program, EVM_INST_PUSH);
-    da_append(&program, (Data) (0x0a0a0a0au));
-
-    //push 0 
-    da_append(&program, EVM_INST_PUSH);
-    da_append(&program, 0);
-    
-    //write64
-    da_append(&program, EVM_INST_WRITE64);
-
-    //push 0 
-    da_append(&program, EVM_INST_PUSH);
-    da_append(&program, 0);
-
-    //push 1
-    da_append(&program, EVM_INST_PUSH);
-    da_append(&program, 1);
-    
-    //dup 1
-    da_append(&program, EVM_INST_DUP);
-    da_append(&program, 1);
-    
-    //print
-    da_append(&program, EVM_INST_PRINTU);
-
-    
-    //push 1
-    da_append(&program, EVM_INST_PUSH);
-    da_append(&program, 1);
-
-    //push 0 
-    da_append(&program, EVM_INST_PUSH);
-    da_append(&program, 0);
-    
-    //puts
-    da_append(&program, EVM_INST_PUTS);
-    
-    //swap
-    da_append(&program, EVM_INST_SWAP);
-
-    //dup 1
-    da_append(&program, EVM_INST_DUP);
-    da_append(&program, 1);
-    
-    //add
-    da_append(&program, EVM_INST_ADD);
-    
-    //dup 0
-    da_append(&program, EVM_INST_DUP);
-    da_append(&program, 0);
-
-
-    //push INT32_MAX
-    da_append(&program, EVM_INST_PUSH);
-    da_append(&program, INT32_MAX);
-
-    //gt
-    da_append(&program, EVM_INST_GT);
-
-    //push 9
-    da_append(&program, EVM_INST_PUSH);
-    da_append(&program, 9);
-     
-    //swap
-    da_append(&program, EVM_INST_SWAP);
-
-    //jpc 
-    da_append(&program, EVM_INST_JPC);
-
-    //halt
-    da_append(&program, EVM_INST_HALT); 
-    
-    evm_init(&evm, program);
-    evm_run(&evm);
-    evm_free(&evm);
-    free(program.items);
-}
-
-int main(void) 
-{
-    testFib();
-    return 0;
-}
-#endif //EVM_DEBUG
\ No newline at end of file
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <stdbool.h>
+
+#include <inttypes.h>
+#include <errno.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include "evm_internal.h"
+#include "simd.h"
+
+char *inst_to_str[EVM_INST_COUNT] = {
+    [EVM_INST_PUSH]    = "EVM_INST_PUSH",
+    [EVM_INST_DUP]     = "EVM_INST_DUP",
+    [EVM_INST_SWAP]    = "EVM_INST_SWAP",
+    [EVM_INST_ADD]    = "EVM_INST_ADD",
+    [EVM_INST_SUB]    = "EVM_INST_SUB",
+    [EVM_INST_MULTU]   = "EVM_INST_MULTU",
+    [EVM_INST_GT]      = "EVM_INST_GT",
+    [EVM_INST_LT]      = "EVM_INST_LT",
+    [EVM_INST_EQ]      = "EVM_INST_EQ",
+    [EVM_INST_GE]      = "EVM_INST_GE",
+    [EVM_INST_LE]      = "EVM_INST_LE",
+    [EVM_INST_READ8]   = "EVM_INST_READ8",
+    [EVM_INST_READ64]  = "EVM_INST_READ64",
+    [EVM_INST_WRITE8]  = "EVM_INST_WRITE8",
+    [EVM_INST_WRITE64] = "EVM_INST_WRITE64",
+    [EVM_INST_PRINTU]  = "EVM_INST_PRINTU",
+    [EVM_INST_PUTS]    = "EVM_INST_PUTS",
+    [EVM_INST_CALL]    = "EVM_INST_CALL",
+    [EVM_INST_RET]     = "EVM_INST_RET",
+    [EVM_INST_JP]      = "EVM_INST_JP",
+    [EVM_INST_JPC]      = "EVM_INST_JPC",
+    [EVM_INST_JR]      = "EVM_INST_JR",
+    [EVM_INST_JRC]     = "EVM_INST_JRC",
+    [EVM_INST_HALT]    = "EVM_INST_HALT",
+    [EVM_INST_NATIVE]  = "EVM_INST_NATIVE",
+    [EVM_INST_MULW]    = "EVM_INST_MULW",
+    [EVM_INST_ADDC]    = "EVM_INST_ADDC",
+    [EVM_INST_DIVU]    = "EVM_INST_DIVU",
+    [EVM_INST_MODU]    = "EVM_INST_MODU",
+    [EVM_INST_VADD]    = "EVM_INST_VADD",
+    [EVM_INST_VMUL]    = "EVM_INST_VMUL",
+    [EVM_INST_VSUM]    = "EVM_INST_VSUM",
+    [EVM_INST_FDREAD]  = "EVM_INST_FDREAD",
+    [EVM_INST_FDWRITE] = "EVM_INST_FDWRITE",
+    [EVM_INST_SPAWN]   = "EVM_INST_SPAWN",
+    [EVM_INST_JOIN]    = "EVM_INST_JOIN",
+    [EVM_INST_ALOAD]   = "EVM_INST_ALOAD",
+    [EVM_INST_ASTORE]  = "EVM_INST_ASTORE",
+    [EVM_INST_CAS]     = "EVM_INST_CAS",
+    [EVM_INST_FADD]    = "EVM_INST_FADD",
+    [EVM_INST_ALLOC]   = "EVM_INST_ALLOC",
+    [EVM_INST_FREE]    = "EVM_INST_FREE",
+    [EVM_INST_REALLOC] = "EVM_INST_REALLOC",
+    [EVM_INST_ENTER]   = "EVM_INST_ENTER",
+    [EVM_INST_LEAVE]   = "EVM_INST_LEAVE",
+    [EVM_INST_LOAD_LOCAL]  = "EVM_INST_LOAD_LOCAL",
+    [EVM_INST_STORE_LOCAL] = "EVM_INST_STORE_LOCAL",
+    [EVM_INST_CALLR]   = "EVM_INST_CALLR",
+    [EVM_INST_PUSHR]   = "EVM_INST_PUSHR",
+};
+
+static const char *err_to_str[EVM_ERR_COUNT] = {
+    [EVM_ERR_OK]                   = "ok",
+    [EVM_ERR_BUDGET]               = "instruction budget exhausted",
+    [EVM_ERR_IO_PENDING]           = "suspended on pending I/O",
+    [EVM_ERR_STACK_UNDERFLOW]      = "stack underflow",
+    [EVM_ERR_STACK_OVERFLOW]       = "stack overflow",
+    [EVM_ERR_CALL_STACK_UNDERFLOW] = "call stack underflow",
+    [EVM_ERR_ILLEGAL_INST]         = "illegal instruction",
+    [EVM_ERR_IP_OUT_OF_BOUNDS]     = "program memory access out of bounds",
+    [EVM_ERR_MEMORY_OUT_OF_BOUNDS] = "data memory access out of bounds",
+    [EVM_ERR_OUT_OF_MEMORY]        = "out of memory",
+    [EVM_ERR_UNKNOWN_NATIVE]       = "unregistered native function",
+    [EVM_ERR_BAD_IMAGE]            = "malformed program image",
+    [EVM_ERR_DIV_BY_ZERO]          = "division by zero",
+    [EVM_ERR_MISALIGNED]           = "misaligned atomic access",
+    [EVM_ERR_BAD_THREAD]           = "join of an unknown thread handle",
+    [EVM_ERR_THREAD]               = "could not start a thread",
+    [EVM_ERR_BAD_POINTER]          = "heap block not returned by alloc, or heap metadata overwritten",
+    [EVM_ERR_BAD_FD]               = "fd handle past EVM_FDS_MAX",
+    [EVM_ERR_BAD_FRAME]            = "leave without enter, or ret inside a frame",
+};
+
+const char *evm_err_to_str(Evm_Err err)
+{
+    if(err >= EVM_ERR_COUNT) return "unknown error";
+    return err_to_str[err];
+}
+
+static void *libc_realloc(void *ctx, void *ptr, size_t old_size, size_t new_size)
+{
+    (void) ctx;
+    (void) old_size;
+    if(new_size == 0){
+        free(ptr);
+        return NULL;
+    }
+    return realloc(ptr, new_size);
+}
+
+const Evm_Allocator evm_libc_allocator = {.realloc = libc_realloc, .ctx = NULL};
+
+static void *evm_realloc(Evm *evm, void *ptr, size_t old_size, size_t new_size)
+{
+    return evm->allocator.realloc(evm->allocator.ctx, ptr, old_size, new_size);
+}
+
+static void evm_dealloc(Evm *evm, void *ptr, size_t size)
+{
+    if(ptr != NULL) evm_realloc(evm, ptr, size, 0);
+}
+
+/**Grows a dynamic array owned by `evm` to hold at least `need` items*/
+static bool evm_grow(Evm *evm, void **items, size_t *capacity, size_t need, size_t item_size)
+{
+    if(need <= *capacity) return true;
+    size_t new_capacity = (*capacity == 0) ? DA_INIT_CAP : *capacity;
+    while(new_capacity < need) new_capacity *= 2;
+    void *new_items = evm_realloc(evm, *items, *capacity * item_size, new_capacity * item_size);
+    if(new_items == NULL) return false;
+    *items = new_items;
+    *capacity = new_capacity;
+    return true;
+}
+
+#define evm_da_reserve(evm, da, n) \
+    evm_grow((evm), (void **) &(da)->items, &(da)->capacity, (da)->size + (n), sizeof(*(da)->items))
+
+#define evm_da_free(evm, da) evm_dealloc((evm), (da)->items, (da)->capacity * sizeof(*(da)->items))
+
+void dump_stack(const Stack *s)
+{
+    for(size_t i = 0; i < s->size; ++i){
+        printf ("index: %zu value: %zu   ", i, s->items[i]);
+    }
+    printf("\n");
+}
+
+static Evm_Err stack_reserve(Evm *evm, Stack *s, size_t n, size_t max)
+{
+    if(s->size + n > max) return EVM_ERR_STACK_OVERFLOW;
+    if(!evm_da_reserve(evm, s, n)) return EVM_ERR_OUT_OF_MEMORY;
+    return EVM_ERR_OK;
+}
+
+Evm_Err evm_push(Evm *evm, Data d)
+{
+    Evm_Err err = stack_reserve(evm, &evm->stack, 1, EVM_STACK_MAX);
+    if(err != EVM_ERR_OK) return err;
+    evm->stack.items[evm->stack.size++] = d;
+    return EVM_ERR_OK;
+}
+
+void evm_io_complete(Evm *evm, int64_t result)
+{
+    //the request popped three operands, so there is room for the result
+    if(evm->io.kind == EVM_IO_READ || evm->io.kind == EVM_IO_WRITE){
+        evm->stack.items[evm->stack.size++] = (Data) result;
+    }
+    if(result > 0 && evm->io.kind == EVM_IO_READ) evm->counters.io_read_bytes += (uint64_t) result;
+    if(result > 0 && evm->io.kind == EVM_IO_WRITE) evm->counters.io_write_bytes += (uint64_t) result;
+    if(evm->io.kind == EVM_IO_PUTS) evm->counters.io_write_bytes += evm->io.size;
+    evm->io = (Evm_Io) {0};
+}
+
+Evm_Err evm_pop(Evm *evm, Data *d)
+{
+    if(evm->stack.size == 0) return EVM_ERR_STACK_UNDERFLOW;
+    *d = evm->stack.items[--evm->stack.size];
+    return EVM_ERR_OK;
+}
+
+/*Every access is bounds checked here first, so this is also where memory_peak is kept*/
+static bool evm_mem_ok(Evm *evm, Addr addr, size_t n)
+{
+    if(addr > evm->memory_capacity || n > evm->memory_capacity - addr) return false;
+    if(addr + n > evm->counters.memory_peak) evm->counters.memory_peak = addr + n;
+    return true;
+}
+
+static void evm_call_pushed(Evm *evm)
+{
+    if(evm->call_stack.size > evm->counters.call_depth_peak) evm->counters.call_depth_peak = evm->call_stack.size;
+}
+
+static Data evm_load64(const Evm *evm, Addr src)
+{
+    Data a;
+    memcpy(&a, evm->memory + src, sizeof(a));
+    return a;
+}
+
+static void evm_store64(Evm *evm, Addr dst, Data a)
+{
+    memcpy(evm->memory + dst, &a, sizeof(a));
+}
+
+static void evm_tier_abort(Evm *evm)
+{
+    evm->tier.recording = false;
+    evm->tier.rec.size = 0;
+}
+
+static void evm_reset_tier(Evm *evm)
+{
+    Evm_Tier *tier = &evm->tier;
+    if(tier->slots){
+        for(size_t i = 0; i < evm->program.size; ++i){
+            Evm_Trace *trace = tier->slots[i].trace;
+            if(trace == NULL) continue;
+            evm_da_free(evm, trace);
+            evm_dealloc(evm, trace, sizeof(*trace));
+        }
+        evm_dealloc(evm, tier->slots, evm->program.size * sizeof(*tier->slots));
+    }
+    evm_da_free(evm, &tier->rec);
+    bool enabled = tier->enabled;
+    memset(tier, 0, sizeof(*tier));
+    tier->enabled = enabled;
+}
+
+static bool evm_setup(Evm *evm, const Evm_Allocator *allocator)
+{
+    memset(evm, 0, sizeof(*evm));
+    evm->allocator = allocator ? *allocator : evm_libc_allocator;
+    evm->memory_capacity = EVM_MEM_CAP;
+    evm->memory = evm_realloc(evm, NULL, 0, evm->memory_capacity);
+    if(evm->memory == NULL) return false;
+    memset(evm->memory, 0, evm->memory_capacity);
+    return true;
+}
+
+void evm_init(Evm *evm, Evm_Insts program)
+{
+    bool ok = evm_setup(evm, NULL);
+    assert(ok && "evm_init: OUT OF MEMORY");
+    (void) ok;
+    evm->program = program;
+}
+
+void evm_init_compact(Evm *evm, Evm_Bytecode code)
+{
+    evm_init(evm, (Evm_Insts) {0});
+    evm->code = code;
+    evm->compact = true;
+}
+
+static void evm_join_all(Evm *evm);
+
+/**Won't free the program, unless it was loaded from an image. Waits for spawned children first*/
+void evm_free(Evm* evm)
+{
+    evm_join_all(evm);
+    evm_da_free(evm, &evm->threads);
+    evm_reset_tier(evm);
+    evm_da_free(evm, &evm->stack);
+    evm_da_free(evm, &evm->call_stack);
+    evm_da_free(evm, &evm->data);
+    if(evm->parent) return; //memory, natives, fds and program belong to the parent
+    evm_dealloc(evm, evm->memory, evm->memory_capacity);
+    evm_dealloc(evm, evm->natives, EVM_NATIVES_MAX * sizeof(*evm->natives));
+    evm_dealloc(evm, evm->fds, EVM_FDS_MAX * sizeof(*evm->fds));
+    if(evm->owns_program){
+        evm_da_free(evm, &evm->program);
+        evm_da_free(evm, &evm->code);
+    }
+}
+
+Evm *evm_create(const Evm_Allocator *allocator)
+{
+    if(allocator == NULL) allocator = &evm_libc_allocator;
+    Evm *evm = allocator->realloc(allocator->ctx, NULL, 0, sizeof(*evm));
+    if(evm == NULL) return NULL;
+    if(!evm_setup(evm, allocator)){
+        allocator->realloc(allocator->ctx, evm, sizeof(*evm), 0);
+        return NULL;
+    }
+    return evm;
+}
+
+void evm_destroy(Evm *evm)
+{
+    if(evm == NULL) return;
+    Evm_Allocator allocator = evm->allocator;
+    evm_free(evm);
+    allocator.realloc(allocator.ctx, evm, sizeof(*evm), 0);
+}
+
+/**Clears the execution state so the loaded program can run again from the start.
+  Buffers are kept for the next run, natives and fds stay registered*/
+void evm_reset(Evm *evm)
+{
+    evm_join_all(evm);
+    evm_tier_abort(evm);
+    evm->ip = evm->entry;
+    evm->retired = 0;
+    evm->children_retired = 0;
+    evm->counters = (Evm_Counters) {0};
+    evm->stack.size = 0;
+    evm->call_stack.size = 0;
+    evm->fp = 0;
+    //only the part the data segment does not cover needs clearing
+    if(evm->data.size > 0) memcpy(evm->memory, evm->data.items, evm->data.size);
+    memset(evm->memory + evm->data.size, 0, evm->memory_capacity - evm->data.size);
+    evm->heap_base = (evm->data.size + sizeof(Data) - 1) & ~(Addr) (sizeof(Data) - 1);
+    memset(&evm->heap, 0, sizeof(evm->heap));
+}
+
+Evm_Err evm_set_data(Evm *evm, const void *data, size_t size)
+{
+    if(size > evm->memory_capacity) return EVM_ERR_MEMORY_OUT_OF_BOUNDS;
+    evm->data.size = 0;
+    if(size > 0){
+        if(!evm_da_reserve(evm, &evm->data, size)) return EVM_ERR_OUT_OF_MEMORY;
+        memcpy(evm->data.items, data, size);
+        evm->data.size = size;
+    }
+    evm_reset(evm);
+    return EVM_ERR_OK;
+}
+
+/**Checks that the sizes in the header fit in the image*/
+static bool read_image_header(const void *image, size_t image_size, Evm_Image_Header *header)
+{
+    if(image_size < sizeof(*header)) return false;
+    memcpy(header, image, sizeof(*header));
+    if(memcmp(header->magic, EVM_IMAGE_MAGIC, sizeof(header->magic)) != 0) return false;
+    if(header->version != EVM_IMAGE_VERSION) return false;
+    size_t unit = (header->flags & EVM_IMAGE_COMPACT) ? 1 : sizeof(Evm_Inst);
+    if(header->program_size > (image_size - sizeof(*header)) / unit) return false;
+    if(header->data_size > image_size - sizeof(*header) - header->program_size * unit) return false;
+    return true;
+}
+
+Evm_Err evm_load_image(Evm *evm, const void *image, size_t image_size)
+{
+    Evm_Image_Header header;
+    if(!read_image_header(image, image_size, &header)) return EVM_ERR_BAD_IMAGE;
+    bool compact = (header.flags & EVM_IMAGE_COMPACT) != 0;
+    size_t unit = compact ? 1 : sizeof(Evm_Inst);
+    if(header.data_size > evm->memory_capacity) return EVM_ERR_BAD_IMAGE;
+
+    //children still running the old program have to be gone before it is freed
+    evm_join_all(evm);
+    evm_reset_tier(evm);
+    if(!evm->owns_program){
+        evm->program = (Evm_Insts) {0};
+        evm->code = (Evm_Bytecode) {0};
+    }
+    evm->owns_program = true;
+    evm->compact = compact;
+    evm->entry = 0;
+    evm->program.size = 0;
+    evm->code.size = 0;
+
+    const uint8_t *body = (const uint8_t *) image + sizeof(header);
+    if(compact){
+        if(!evm_da_reserve(evm, &evm->code, header.program_size)) return EVM_ERR_OUT_OF_MEMORY;
+        memcpy(evm->code.items, body, header.program_size);
+        evm->code.size = header.program_size;
+    } else {
+        if(!evm_da_reserve(evm, &evm->program, header.program_size)) return EVM_ERR_OUT_OF_MEMORY;
+        memcpy(evm->program.items, body, header.program_size * sizeof(Evm_Inst));
+        evm->program.size = header.program_size;
+    }
+
+    return evm_set_data(evm, body + header.program_size * unit, header.data_size);
+}
+
+static size_t write_image(uint32_t flags, const void *body, size_t count, size_t unit, Evm_Segment data,
+                          void *buf, size_t buf_size)
+{
+    Evm_Image_Header header = {.version = EVM_IMAGE_VERSION, .flags = flags, .data_size = data.size, .program_size = count};
+    memcpy(header.magic, EVM_IMAGE_MAGIC, sizeof(header.magic));
+    size_t image_size = sizeof(header) + count * unit + data.size;
+    if(buf != NULL && buf_size >= image_size){
+        uint8_t *p = buf;
+        memcpy(p, &header, sizeof(header));
+        p += sizeof(header);
+        if(count > 0) memcpy(p, body, count * unit);
+        p += count * unit;
+        if(data.size > 0) memcpy(p, data.items, data.size);
+    }
+    return image_size;
+}
+
+size_t evm_write_image_ex(Evm_Insts program, Evm_Segment data, uint32_t flags, void *buf, size_t buf_size)
+{
+    return write_image(flags & ~EVM_IMAGE_COMPACT, program.items, program.size, sizeof(Evm_Inst), data, buf, buf_size);
+}
+
+size_t evm_write_compact_image_ex(Evm_Bytecode code, Evm_Segment data, uint32_t flags, void *buf, size_t buf_size)
+{
+    return write_image(flags | EVM_IMAGE_COMPACT, code.items, code.size, 1, data, buf, buf_size);
+}
+
+size_t evm_write_image(Evm_Insts program, void *buf, size_t buf_size)
+{
+    return evm_write_image_ex(program, (Evm_Segment) {0}, 0, buf, buf_size);
+}
+
+size_t evm_write_compact_image(Evm_Bytecode code, void *buf, size_t buf_size)
+{
+    return evm_write_compact_image_ex(code, (Evm_Segment) {0}, 0, buf, buf_size);
+}
+
+Evm_Err evm_region_add(Evm_Insts *region, const void *image, size_t image_size,
+                       Addr *entry, const uint8_t **data, size_t *data_size)
+{
+    Evm_Image_Header header;
+    if(!read_image_header(image, image_size, &header)) return EVM_ERR_BAD_IMAGE;
+    if((header.flags & EVM_IMAGE_COMPACT) || !(header.flags & EVM_IMAGE_PIC)) return EVM_ERR_BAD_IMAGE;
+
+    size_t size = region->size + header.program_size;
+    if(size > region->capacity){
+        size_t capacity = region->capacity == 0 ? DA_INIT_CAP : region->capacity;
+        while(capacity < size) capacity *= 2;
+        Evm_Inst *items = realloc(region->items, capacity * sizeof(*items));
+        if(items == NULL) return EVM_ERR_OUT_OF_MEMORY;
+        region->items = items;
+        region->capacity = capacity;
+    }
+    const uint8_t *body = (const uint8_t *) image + sizeof(header);
+    memcpy(region->items + region->size, body, header.program_size * sizeof(Evm_Inst));
+    *entry = region->size;
+    region->size = size;
+    *data = body + header.program_size * sizeof(Evm_Inst);
+    *data_size = header.data_size;
+    return EVM_ERR_OK;
+}
+
+void evm_attach(Evm *evm, Evm_Insts region, Addr entry)
+{
+    evm_join_all(evm);
+    evm_reset_tier(evm);
+    if(evm->owns_program){
+        evm_da_free(evm, &evm->program);
+        evm_da_free(evm, &evm->code);
+    }
+    evm->owns_program = false;
+    evm->program = region;
+    evm->code = (Evm_Bytecode) {0};
+    evm->compact = false;
+    evm->entry = entry;
+    evm_reset(evm);
+}
+
+void evm_attach_compact(Evm *evm, Evm_Bytecode code)
+{
+    evm_attach(evm, (Evm_Insts) {0}, 0);
+    evm->code = code;
+    evm->compact = true;
+}
+
+Addr evm_ip(const Evm *evm)
+{
+    return evm->ip;
+}
+
+uint64_t evm_retired(const Evm *evm)
+{
+    return evm->retired;
+}
+
+uint64_t evm_children_retired(const Evm *evm)
+{
+    return evm->children_retired;
+}
+
+size_t evm_stack_depth(const Evm *evm)
+{
+    return evm->stack.size;
+}
+
+size_t evm_call_depth(const Evm *evm)
+{
+    return evm->call_stack.size;
+}
+
+void evm_counters(const Evm *evm, Evm_Counters *counters)
+{
+    *counters = evm->counters;
+}
+
+uint8_t *evm_memory(Evm *evm, size_t *size)
+{
+    if(size) *size = evm->memory_capacity;
+    return evm->memory;
+}
+
+Evm_Insts evm_program(const Evm *evm)
+{
+    return evm->program;
+}
+
+Evm_Segment evm_data(const Evm *evm)
+{
+    return evm->data;
+}
+
+void evm_set_tiered(Evm *evm, bool enabled)
+{
+    evm->tier.enabled = enabled;
+}
+
+void evm_set_profile(Evm *evm, uint64_t *counts)
+{
+    evm->profile = counts;
+}
+
+void evm_set_io_async(Evm *evm, bool async)
+{
+    evm->io_async = async;
+}
+
+Evm_Io *evm_io(Evm *evm)
+{
+    return &evm->io;
+}
+
+void evm_set_monitor(Evm *evm, const Evm_Monitor *monitor)
+{
+    evm->monitor = monitor ? *monitor : (Evm_Monitor) {0};
+}
+
+void evm_monitor(const Evm *evm, Evm_Monitor *monitor)
+{
+    *monitor = evm->monitor;
+}
+
+void evm_set_user(Evm *evm, void *user)
+{
+    evm->user = user;
+}
+
+void *evm_user(const Evm *evm)
+{
+    return evm->user;
+}
+
+static uint64_t zigzag_encode(uint64_t v)
+{
+    return (v << 1) ^ (0 - (v >> 63));
+}
+
+static uint64_t zigzag_decode(uint64_t z)
+{
+    return (z >> 1) ^ (0 - (z & 1));
+}
+
+size_t evm_leb128_encode(uint64_t value, uint8_t *out)
+{
+    size_t n = 0;
+    do {
+        uint8_t byte = value & 0x7f;
+        value >>= 7;
+        if(value != 0) byte |= 0x80;
+        out[n++] = byte;
+    } while(value != 0);
+    return n;
+}
+
+/**Returns the number of bytes consumed, 0 if the encoding runs past `avail` or is too long*/
+static size_t leb128_decode(const uint8_t *p, size_t avail, uint64_t *value)
+{
+    uint64_t res = 0;
+    for(size_t i = 0; i < avail && i < EVM_LEB128_MAX; ++i){
+        res |= (uint64_t) (p[i] & 0x7f) << (7 * i);
+        if((p[i] & 0x80) == 0){
+            *value = res;
+            return i + 1;
+        }
+    }
+    return 0;
+}
+
+bool evm_has_immediate(Evm_Inst inst)
+{
+    return inst == EVM_INST_PUSH || inst == EVM_INST_DUP || inst == EVM_INST_NATIVE
+        || inst == EVM_INST_ENTER || inst == EVM_INST_LOAD_LOCAL || inst == EVM_INST_STORE_LOCAL
+        || inst == EVM_INST_PUSHR;
+}
+
+/**Fixed width so the layout does not depend on the values*/
+static size_t encode_reloc(uint64_t z, uint8_t *out)
+{
+    for(size_t k = 0; k < EVM_RELOC_WIDTH; ++k){
+        out[k] = ((z >> (7 * k)) & 0x7f) | (k + 1 < EVM_RELOC_WIDTH ? 0x80 : 0);
+    }
+    return EVM_RELOC_WIDTH;
+}
+
+bool evm_encode_compact(Evm_Insts program, const size_t *relocs, size_t relocs_count, Evm_Bytecode *out)
+{
+    return evm_encode_compact_ex(program, relocs, relocs_count, NULL, 0, out);
+}
+
+bool evm_encode_compact_ex(Evm_Insts program, const size_t *relocs, size_t relocs_count,
+                           const Evm_Rel_Reloc *rel_relocs, size_t rel_relocs_count, Evm_Bytecode *out)
+{
+    bool ok = false;
+    size_t *offsets = malloc((program.size + 1) * sizeof(*offsets));
+    uint8_t *kind = calloc(program.size + 1, 1); //1: instruction start, 2: relocated immediate, 3: relative one
+    size_t *bases = rel_relocs_count > 0 ? malloc(program.size * sizeof(*bases)) : NULL;
+    if(offsets == NULL || kind == NULL || (rel_relocs_count > 0 && bases == NULL)) goto defer;
+
+    for(size_t i = 0; i < relocs_count; ++i){
+        if(relocs[i] >= program.size) goto defer;
+        kind[relocs[i]] = 2;
+    }
+    for(size_t i = 0; i < rel_relocs_count; ++i){
+        if(rel_relocs[i].index >= program.size || kind[rel_relocs[i].index] != 0) goto defer;
+        kind[rel_relocs[i].index] = 3;
+        bases[rel_relocs[i].index] = rel_relocs[i].base;
+    }
+
+    //first pass: byte offset of every instruction start
+    size_t size = 0;
+    uint8_t scratch[EVM_LEB128_MAX];
+    for(size_t i = 0; i < program.size; ++i){
+        if(kind[i] >= 2 || program.items[i] >= 256) goto defer;
+        kind[i] = 1;
+        offsets[i] = size++;
+        if(evm_has_immediate(program.items[i])){
+            if(++i >= program.size) goto defer;
+            size += kind[i] >= 2 ? EVM_RELOC_WIDTH : evm_leb128_encode(zigzag_encode(program.items[i]), scratch);
+        }
+    }
+    kind[program.size] = 1;
+    offsets[program.size] = size;
+
+    //second pass: emit
+    out->size = 0;
+    if(out->capacity < size){
+        uint8_t *items = realloc(out->items, size);
+        if(items == NULL) goto defer;
+        out->items = items;
+        out->capacity = size;
+    }
+    for(size_t i = 0; i < program.size; ++i){
+        out->items[out->size++] = (uint8_t) program.items[i];
+        if(!evm_has_immediate(program.items[i])) continue;
+        Data imm = program.items[++i];
+        if(kind[i] == 2){
+            if(imm > program.size || kind[imm] != 1) goto defer;
+            uint64_t z = zigzag_encode(offsets[imm]);
+            if(z >> (7 * EVM_RELOC_WIDTH)) goto defer;
+            out->size += encode_reloc(z, out->items + out->size);
+        } else if(kind[i] == 3){
+            size_t base = bases[i];
+            size_t target = base + imm;     //imm is a signed distance, this wraps
+            if(base > program.size || kind[base] != 1 || target > program.size || kind[target] != 1) goto defer;
+            uint64_t z = zigzag_encode(offsets[target] - offsets[base]);
+            if(z >> (7 * EVM_RELOC_WIDTH)) goto defer;
+            out->size += encode_reloc(z, out->items + out->size);
+        } else {
+            out->size += evm_leb128_encode(zigzag_encode(imm), out->items + out->size);
+        }
+    }
+    ok = true;
+
+defer:
+    free(offsets);
+    free(kind);
+    free(bases);
+    return ok;
+}
+
+Evm_Err evm_register_native(Evm *evm, size_t index, Evm_Native_Fn fn, void *user)
+{
+    if(index >= EVM_NATIVES_MAX) return EVM_ERR_UNKNOWN_NATIVE;
+    if(evm->natives == NULL){
+        size_t size = EVM_NATIVES_MAX * sizeof(*evm->natives);
+        evm->natives = evm_realloc(evm, NULL, 0, size);
+        if(evm->natives == NULL) return EVM_ERR_OUT_OF_MEMORY;
+        memset(evm->natives, 0, size);
+    }
+    evm->natives[index] = (Evm_Native) {.fn = fn, .user = user};
+    return EVM_ERR_OK;
+}
+
+Evm_Err evm_register_fd(Evm *evm, size_t handle, int fd)
+{
+    if(handle >= EVM_FDS_MAX) return EVM_ERR_BAD_FD;
+    if(evm->fds == NULL){
+        size_t size = EVM_FDS_MAX * sizeof(*evm->fds);
+        evm->fds = evm_realloc(evm, NULL, 0, size);
+        if(evm->fds == NULL) return EVM_ERR_OUT_OF_MEMORY;
+        memset(evm->fds, 0, size);
+    }
+    evm->fds[handle] = fd < 0 ? 0 : fd + 1;
+    return EVM_ERR_OK;
+}
+
+/**Host fd behind a guest handle, -1 if it is not registered*/
+static int evm_host_fd(const Evm *evm, Data handle)
+{
+    if(evm->fds == NULL || handle >= EVM_FDS_MAX) return -1;
+    return evm->fds[handle] - 1;
+}
+
+/* Threads: a spawned child is a full Evm of its own (stacks, ip, tier) that points at the
+   parent's memory, program and natives. Plain read/write instructions on memory shared with a
+   running child race; the atomic instructions are sequentially consistent. Natives and the
+   allocator get called from every thread. */
+
+struct Evm_Thread {
+    pthread_t tid;
+    Evm evm;
+    Evm_Err err;
+};
+
+static void *evm_thread_main(void *arg)
+{
+    Evm_Thread *t = arg;
+    t->err = evm_run_ex(&t->evm);
+    return NULL;
+}
+
+/**Starts a child at `addr` with the `argc` words below the stack top as its initial stack.
+  The arguments stay on the parent's stack, the caller drops them*/
+static Evm_Err evm_spawn(Evm *evm, Addr addr, size_t argc, Data *handle)
+{
+    size_t slot = 0;
+    while(slot < evm->threads.size && evm->threads.items[slot] != NULL) slot++;
+    if(slot >= EVM_THREADS_MAX) return EVM_ERR_THREAD;
+    if(slot == evm->threads.size){
+        if(!evm_da_reserve(evm, &evm->threads, 1)) return EVM_ERR_OUT_OF_MEMORY;
+        evm->threads.items[evm->threads.size++] = NULL;
+    }
+
+    Evm_Thread *t = evm_realloc(evm, NULL, 0, sizeof(*t));
+    if(t == NULL) return EVM_ERR_OUT_OF_MEMORY;
+    memset(t, 0, sizeof(*t));
+    Evm *child = &t->evm;
+    child->allocator = evm->allocator;
+    child->parent = evm;
+    child->heap_base = evm->heap_base;
+    child->ip = addr;
+    child->program = evm->program;
+    child->code = evm->code;
+    child->compact = evm->compact;
+    child->memory = evm->memory;
+    child->memory_capacity = evm->memory_capacity;
+    child->natives = evm->natives;
+    child->fds = evm->fds;
+    child->tier.enabled = evm->tier.enabled;
+
+    Evm_Err err = stack_reserve(child, &child->stack, argc, EVM_STACK_MAX);
+    if(err == EVM_ERR_OK){
+        memcpy(child->stack.items, evm->stack.items + evm->stack.size - argc, argc * sizeof(Data));
+        child->stack.size = argc;
+        if(pthread_create(&t->tid, NULL, evm_thread_main, t) != 0) err = EVM_ERR_THREAD;
+    }
+    if(err != EVM_ERR_OK){
+        evm_free(child);
+        evm_dealloc(evm, t, sizeof(*t));
+        return err;
+    }
+    evm->threads.items[slot] = t;
+    *handle = slot;
+    return EVM_ERR_OK;
+}
+
+/**Waits for the child; its fault, if any, is returned, otherwise its stack top (or 0) in `result`*/
+static Evm_Err evm_join(Evm *evm, Data handle, Data *result)
+{
+    if(handle >= evm->threads.size || evm->threads.items[handle] == NULL) return EVM_ERR_BAD_THREAD;
+    Evm_Thread *t = evm->threads.items[handle];
+    evm->threads.items[handle] = NULL;
+    pthread_join(t->tid, NULL);
+    Evm_Err err = t->err;
+    evm->children_retired += t->evm.retired + t->evm.children_retired;
+    *result = t->evm.stack.size > 0 ? t->evm.stack.items[t->evm.stack.size - 1] : 0;
+    evm_free(&t->evm);
+    evm_dealloc(evm, t, sizeof(*t));
+    return err;
+}
+
+static void evm_join_all(Evm *evm)
+{
+    for(size_t i = 0; i < evm->threads.size; ++i){
+        Data result;
+        if(evm->threads.items[i] != NULL) evm_join(evm, i, &result);
+    }
+    evm->threads.size = 0;
+}
+
+/**Atomic view of an 8 byte aligned word of data memory*/
+static _Atomic uint64_t *evm_atomic(Evm *evm, Addr addr)
+{
+    return (_Atomic uint64_t *) (evm->memory + addr);
+}
+
+/* Heap. A block header holds the block size in its low 32 bits, with bit 0 set while the block
+   is allocated, and the size asked for in the high 32 bits. Blocks are named by the address
+   just past the header, which is what alloc returns and what the free lists link.
+   Free blocks are boundary tagged: their last word repeats the size and the header of the block
+   after them says they are free, so a freed block merges with free neighbours on both sides.
+   A minimum block has no room for the size next to its link, a flag of its own stands for it */
+
+#define HEAP_USED (1ull)
+#define HEAP_PREV_FREE (2ull)   /*the block in front is free, the word before this header is its size*/
+#define HEAP_PREV_MIN (4ull)    /*the block in front is a free EVM_HEAP_MIN_BLOCK one*/
+#define HEAP_PREV (HEAP_PREV_FREE | HEAP_PREV_MIN)
+#define HEAP_HEADER (sizeof(Data))
+
+static Evm_Heap *evm_heap_acquire(Evm *evm)
+{
+    Evm *root = evm;
+    while(root->parent) root = root->parent;
+    Evm_Heap *heap = &root->heap;
+    while(atomic_exchange_explicit(&heap->lock, 1, memory_order_acquire));
+    if(!heap->ready){
+        heap->base = heap->top = root->heap_base;
+        heap->ready = true;
+    }
+    return heap;
+}
+
+static void evm_heap_release(Evm_Heap *heap)
+{
+    atomic_store_explicit(&heap->lock, 0, memory_order_release);
+}
+
+static uint64_t evm_heap_size(Data header)
+{
+    return header & 0xfffffff8;
+}
+
+/**Whether `p` names a block inside the heap in the given state. Headers live in data memory
+   the program can overwrite, so every one is checked before it is trusted*/
+static bool evm_heap_valid(Evm *evm, const Evm_Heap *heap, Addr p, bool used)
+{
+    if(p % sizeof(Data) != 0 || p < heap->base + HEAP_HEADER || p >= heap->top) return false;
+    Data header = evm_load64(evm, p - HEAP_HEADER);
+    uint64_t size = evm_heap_size(header);
+    return (header & HEAP_USED) == used && size >= EVM_HEAP_MIN_BLOCK && size % sizeof(Data) == 0
+        && size <= heap->top - (p - HEAP_HEADER);
+}
+
+/**The size class list of a block size, or the first fit list*/
+static size_t evm_heap_list(uint64_t size)
+{
+    for(size_t i = 0; i < EVM_HEAP_CLASSES; ++i){
+        if(size == (uint64_t) EVM_HEAP_MIN_BLOCK << i) return i;
+    }
+    return EVM_HEAP_CLASSES;
+}
+
+/**Block size for a request of `n` bytes, header included*/
+static uint64_t evm_heap_block_size(uint64_t n)
+{
+    uint64_t size = (n + HEAP_HEADER + sizeof(Data) - 1) & ~(uint64_t) (sizeof(Data) - 1);
+    if(size > EVM_HEAP_CLASS_MAX) return size;
+    uint64_t class = EVM_HEAP_MIN_BLOCK;
+    while(class < size) class <<= 1;
+    return class;
+}
+
+/**Tells the block after `p` whether `p` is free*/
+static void evm_heap_mark_next(Evm *evm, const Evm_Heap *heap, Addr p, uint64_t size, bool free)
+{
+    Addr next = p - HEAP_HEADER + size;
+    if(next >= heap->top) return;
+    Data header = evm_load64(evm, next) & ~HEAP_PREV;
+    if(free) header |= size == EVM_HEAP_MIN_BLOCK ? HEAP_PREV : HEAP_PREV_FREE;
+    evm_store64(evm, next, header);
+}
+
+/**Takes free block `p` off its list. The lists are singly linked, so this walks the list of its
+   size. False when it is not there, which only overwritten heap metadata can cause*/
+static bool evm_heap_unlink(Evm *evm, Evm_Heap *heap, Addr p, uint64_t size)
+{
+    size_t list = evm_heap_list(size);
+    size_t limit = heap->stats.heap_bytes / EVM_HEAP_MIN_BLOCK;
+    Addr prev = 0;
+    for(Addr q = heap->free_lists[list]; q != 0; prev = q, q = evm_load64(evm, q)){
+        if(!evm_heap_valid(evm, heap, q, false) || limit-- == 0) return false;
+        if(q != p) continue;
+        if(prev == 0) heap->free_lists[list] = evm_load64(evm, q);
+        else evm_store64(evm, prev, evm_load64(evm, q));
+        heap->stats.free_bytes -= size;
+        return true;
+    }
+    return false;
+}
+
+/**Merges a block that is no longer in use with the free blocks on either side, then puts it on
+   its free list or back into the uncarved tail. Neighbours whose headers do not check out are
+   left alone, the lists report them when they are next walked*/
+static void evm_heap_put(Evm *evm, Evm_Heap *heap, Addr p, uint64_t size)
+{
+    Data prev_flags = evm_load64(evm, p - HEAP_HEADER) & HEAP_PREV;
+    Addr next = p + size;
+    if(evm_heap_valid(evm, heap, next, false)){
+        uint64_t next_size = evm_heap_size(evm_load64(evm, next - HEAP_HEADER));
+        if(evm_heap_unlink(evm, heap, next, next_size)) size += next_size;
+    }
+    if(prev_flags & HEAP_PREV_FREE){
+        uint64_t prev_size = prev_flags & HEAP_PREV_MIN ? EVM_HEAP_MIN_BLOCK : evm_load64(evm, p - 2 * HEAP_HEADER);
+        Addr prev = p - prev_size;
+        if(prev_size <= p - heap->base - HEAP_HEADER && evm_heap_valid(evm, heap, prev, false)
+           && evm_heap_size(evm_load64(evm, prev - HEAP_HEADER)) == prev_size
+           && evm_heap_unlink(evm, heap, prev, prev_size)){
+            prev_flags = evm_load64(evm, prev - HEAP_HEADER) & HEAP_PREV;
+            p = prev;
+            size += prev_size;
+        }
+    }
+    if(p - HEAP_HEADER + size == heap->top){
+        heap->top -= size;
+        heap->stats.heap_bytes -= size;
+        return;
+    }
+    size_t list = evm_heap_list(size);
+    evm_store64(evm, p - HEAP_HEADER, size | prev_flags);
+    evm_store64(evm, p - 2 * HEAP_HEADER + size, size);    //the link takes its place in a minimum block
+    evm_store64(evm, p, heap->free_lists[list]);
+    heap->free_lists[list] = p;
+    heap->stats.free_bytes += size;
+    evm_heap_mark_next(evm, heap, p, size, true);
+}
+
+/**Unlinks the first block of at least `*size` bytes from list `list`, 0 if there is none.
+   A block from the first fit list is split when the rest can stand alone*/
+static Evm_Err evm_heap_fit(Evm *evm, Evm_Heap *heap, size_t list, uint64_t *size, Addr *out)
+{
+    Addr prev = 0;
+    size_t limit = heap->stats.heap_bytes / EVM_HEAP_MIN_BLOCK;  //a cycle written by the program ends here
+    *out = 0;
+    for(Addr p = heap->free_lists[list]; p != 0; prev = p, p = evm_load64(evm, p)){
+        if(!evm_heap_valid(evm, heap, p, false) || limit-- == 0) return EVM_ERR_BAD_POINTER;
+        uint64_t have = evm_heap_size(evm_load64(evm, p - HEAP_HEADER));
+        if(have < *size) continue;
+        Addr next = evm_load64(evm, p);
+        if(prev == 0) heap->free_lists[list] = next;
+        else evm_store64(evm, prev, next);
+        heap->stats.free_bytes -= have;
+        if(list == EVM_HEAP_CLASSES && have - *size >= EVM_HEAP_MIN_BLOCK){
+            evm_store64(evm, p + *size - HEAP_HEADER, have - *size);    //follows a used block
+            evm_heap_put(evm, heap, p + *size, have - *size);
+        } else {
+            *size = have;
+        }
+        *out = p;
+        return EVM_ERR_OK;
+    }
+    return EVM_ERR_OK;
+}
+
+/**Hands out a block for `n` bytes: its own class list, the uncarved tail, then any larger free block*/
+static Evm_Err evm_heap_take(Evm *evm, Evm_Heap *heap, Data n, Addr *out)
+{
+    *out = 0;
+    if(n > evm->memory_capacity) return EVM_ERR_OK;
+    uint64_t size = evm_heap_block_size(n);
+    size_t list = evm_heap_list(size);
+    Addr p = 0;
+    Evm_Err err = evm_heap_fit(evm, heap, list, &size, &p);
+    if(err != EVM_ERR_OK) return err;
+    bool carved = p == 0 && size <= evm->memory_capacity - heap->top;
+    if(carved){
+        p = heap->top + HEAP_HEADER;
+        heap->top += size;
+        heap->stats.heap_bytes += size;
+    }
+    for(size_t i = list + 1; p == 0 && i <= EVM_HEAP_CLASSES; ++i){
+        if((err = evm_heap_fit(evm, heap, i, &size, &p)) != EVM_ERR_OK) return err;
+    }
+    if(p == 0) return EVM_ERR_OK;
+
+    //free blocks never end at the top, they merge into it
+    Data prev_flags = carved ? 0 : evm_load64(evm, p - HEAP_HEADER) & HEAP_PREV;
+    evm_store64(evm, p - HEAP_HEADER, (n << 32) | size | HEAP_USED | prev_flags);
+    evm_heap_mark_next(evm, heap, p, size, false);
+    heap->stats.live_bytes += size;
+    heap->stats.requested_bytes += n;
+    if(heap->stats.live_bytes > heap->stats.peak_bytes) heap->stats.peak_bytes = heap->stats.live_bytes;
+    *out = p;
+    return EVM_ERR_OK;
+}
+
+/**Frees a block evm_heap_valid accepted as used*/
+static void evm_heap_give(Evm *evm, Evm_Heap *heap, Addr p)
+{
+    Data header = evm_load64(evm, p - HEAP_HEADER);
+    heap->stats.live_bytes -= evm_heap_size(header);
+    heap->stats.requested_bytes -= header >> 32;
+    evm_heap_put(evm, heap, p, evm_heap_size(header));
+}
+
+static Evm_Err evm_heap_alloc(Evm *evm, Data n, Data *out)
+{
+    Evm_Heap *heap = evm_heap_acquire(evm);
+    Evm_Err err = evm_heap_take(evm, heap, n, out);
+    heap->stats.allocs++;
+    if(err == EVM_ERR_OK && *out == 0) heap->stats.failed++;
+    evm_heap_release(heap);
+    return err;
+}
+
+static Evm_Err evm_heap_free(Evm *evm, Addr p)
+{
+    if(p == 0) return EVM_ERR_OK;
+    Evm_Heap *heap = evm_heap_acquire(evm);
+    Evm_Err err = EVM_ERR_BAD_POINTER;
+    if(evm_heap_valid(evm, heap, p, true)){
+        evm_heap_give(evm, heap, p);
+        heap->stats.frees++;
+        err = EVM_ERR_OK;
+    }
+    evm_heap_release(heap);
+    return err;
+}
+
+/**In place when the block is big enough or ends the carved part of the heap, else moves it.
+   On failure the old block stays allocated*/
+static Evm_Err evm_heap_realloc(Evm *evm, Addr p, Data n, Data *out)
+{
+    if(p == 0) return evm_heap_alloc(evm, n, out);
+    if(n == 0){
+        *out = 0;
+        return evm_heap_free(evm, p);
+    }
+    Evm_Heap *heap = evm_heap_acquire(evm);
+    heap->stats.reallocs++;
+    if(!evm_heap_valid(evm, heap, p, true)){
+        evm_heap_release(heap);
+        return EVM_ERR_BAD_POINTER;
+    }
+    Data header = evm_load64(evm, p - HEAP_HEADER);
+    uint64_t size = evm_heap_size(header), old_n = header >> 32;
+    uint64_t need = n <= evm->memory_capacity ? evm_heap_block_size(n) : UINT64_MAX;
+    bool at_top = p - HEAP_HEADER + size == heap->top;
+    Evm_Err err = EVM_ERR_OK;
+    if(need <= size || (at_top && need - size <= evm->memory_capacity - heap->top)){
+        if(need > size){
+            heap->top += need - size;
+            heap->stats.heap_bytes += need - size;
+            heap->stats.live_bytes += need - size;
+            if(heap->stats.live_bytes > heap->stats.peak_bytes) heap->stats.peak_bytes = heap->stats.live_bytes;
+            size = need;
+        }
+        evm_store64(evm, p - HEAP_HEADER, (n << 32) | size | HEAP_USED | (header & HEAP_PREV));
+        heap->stats.requested_bytes += n - old_n;
+        *out = p;
+    } else if((err = evm_heap_take(evm, heap, n, out)) == EVM_ERR_OK && *out != 0){
+        memmove(evm->memory + *out, evm->memory + p, old_n < n ? old_n : n);
+        evm_heap_give(evm, heap, p);
+    }
+    if(err == EVM_ERR_OK && *out == 0) heap->stats.failed++;
+    evm_heap_release(heap);
+    return err;
+}
+
+void evm_heap_stats(Evm *evm, Evm_Heap_Stats *stats)
+{
+    Evm_Heap *heap = evm_heap_acquire(evm);
+    *stats = heap->stats;
+    evm_heap_release(heap);
+}
+
+/* Tiered execution: backward branches are counted per target address, a hot loop head
+   gets one iteration recorded and compiled to an Evm_Trace, and later iterations run the
+   trace until one of its guards fails. */
+
+/**Where the interpreter went after the recorded instruction*/
+static Addr evm_trace_entry_next(Evm_Trace_Entry e)
+{
+    switch((Evm_Opcode) e.inst){
+        case EVM_INST_PUSH:
+        case EVM_INST_PUSHR:
+        case EVM_INST_DUP:  return e.ip + 2;
+        case EVM_INST_JP:   return e.target;
+        case EVM_INST_JR:   return e.ip + 1 + e.target;
+        case EVM_INST_JPC:  return e.taken ? e.target : e.ip + 1;
+        case EVM_INST_JRC:  return e.taken ? e.ip + 1 + e.target : e.ip + 1;
+        case EVM_INST_SWAP:
+        case EVM_INST_ADD:
+        case EVM_INST_SUB:
+        case EVM_INST_MULTU:
+        case EVM_INST_GT:
+        case EVM_INST_LT:
+        case EVM_INST_EQ:
+        case EVM_INST_GE:
+        case EVM_INST_LE:
+        case EVM_INST_READ8:
+        case EVM_INST_READ64:
+        case EVM_INST_WRITE8:
+        case EVM_INST_WRITE64:
+        case EVM_INST_PUTS:
+        case EVM_INST_PRINTU:
+        case EVM_INST_CALL:
+        case EVM_INST_RET:
+        case EVM_INST_HALT:
+        case EVM_INST_NATIVE:
+        case EVM_INST_MULW:
+        case EVM_INST_ADDC:
+        case EVM_INST_DIVU:
+        case EVM_INST_MODU:
+        case EVM_INST_VADD:
+        case EVM_INST_VMUL:
+        case EVM_INST_VSUM:
+        case EVM_INST_FDREAD:
+        case EVM_INST_FDWRITE:
+        case EVM_INST_SPAWN:
+        case EVM_INST_JOIN:
+        case EVM_INST_ALOAD:
+        case EVM_INST_ASTORE:
+        case EVM_INST_CAS:
+        case EVM_INST_FADD:
+        case EVM_INST_ALLOC:
+        case EVM_INST_FREE:
+        case EVM_INST_REALLOC:
+        case EVM_INST_ENTER:
+        case EVM_INST_LEAVE:
+        case EVM_INST_LOAD_LOCAL:
+        case EVM_INST_STORE_LOCAL:
+        case EVM_INST_CALLR:
+        case EVM_INST_COUNT:
+        default:            return e.ip + 1;
+    }
+}
+
+/**NULL when out of memory or when `rec` is not one unbroken path from `head` back to it*/
+static Evm_Trace *evm_tier_compile(Evm *evm, Evm_Trace_Entries rec, Addr head)
+{
+    for(size_t i = 0; i < rec.size; ++i){
+        Addr expected = i == 0 ? head : evm_trace_entry_next(rec.items[i - 1]);
+        if(rec.items[i].ip != expected) return NULL;
+    }
+    if(rec.size == 0 || evm_trace_entry_next(rec.items[rec.size - 1]) != head) return NULL;
+
+    Evm_Trace *trace = evm_realloc(evm, NULL, 0, sizeof(*trace));
+    if(trace == NULL) return NULL;
+    memset(trace, 0, sizeof(*trace));
+    trace->head = head;
+    if(!evm_da_reserve(evm, trace, rec.size)){
+        evm_dealloc(evm, trace, sizeof(*trace));
+        return NULL;
+    }
+
+    int32_t d = 0, lo = 0, hi = 0;
+    #define SLOT(x) (lo = ((x) < lo ? (x) : lo), (x))
+
+    for(size_t i = 0; i < rec.size; ++i){
+        Evm_Trace_Entry e = rec.items[i];
+        Evm_Trace_Op op = {.kind = (Evm_Opcode) e.inst, .ip = e.ip, .next_ip = e.ip + 1, .taken = e.taken};
+        switch((Evm_Opcode) e.inst){
+            case EVM_INST_PUSH:
+            case EVM_INST_PUSHR:    //the address was resolved while recording
+                op.kind = EVM_INST_PUSH;
+                op.next_ip = e.ip + 2;
+                op.imm = e.imm;
+                op.dst = d++;
+            break;
+            case EVM_INST_DUP:
+                op.next_ip = e.ip + 2;
+                op.a = SLOT(d - 1 - (int32_t) e.imm);   //e.imm < EVM_STACK_MAX, checked while recording
+                op.dst = d++;
+            break;
+            case EVM_INST_SWAP:
+                op.a = SLOT(d - 1);
+                op.b = SLOT(d - 2);
+            break;
+            case EVM_INST_ADD:
+            case EVM_INST_SUB:
+            case EVM_INST_MULTU:
+            case EVM_INST_GT:
+            case EVM_INST_LT:
+            case EVM_INST_EQ:
+            case EVM_INST_GE:
+            case EVM_INST_LE: {
+                op.a = SLOT(d - 1);
+                op.b = SLOT(d - 2);
+                op.dst = --d - 1;
+                //fold `push imm; op` so the constant never touches the stack
+                Evm_Trace_Op *prev = trace->size > 0 ? &trace->items[trace->size - 1] : NULL;
+                if(prev && prev->kind == EVM_INST_PUSH && prev->dst == op.a){
+                    op.imm_operand = true;
+                    op.imm = prev->imm;
+                    trace->size--;
+                }
+            }
+            break;
+            case EVM_INST_READ8:
+            case EVM_INST_READ64:
+                op.a = SLOT(d - 1);
+                op.dst = d - 1;
+            break;
+            case EVM_INST_WRITE8:
+            case EVM_INST_WRITE64:
+            case EVM_INST_PUTS:
+                op.a = SLOT(d - 1);
+                op.b = SLOT(d - 2);
+                d -= 2;
+            break;
+            case EVM_INST_PRINTU:
+            case EVM_INST_JP:
+            case EVM_INST_JR:
+                op.a = SLOT(d - 1);
+                op.imm = e.target;
+                d -= 1;
+            break;
+            case EVM_INST_JPC:
+            case EVM_INST_JRC:
+                op.a = SLOT(d - 1);
+                op.b = SLOT(d - 2);
+                op.imm = e.target;
+                d -= 2;
+            break;
+            case EVM_INST_CALL:
+            case EVM_INST_RET:
+            case EVM_INST_HALT:
+            case EVM_INST_NATIVE:
+            case EVM_INST_MULW:
+            case EVM_INST_ADDC:
+            case EVM_INST_DIVU:
+            case EVM_INST_MODU:
+            case EVM_INST_VADD:
+            case EVM_INST_VMUL:
+            case EVM_INST_VSUM:
+            case EVM_INST_FDREAD:
+            case EVM_INST_FDWRITE:
+            case EVM_INST_SPAWN:
+            case EVM_INST_JOIN:
+            case EVM_INST_ALOAD:
+            case EVM_INST_ASTORE:
+            case EVM_INST_CAS:
+            case EVM_INST_FADD:
+            case EVM_INST_ALLOC:
+            case EVM_INST_FREE:
+            case EVM_INST_REALLOC:
+            case EVM_INST_ENTER:
+            case EVM_INST_LEAVE:
+            case EVM_INST_LOAD_LOCAL:
+            case EVM_INST_STORE_LOCAL:
+            case EVM_INST_CALLR:
+            case EVM_INST_COUNT:
+            default:
+                UNREACHABLE; //rejected while recording
+        }
+        if(d > hi) hi = d;
+        op.depth = d;
+        op.insts = i + 1;
+        trace->items[trace->size++] = op;
+    }
+    #undef SLOT
+
+    trace->min_depth = (size_t) -lo;
+    trace->max_growth = (size_t) hi;
+    trace->net = d;
+    trace->insts = rec.size;
+    return trace;
+}
+
+static void evm_tier_record(Evm *evm)
+{
+    Evm_Tier *tier = &evm->tier;
+    if(evm->ip == tier->rec_head && tier->rec.size > 0){
+        Evm_Hot_Slot *slot = &tier->slots[tier->rec_head];
+        slot->trace = evm_tier_compile(evm, tier->rec, tier->rec_head);
+        if(slot->trace) tier->traces_compiled++;
+        evm_tier_abort(evm);
+        return;
+    }
+
+    if(tier->rec.size >= EVM_TIER_MAX_TRACE_LEN || evm->ip >= evm->program.size){
+        evm_tier_abort(evm);
+        return;
+    }
+
+    Evm_Trace_Entry e = {.ip = evm->ip, .inst = evm->program.items[evm->ip]};
+    switch((Evm_Opcode) e.inst){
+        case EVM_INST_PUSH:
+        case EVM_INST_PUSHR:
+        case EVM_INST_DUP:
+            if(evm->ip + 1 >= evm->program.size){
+                evm_tier_abort(evm);
+                return;
+            }
+            e.imm = evm->program.items[evm->ip + 1];
+            if(e.inst == EVM_INST_PUSHR) e.imm += evm->ip + 2;
+            //a dup that faults here is no loop worth a trace, and the compiled slot math needs imm < depth
+            if(e.inst == EVM_INST_DUP && e.imm >= evm->stack.size){
+                evm_tier_abort(evm);
+                return;
+            }
+        break;
+        case EVM_INST_JP:
+        case EVM_INST_JR:
+            if(evm->stack.size < 1){
+                evm_tier_abort(evm);
+                return;
+            }
+            e.target = evm->stack.items[evm->stack.size - 1];
+        break;
+        case EVM_INST_JPC:
+        case EVM_INST_JRC:
+            if(evm->stack.size < 2){
+                evm_tier_abort(evm);
+                return;
+            }
+            e.taken = evm->stack.items[evm->stack.size - 1] != 0;
+            e.target = evm->stack.items[evm->stack.size - 2];
+        break;
+        case EVM_INST_SWAP:
+        case EVM_INST_ADD:
+        case EVM_INST_SUB:
+        case EVM_INST_MULTU:
+        case EVM_INST_GT:
+        case EVM_INST_LT:
+        case EVM_INST_EQ:
+        case EVM_INST_GE:
+        case EVM_INST_LE:
+        case EVM_INST_READ8:
+        case EVM_INST_READ64:
+        case EVM_INST_WRITE8:
+        case EVM_INST_WRITE64:
+        case EVM_INST_PRINTU:
+        break;
+        case EVM_INST_PUTS:
+            if(evm->io_async){
+                evm_tier_abort(evm);
+                return;
+            }
+        break;
+        //calls leave the loop body and halts end it, neither is worth a trace
+        case EVM_INST_CALL:
+        case EVM_INST_RET:
+        case EVM_INST_HALT:
+        case EVM_INST_NATIVE:
+        case EVM_INST_MULW:
+        case EVM_INST_ADDC:
+        case EVM_INST_DIVU:
+        case EVM_INST_MODU:
+        case EVM_INST_VADD:
+        case EVM_INST_VMUL:
+        case EVM_INST_VSUM:
+        case EVM_INST_FDREAD:
+        case EVM_INST_FDWRITE:
+        case EVM_INST_SPAWN:
+        case EVM_INST_JOIN:
+        case EVM_INST_ALOAD:
+        case EVM_INST_ASTORE:
+        case EVM_INST_CAS:
+        case EVM_INST_FADD:
+        case EVM_INST_ALLOC:
+        case EVM_INST_FREE:
+        case EVM_INST_REALLOC:
+        case EVM_INST_ENTER:
+        case EVM_INST_LEAVE:
+        case EVM_INST_LOAD_LOCAL:
+        case EVM_INST_STORE_LOCAL:
+        case EVM_INST_CALLR:
+        case EVM_INST_COUNT:
+        default:
+            evm_tier_abort(evm);
+            return;
+    }
+    if(!evm_da_reserve(evm, &tier->rec, 1)){
+        evm_tier_abort(evm);
+        return;
+    }
+    tier->rec.items[tier->rec.size++] = e;
+}
+
+/**Runs `trace` until a guard fails or `*budget` cannot cover another iteration, leaving
+  evm->ip and the stack as the interpreter would. Does nothing if the stack cannot satisfy
+  the trace's slots*/
+static Evm_Err evm_trace_run(Evm *evm, const Evm_Trace *trace, uint64_t *budget)
+{
+    if(evm->stack.size < trace->min_depth || *budget < trace->insts) return EVM_ERR_OK;
+    evm->tier.traces_entered++;
+
+    #define TRACE_EXIT(i) do {                                          \
+        evm->stack.size += (i) > 0 ? trace->items[(i) - 1].depth : 0;   \
+        evm->retired += (i) > 0 ? trace->items[(i) - 1].insts : 0;      \
+        *budget -= (i) > 0 ? trace->items[(i) - 1].insts : 0;           \
+    } while(0)
+
+    while(true){
+        Evm_Err err = stack_reserve(evm, &evm->stack, trace->max_growth, EVM_STACK_MAX);
+        if(err != EVM_ERR_OK){
+            evm->ip = trace->head;
+            return err;
+        }
+        Data *s = evm->stack.items + evm->stack.size;
+
+        for(size_t i = 0; i < trace->size; ++i){
+            const Evm_Trace_Op *op = &trace->items[i];
+            #define OPERAND_A (op->imm_operand ? op->imm : s[op->a])
+            switch(op->kind){
+                case EVM_INST_PUSH:  s[op->dst] = op->imm;                      break;
+                case EVM_INST_DUP:   s[op->dst] = s[op->a];                     break;
+                case EVM_INST_SWAP: {
+                    Data t = s[op->a];
+                    s[op->a] = s[op->b];
+                    s[op->b] = t;
+                }
+                break;
+                case EVM_INST_ADD:   s[op->dst] = s[op->b] + OPERAND_A;         break;
+                case EVM_INST_SUB:   s[op->dst] = s[op->b] - OPERAND_A;         break;
+                case EVM_INST_MULTU: s[op->dst] = s[op->b] * OPERAND_A;         break;
+                case EVM_INST_GT:    s[op->dst] = OPERAND_A > s[op->b];         break;
+                case EVM_INST_LT:    s[op->dst] = OPERAND_A < s[op->b];         break;
+                case EVM_INST_EQ:    s[op->dst] = OPERAND_A == s[op->b];        break;
+                case EVM_INST_GE:    s[op->dst] = OPERAND_A >= s[op->b];        break;
+                case EVM_INST_LE:    s[op->dst] = OPERAND_A <= s[op->b];        break;
+                case EVM_INST_READ8:
+                case EVM_INST_READ64:
+                case EVM_INST_WRITE8:
+                case EVM_INST_WRITE64:
+                case EVM_INST_PUTS: {
+                    bool wide = op->kind == EVM_INST_READ64 || op->kind == EVM_INST_WRITE64;
+                    Addr addr = OPERAND_A;
+                    size_t n = op->kind == EVM_INST_PUTS ? s[op->b] : wide ? sizeof(Data) : 1;
+                    if(!evm_mem_ok(evm, addr, n)){
+                        TRACE_EXIT(i);
+                        evm->ip = op->ip;
+                        return EVM_ERR_MEMORY_OUT_OF_BOUNDS;
+                    }
+                    if(op->kind == EVM_INST_READ8) s[op->dst] = evm->memory[addr];
+                    else if(op->kind == EVM_INST_READ64) s[op->dst] = evm_load64(evm, addr);
+                    else if(op->kind == EVM_INST_WRITE8) evm->memory[addr] = s[op->b];
+                    else if(op->kind == EVM_INST_WRITE64) evm_store64(evm, addr, s[op->b]);
+                    else {
+                        fwrite(&evm->memory[addr], n, 1, stdout);
+                        fflush(stdout);
+                        evm->counters.io_write_bytes += n;
+                    }
+                }
+                break;
+                case EVM_INST_PRINTU:  printf("%zu", OPERAND_A);                break;
+                case EVM_INST_JP:
+                case EVM_INST_JR: {
+                    Data target = OPERAND_A;
+                    if(target != op->imm){
+                        TRACE_EXIT(i + 1);
+                        evm->ip = op->kind == EVM_INST_JP ? target : op->next_ip + target;
+                        evm->tier.guard_exits++;
+                        return EVM_ERR_OK;
+                    }
+                }
+                break;
+                case EVM_INST_JPC:
+                case EVM_INST_JRC: {
+                    bool taken = OPERAND_A != 0;
+                    Data target = s[op->b];
+                    if(taken != op->taken || (taken && target != op->imm)){
+                        TRACE_EXIT(i + 1);
+                        if(!taken) evm->ip = op->next_ip;
+                        else evm->ip = op->kind == EVM_INST_JPC ? target : op->next_ip + target;
+                        evm->tier.guard_exits++;
+                        return EVM_ERR_OK;
+                    }
+                }
+                break;
+                case EVM_INST_CALL:
+                case EVM_INST_RET:
+                case EVM_INST_HALT:
+                case EVM_INST_NATIVE:
+                case EVM_INST_MULW:
+                case EVM_INST_ADDC:
+                case EVM_INST_DIVU:
+                case EVM_INST_MODU:
+                case EVM_INST_VADD:
+                case EVM_INST_VMUL:
+                case EVM_INST_VSUM:
+                case EVM_INST_FDREAD:
+                case EVM_INST_FDWRITE:
+                case EVM_INST_SPAWN:
+                case EVM_INST_JOIN:
+                case EVM_INST_ALOAD:
+                case EVM_INST_ASTORE:
+                case EVM_INST_CAS:
+                case EVM_INST_FADD:
+                case EVM_INST_ALLOC:
+                case EVM_INST_FREE:
+                case EVM_INST_REALLOC:
+                case EVM_INST_ENTER:
+                case EVM_INST_LEAVE:
+                case EVM_INST_LOAD_LOCAL:
+                case EVM_INST_STORE_LOCAL:
+                case EVM_INST_CALLR:
+                case EVM_INST_PUSHR:
+                case EVM_INST_COUNT:
+                default:
+                    UNREACHABLE;
+            }
+            #undef OPERAND_A
+        }
+
+        evm->stack.size += trace->net;
+        evm->retired += trace->insts;
+        *budget -= trace->insts;
+        if(evm->stack.size < trace->min_depth || *budget < trace->insts){
+            evm->ip = trace->head;
+            return EVM_ERR_OK;
+        }
+    }
+    #undef TRACE_EXIT
+}
+
+/**Called after a branch lands on evm->ip at or before the branch itself*/
+static Evm_Err evm_tier_backedge(Evm *evm, uint64_t *budget)
+{
+    Evm_Tier *tier = &evm->tier;
+    if(evm->ip >= evm->program.size) return EVM_ERR_OK;
+    if(tier->slots == NULL){
+        size_t size = evm->program.size * sizeof(*tier->slots);
+        tier->slots = evm_realloc(evm, NULL, 0, size);
+        if(tier->slots == NULL) return EVM_ERR_OUT_OF_MEMORY;
+        memset(tier->slots, 0, size);
+    }
+
+    Evm_Hot_Slot *slot = &tier->slots[evm->ip];
+    //an inner loop run as a trace would be missing from the recording of the loop around it
+    if(slot->trace != NULL && !tier->recording) return evm_trace_run(evm, slot->trace, budget);
+
+    if(tier->recording || slot->attempts >= EVM_TIER_MAX_ATTEMPTS) return EVM_ERR_OK;
+    if(++slot->hits >= EVM_TIER_HOT_THRESHOLD){
+        slot->hits = 0;
+        slot->attempts++;
+        tier->recording = true;
+        tier->rec_head = evm->ip;
+        tier->rec.size = 0;
+    }
+    return EVM_ERR_OK;
+}
+
+/* Wide arithmetic and vector kernels. Vector operands are runs of 64-bit words in data memory
+   (any alignment); the kernels use AVX2 or SSE2 when the build targets them. Overlapping
+   ranges other than dst == a or dst == b give unspecified results */
+
+#if defined(__SIZEOF_INT128__)
+__extension__ typedef unsigned __int128 Evm_U128;
+
+static void evm_mulw(Data a, Data b, Data *lo, Data *hi)
+{
+    Evm_U128 r = (Evm_U128) a * b;
+    *lo = (Data) r;
+    *hi = (Data) (r >> 64);
+}
+#else
+static void evm_mulw(Data a, Data b, Data *lo, Data *hi)
+{
+    Data a0 = a & 0xffffffff, a1 = a >> 32;
+    Data b0 = b & 0xffffffff, b1 = b >> 32;
+    Data p00 = a0 * b0, p01 = a0 * b1, p10 = a1 * b0, p11 = a1 * b1;
+    Data mid = (p00 >> 32) + (p01 & 0xffffffff) + (p10 & 0xffffffff);
+    *lo = (mid << 32) | (p00 & 0xffffffff);
+    *hi = p11 + (p01 >> 32) + (p10 >> 32) + (mid >> 32);
+}
+#endif
+
+static void evm_vbinop(uint8_t *dst, const uint8_t *a, const uint8_t *b, size_t n, bool mul)
+{
+    size_t i = 0;
+#if defined(__AVX2__)
+    for(; i + 4 <= n; i += 4){
+        __m256i va = _mm256_loadu_si256((const __m256i *) (a + i * 8));
+        __m256i vb = _mm256_loadu_si256((const __m256i *) (b + i * 8));
+        __m256i vr = mul ? mul64x4(va, vb) : _mm256_add_epi64(va, vb);
+        _mm256_storeu_si256((__m256i *) (dst + i * 8), vr);
+    }
+#elif defined(__SSE2__)
+    for(; i + 2 <= n; i += 2){
+        __m128i va = _mm_loadu_si128((const __m128i *) (a + i * 8));
+        __m128i vb = _mm_loadu_si128((const __m128i *) (b + i * 8));
+        __m128i vr = mul ? mul64x2(va, vb) : _mm_add_epi64(va, vb);
+        _mm_storeu_si128((__m128i *) (dst + i * 8), vr);
+    }
+#endif
+    for(; i < n; ++i){
+        Data x, y;
+        memcpy(&x, a + i * 8, 8);
+        memcpy(&y, b + i * 8, 8);
+        Data r = mul ? x * y : x + y;
+        memcpy(dst + i * 8, &r, 8);
+    }
+}
+
+static Data evm_vsum(const uint8_t *p, size_t n)
+{
+    size_t i = 0;
+    Data sum = 0;
+#if defined(__AVX2__)
+    __m256i acc = _mm256_setzero_si256();
+    for(; i + 4 <= n; i += 4) acc = _mm256_add_epi64(acc, _mm256_loadu_si256((const __m256i *) (p + i * 8)));
+    Data lanes[4];
+    _mm256_storeu_si256((__m256i *) lanes, acc);
+    sum = lanes[0] + lanes[1] + lanes[2] + lanes[3];
+#elif defined(__SSE2__)
+    __m128i acc = _mm_setzero_si128();
+    for(; i + 2 <= n; i += 2) acc = _mm_add_epi64(acc, _mm_loadu_si128((const __m128i *) (p + i * 8)));
+    Data lanes[2];
+    _mm_storeu_si128((__m128i *) lanes, acc);
+    sum = lanes[0] + lanes[1];
+#endif
+    for(; i < n; ++i){
+        Data x;
+        memcpy(&x, p + i * 8, 8);
+        sum += x;
+    }
+    return sum;
+}
+
+/**Bounds check for a run of `n` words at `addr`*/
+static bool evm_vec_ok(Evm *evm, Addr addr, Data n)
+{
+    return n <= evm->memory_capacity / sizeof(Data) && evm_mem_ok(evm, addr, n * sizeof(Data));
+}
+
+#if defined(__GNUC__)
+#define EVM_ALWAYS_INLINE __attribute__((always_inline)) inline
+#else
+#define EVM_ALWAYS_INLINE inline
+#endif
+
+/**The interpreter body, instantiated once per encoding (and once more for profiling) so the
+   fetch/decode branches fold away*/
+static EVM_ALWAYS_INLINE Evm_Err evm_exec(Evm *evm, uint64_t budget, const bool compact, const bool profile)
+{
+    Evm_Err err = EVM_ERR_OK;
+    Addr inst_ip = evm->ip;
+    const size_t program_size = compact ? evm->code.size : evm->program.size;
+
+    #define FAULT(e) do { evm->ip = inst_ip; return (e); } while(0)
+    #define CHECK(e) do { if((err = (e)) != EVM_ERR_OK) FAULT(err); } while(0)
+    #define NEED(n) do { if(evm->stack.size < (n)) FAULT(EVM_ERR_STACK_UNDERFLOW); } while(0)
+    #define ROOM(n) do {                                                               \
+        if(evm->stack.capacity - evm->stack.size < (n))                                \
+            CHECK(stack_reserve(evm, &evm->stack, (n), EVM_STACK_MAX));                \
+    } while(0)
+    #define POP() (evm->stack.items[--evm->stack.size])
+    #define PUSH(x) (evm->stack.items[evm->stack.size++] = (x))
+    #define TOP(i) (evm->stack.items[evm->stack.size - 1 - (i)])
+    #define IMM(x) do {                                                                \
+        if(evm->ip >= program_size) FAULT(EVM_ERR_IP_OUT_OF_BOUNDS);                    \
+        if(!compact) (x) = evm->program.items[evm->ip++];                              \
+        else if(evm->code.items[evm->ip] < 0x80) (x) = zigzag_decode(evm->code.items[evm->ip++]); \
+        else {                                                                         \
+            uint64_t z;                                                                \
+            size_t n = leb128_decode(evm->code.items + evm->ip, program_size - evm->ip, &z); \
+            if(n == 0) FAULT(EVM_ERR_IP_OUT_OF_BOUNDS);                                 \
+            evm->ip += n;                                                              \
+            (x) = zigzag_decode(z);                                                    \
+        }                                                                              \
+    } while(0)
+    #define MEM(addr, n) do { if(!evm_mem_ok(evm, (addr), (n))) FAULT(EVM_ERR_MEMORY_OUT_OF_BOUNDS); } while(0)
+    #define ATOMIC(addr) do {                                                          \
+        MEM((addr), sizeof(Data));                                                     \
+        if((addr) % sizeof(Data) != 0) FAULT(EVM_ERR_MISALIGNED);                      \
+    } while(0)
+    #define BACKEDGE() do {                                                            \
+        if(!compact && !profile && evm->tier.enabled && evm->ip <= inst_ip)            \
+            CHECK(evm_tier_backedge(evm, &budget));                                    \
+    } while(0)
+
+    while(budget > 0){
+        if(!compact && !profile && evm->tier.recording) evm_tier_record(evm);
+        inst_ip = evm->ip;
+        if(evm->ip >= program_size) FAULT(EVM_ERR_IP_OUT_OF_BOUNDS);
+        if(profile) evm->profile[inst_ip]++;
+        Evm_Inst inst = compact ? evm->code.items[evm->ip++] : evm->program.items[evm->ip++];
+        evm->retired++;
+        budget--;
+        switch(inst){
+            case EVM_INST_PUSH: {
+                Data a;
+                IMM(a);
+                ROOM(1);
+                PUSH(a);
+            }
+            break;
+            case EVM_INST_DUP: {
+                Data offset;
+                IMM(offset);
+                if(offset >= evm->stack.size) FAULT(EVM_ERR_STACK_UNDERFLOW);
+                ROOM(1);
+                Data a = TOP(offset);
+                PUSH(a);
+            }
+            break;
+            case EVM_INST_SWAP: {
+                NEED(2);
+                Data a = TOP(0);
+                TOP(0) = TOP(1);
+                TOP(1) = a;
+            }
+            break;
+            case EVM_INST_ADD:{
+                NEED(2);
+                Data a = POP();
+                TOP(0) = TOP(0) + a;
+            }
+            break;
+            case EVM_INST_SUB:{
+                NEED(2);
+                Data a = POP();
+                TOP(0) = TOP(0) - a;
+            }
+            break;
+            case EVM_INST_MULTU: {
+                NEED(2);
+                Data a = POP();
+                TOP(0) = TOP(0) * a;
+            }
+            break;
+            case EVM_INST_GT: {
+                NEED(2);
+                Data a = POP();
+                TOP(0) = a > TOP(0);
+            }
+            break;
+            case EVM_INST_LT: {
+                NEED(2);
+                Data a = POP();
+                TOP(0) = a < TOP(0);
+            }
+            break;
+            case EVM_INST_EQ: {
+                NEED(2);
+                Data a = POP();
+                TOP(0) = a == TOP(0);
+            }
+            break;
+            case EVM_INST_GE: {
+                NEED(2);
+                Data a = POP();
+                TOP(0) = a >= TOP(0);
+            }
+            break;
+            case EVM_INST_LE: {
+                NEED(2);
+                Data a = POP();
+                TOP(0) = a <= TOP(0);
+            }
+            break;
+            case EVM_INST_READ8: {
+                NEED(1);
+                Addr src = (Addr) TOP(0);
+                MEM(src, 1);
+                TOP(0) = evm->memory[src];
+            }
+            break;
+            case EVM_INST_READ64: {
+                NEED(1);
+                Addr src = (Addr) TOP(0);
+                MEM(src, sizeof(Data));
+                TOP(0) = evm_load64(evm, src);
+            }
+            break;
+            case EVM_INST_WRITE8: {
+                NEED(2);
+                Addr dst = (Addr) POP();
+                Data a = POP();
+                MEM(dst, 1);
+                evm->memory[dst] = a;
+            }
+            break;
+            case EVM_INST_WRITE64:{
+                NEED(2);
+                Addr dst = (Addr) POP();
+                Data a = POP();
+                MEM(dst, sizeof(Data));
+                evm_store64(evm, dst, a);
+            }
+            break;
+            case EVM_INST_PRINTU: {
+                NEED(1);
+                Data a = POP();
+                printf("%zu", a);
+            }
+            break;
+            case EVM_INST_PUTS: {
+                NEED(2);
+                Addr ptr = (Addr) POP();
+                Data size = POP();
+                MEM(ptr, size);
+                if(evm->io_async){
+                    evm->io = (Evm_Io) {.kind = EVM_IO_PUTS, .fd = STDOUT_FILENO, .addr = ptr, .size = size};
+                    return EVM_ERR_IO_PENDING;
+                }
+                fwrite(&evm->memory[ptr], size, 1, stdout);
+                fflush(stdout);
+                evm->counters.io_write_bytes += size;
+            }
+            break;
+            case EVM_INST_FDREAD:
+            case EVM_INST_FDWRITE: {
+                NEED(3);
+                int fd = evm_host_fd(evm, TOP(0));
+                Addr ptr = TOP(1);
+                Data size = TOP(2);
+                MEM(ptr, size);
+                evm->stack.size -= 3;
+                if(fd < 0){
+                    PUSH((Data) -EBADF);
+                    break;
+                }
+                Evm_Io_Kind kind = inst == EVM_INST_FDREAD ? EVM_IO_READ : EVM_IO_WRITE;
+                if(evm->io_async){
+                    evm->io = (Evm_Io) {.kind = kind, .fd = fd, .addr = ptr, .size = size};
+                    return EVM_ERR_IO_PENDING;
+                }
+                if(kind == EVM_IO_WRITE && fd == STDOUT_FILENO) fflush(stdout);
+                ssize_t n = kind == EVM_IO_READ ? read(fd, evm->memory + ptr, size)
+                                                : write(fd, evm->memory + ptr, size);
+                if(n > 0 && kind == EVM_IO_READ) evm->counters.io_read_bytes += (uint64_t) n;
+                if(n > 0 && kind == EVM_IO_WRITE) evm->counters.io_write_bytes += (uint64_t) n;
+                PUSH(n < 0 ? (Data) -errno : (Data) n);
+            }
+            break;
+            case EVM_INST_CALL: {
+                NEED(1);
+                Addr func_addr = (Addr) POP();
+                CHECK(stack_reserve(evm, &evm->call_stack, 1, EVM_CALL_STACK_MAX));
+                evm->call_stack.items[evm->call_stack.size++] = evm->ip;
+                evm_call_pushed(evm);
+                evm->ip = func_addr;
+            }
+            break;
+            case EVM_INST_RET:{
+                if(evm->call_stack.size == 0) FAULT(EVM_ERR_CALL_STACK_UNDERFLOW);
+                if(evm->call_stack.items[evm->call_stack.size - 1] & EVM_FRAME_TAG) FAULT(EVM_ERR_BAD_FRAME);
+                evm->ip = (Addr) evm->call_stack.items[--evm->call_stack.size];
+            }
+            break;
+            case EVM_INST_JP: {
+                NEED(1);
+                evm->ip = POP();
+                BACKEDGE();
+            }
+            break;
+            case EVM_INST_JPC: {
+                NEED(2);
+                Data cond = POP();
+                Addr new_ip = (Addr) POP();
+                if(cond){
+                    evm->ip = new_ip;
+                    BACKEDGE();
+                }
+            }
+            break;
+            case EVM_INST_JR: {
+                NEED(1);
+                evm->ip += POP();
+                BACKEDGE();
+            }
+            break;
+            case EVM_INST_JRC: {
+                NEED(2);
+                Data cond = POP();
+                Data offset = POP();
+                if(cond){
+                    evm->ip += offset;
+                    BACKEDGE();
+                }
+            }
+            break;
+            case EVM_INST_HALT:
+                evm->ip = inst_ip;
+                return EVM_ERR_OK;
+
+            case EVM_INST_NATIVE: {
+                Data index;
+                IMM(index);
+                if(evm->natives == NULL || index >= EVM_NATIVES_MAX || evm->natives[index].fn == NULL){
+                    FAULT(EVM_ERR_UNKNOWN_NATIVE);
+                }
+                CHECK(evm->natives[index].fn(evm, evm->natives[index].user));
+            }
+            break;
+            case EVM_INST_MULW: {
+                NEED(2);
+                Data lo, hi;
+                evm_mulw(TOP(1), TOP(0), &lo, &hi);
+                TOP(1) = lo;
+                TOP(0) = hi;
+            }
+            break;
+            case EVM_INST_ADDC: {
+                NEED(3);
+                Data c = POP() != 0;
+                Data a = TOP(0), b = TOP(1);
+                Data sum = b + a;
+                Data cout = sum < a;
+                sum += c;
+                cout |= sum < c;
+                TOP(1) = sum;
+                TOP(0) = cout;
+            }
+            break;
+            case EVM_INST_DIVU:
+            case EVM_INST_MODU: {
+                NEED(2);
+                if(TOP(0) == 0) FAULT(EVM_ERR_DIV_BY_ZERO);
+                Data a = POP();
+                TOP(0) = inst == EVM_INST_DIVU ? TOP(0) / a : TOP(0) % a;
+            }
+            break;
+            case EVM_INST_VADD:
+            case EVM_INST_VMUL: {
+                NEED(4);
+                Data n = TOP(0);
+                Addr b = TOP(1), a = TOP(2), dst = TOP(3);
+                if(!evm_vec_ok(evm, dst, n) || !evm_vec_ok(evm, a, n) || !evm_vec_ok(evm, b, n)){
+                    FAULT(EVM_ERR_MEMORY_OUT_OF_BOUNDS);
+                }
+                evm->stack.size -= 4;
+                evm_vbinop(evm->memory + dst, evm->memory + a, evm->memory + b, n, inst == EVM_INST_VMUL);
+            }
+            break;
+            case EVM_INST_VSUM: {
+                NEED(2);
+                Data n = POP();
+                Addr ptr = TOP(0);
+                if(!evm_vec_ok(evm, ptr, n)) FAULT(EVM_ERR_MEMORY_OUT_OF_BOUNDS);
+                TOP(0) = evm_vsum(evm->memory + ptr, n);
+            }
+            break;
+
+            case EVM_INST_SPAWN: {
+                NEED(2);
+                Addr addr = TOP(0);
+                Data argc = TOP(1);
+                if(argc > evm->stack.size - 2) FAULT(EVM_ERR_STACK_UNDERFLOW);
+                evm->stack.size -= 2;
+                Data handle;
+                CHECK(evm_spawn(evm, addr, argc, &handle));
+                evm->stack.size -= argc;
+                PUSH(handle);
+            }
+            break;
+            case EVM_INST_JOIN: {
+                NEED(1);
+                CHECK(evm_join(evm, TOP(0), &TOP(0)));
+            }
+            break;
+            case EVM_INST_ALOAD: {
+                NEED(1);
+                ATOMIC(TOP(0));
+                TOP(0) = atomic_load(evm_atomic(evm, TOP(0)));
+            }
+            break;
+            case EVM_INST_ASTORE: {
+                NEED(2);
+                ATOMIC(TOP(0));
+                Addr addr = POP();
+                atomic_store(evm_atomic(evm, addr), POP());
+            }
+            break;
+            case EVM_INST_CAS: {
+                NEED(3);
+                ATOMIC(TOP(0));
+                Addr addr = POP();
+                Data desired = POP();
+                uint64_t expected = TOP(0);
+                atomic_compare_exchange_strong(evm_atomic(evm, addr), &expected, desired);
+                TOP(0) = expected;
+            }
+            break;
+            case EVM_INST_FADD: {
+                NEED(2);
+                ATOMIC(TOP(0));
+                Addr addr = POP();
+                TOP(0) = atomic_fetch_add(evm_atomic(evm, addr), TOP(0));
+            }
+            break;
+
+            case EVM_INST_ALLOC: {
+                NEED(1);
+                Data ptr;
+                CHECK(evm_heap_alloc(evm, TOP(0), &ptr));
+                TOP(0) = ptr;
+            }
+            break;
+
+            case EVM_INST_FREE: {
+                NEED(1);
+                CHECK(evm_heap_free(evm, TOP(0)));
+                evm->stack.size--;
+            }
+            break;
+
+            case EVM_INST_REALLOC: {
+                NEED(2);
+                Data ptr;
+                CHECK(evm_heap_realloc(evm, TOP(1), TOP(0), &ptr));
+                evm->stack.size--;
+                TOP(0) = ptr;
+            }
+            break;
+
+            case EVM_INST_ENTER: {
+                Data n = 0;
+                IMM(n);
+                if(n > EVM_STACK_MAX) FAULT(EVM_ERR_STACK_OVERFLOW);
+                ROOM(n);
+                if(evm->fp > 0xffffffff) FAULT(EVM_ERR_STACK_OVERFLOW);
+                CHECK(stack_reserve(evm, &evm->call_stack, 1, EVM_CALL_STACK_MAX));
+                evm->call_stack.items[evm->call_stack.size++] = EVM_FRAME_TAG | (n << 32) | evm->fp;
+                evm_call_pushed(evm);
+                evm->fp = evm->stack.size;
+                memset(evm->stack.items + evm->stack.size, 0, n * sizeof(Data));
+                evm->stack.size += n;
+            }
+            break;
+
+            case EVM_INST_LEAVE: {
+                if(evm->call_stack.size == 0) FAULT(EVM_ERR_CALL_STACK_UNDERFLOW);
+                Data frame = evm->call_stack.items[evm->call_stack.size - 1];
+                if(!(frame & EVM_FRAME_TAG)) FAULT(EVM_ERR_BAD_FRAME);
+                size_t locals_end = evm->fp + ((frame & ~EVM_FRAME_TAG) >> 32);
+                if(evm->stack.size < locals_end) FAULT(EVM_ERR_STACK_UNDERFLOW);
+                size_t results = evm->stack.size - locals_end;
+                memmove(evm->stack.items + evm->fp, evm->stack.items + locals_end, results * sizeof(Data));
+                evm->stack.size = evm->fp + results;
+                evm->fp = frame & 0xffffffff;
+                evm->call_stack.size--;
+            }
+            break;
+
+            case EVM_INST_LOAD_LOCAL: {
+                Data i;
+                IMM(i);
+                Data slot = evm->fp + i;    //wraps for negative i
+                if(slot >= evm->stack.size) FAULT(EVM_ERR_STACK_UNDERFLOW);
+                ROOM(1);
+                PUSH(evm->stack.items[slot]);
+            }
+            break;
+
+            case EVM_INST_STORE_LOCAL: {
+                Data i;
+                IMM(i);
+                NEED(1);
+                Data v = POP();
+                Data slot = evm->fp + i;
+                if(slot >= evm->stack.size) FAULT(EVM_ERR_STACK_UNDERFLOW);
+                evm->stack.items[slot] = v;
+            }
+            break;
+
+            case EVM_INST_CALLR: {
+                NEED(1);
+                Data offset = POP();
+                CHECK(stack_reserve(evm, &evm->call_stack, 1, EVM_CALL_STACK_MAX));
+                evm->call_stack.items[evm->call_stack.size++] = evm->ip;
+                evm_call_pushed(evm);
+                evm->ip += offset;
+            }
+            break;
+
+            case EVM_INST_PUSHR: {
+                Data offset;
+                IMM(offset);
+                ROOM(1);
+                PUSH(evm->ip + offset);
+            }
+            break;
+
+            case EVM_INST_COUNT:
+            default:
+                FAULT(EVM_ERR_ILLEGAL_INST);
+        }
+        //printf("Ip: %zu Inst: %s Size: %zu\n", evm->ip, inst_to_str[inst], evm->stack.size);
+    }
+    return EVM_ERR_BUDGET;
+
+    #undef BACKEDGE
+    #undef ATOMIC
+    #undef MEM
+    #undef IMM
+    #undef TOP
+    #undef PUSH
+    #undef POP
+    #undef ROOM
+    #undef NEED
+    #undef CHECK
+    #undef FAULT
+}
+
+static Evm_Err evm_exec_words(Evm *evm, uint64_t budget)
+{
+    return evm_exec(evm, budget, false, false);
+}
+
+static Evm_Err evm_exec_compact(Evm *evm, uint64_t budget)
+{
+    return evm_exec(evm, budget, true, false);
+}
+
+/*Traces bypass the interpreter loop, so a profiled run stays in it*/
+static Evm_Err evm_exec_profile(Evm *evm, uint64_t budget)
+{
+    return evm_exec(evm, budget, false, true);
+}
+
+Evm_Err evm_run_budget(Evm *evm, uint64_t budget)
+{
+    Evm_Err err;
+    if(evm->compact) err = evm_exec_compact(evm, budget);
+    else err = evm->profile != NULL ? evm_exec_profile(evm, budget) : evm_exec_words(evm, budget);
+    if(evm->monitor.fn != NULL) evm->monitor.fn(evm, err, evm->monitor.user);
+    return err;
+}
+
+Evm_Err evm_run_ex(Evm *evm)
+{
+    uint64_t slice = evm->monitor.fn != NULL && evm->monitor.slice > 0 ? evm->monitor.slice : UINT64_MAX;
+    Evm_Err err;
+    do err = evm_run_budget(evm, slice);
+    while(err == EVM_ERR_BUDGET);
+    return err;
+}
+
+void evm_run(Evm *evm)
+{
+    Evm_Err err = evm_run_ex(evm);
+    if(err != EVM_ERR_OK){
+        fprintf(stderr, "evm: %s at ip %zu\n", evm_err_to_str(err), evm->ip);
+        exit(1);
+    }
+}
+
+
+#ifdef EVM_DEBUG
+#include "perf.h"
+
+static void testFib(void) 
+{
+    Evm evm = {0};
+    Evm_Insts program = {0};
+
+    //push 'newline'
+    da_append(&program, EVM_INST_PUSH);
+    da_append(&program, (Data) (0x0a0a0a0au));
+
+    //push 0 
+    da_append(&program, EVM_INST_PUSH);
+    da_append(&program, 0);
+    
+    //write64
+    da_append(&program, EVM_INST_WRITE64);
+
+    //push 0 
+    da_append(&program, EVM_INST_PUSH);
+    da_append(&program, 0);
+
+    //push 1
+    da_append(&program, EVM_INST_PUSH);
+    da_append(&program, 1);
+    
+    //dup 1
+    da_append(&program, EVM_INST_DUP);
+    da_append(&program, 1);
+    
+    //print
+    da_append(&program, EVM_INST_PRINTU);
+
+    
+    //push 1
+    da_append(&program, EVM_INST_PUSH);
+    da_append(&program, 1);
+
+    //push 0 
+    da_append(&program, EVM_INST_PUSH);
+    da_append(&program, 0);
+    
+    //puts
+    da_append(&program, EVM_INST_PUTS);
+    
+    //swap
+    da_append(&program, EVM_INST_SWAP);
+
+    //dup 1
+    da_append(&program, EVM_INST_DUP);
+    da_append(&program, 1);
+    
+    //add
+    da_append(&program, EVM_INST_ADD);
+    
+    //dup 0
+    da_append(&program, EVM_INST_DUP);
+    da_append(&program, 0);
+
+
+    //push INT32_MAX
+    da_append(&program, EVM_INST_PUSH);
+    da_append(&program, INT32_MAX);
+
+    //gt
+    da_append(&program, EVM_INST_GT);
+
+    //push 9
+    da_append(&program, EVM_INST_PUSH);
+    da_append(&program, 9);
+     
+    //swap
+    da_append(&program, EVM_INST_SWAP);
+
+    //jpc 
+    da_append(&program, EVM_INST_JPC);
+
+    //halt
+    da_append(&program, EVM_INST_HALT); 
+    
+    evm_init(&evm, program);
+    Evm_Err err = evm_run_ex(&evm);
+    if(err != EVM_ERR_OK){
+        fprintf(stderr, "ERROR: %s at ip %zu (%s)\n", evm_err_to_str(err), evm.ip, inst_to_str[evm.program.items[evm.ip]]);
+        dump_stack(&evm.stack);
+    }
+    evm_free(&evm);
+    free(program.items);
+}
+
+/**A reset in the middle of a trace recording must not resume it from the entry point*/
+static void testTierReset(void)
+{
+    Data n = 1000;
+    Data words[] = {
+        EVM_INST_PUSH, 0,
+        EVM_INST_PUSH, 1,       //loop
+        EVM_INST_ADD,
+        EVM_INST_PUSH, 2,
+        EVM_INST_DUP, 1,
+        EVM_INST_PUSH, n,
+        EVM_INST_GT,
+        EVM_INST_JPC,
+        EVM_INST_HALT,
+    };
+    Evm evm = {0};
+    evm_init(&evm, (Evm_Insts) {.items = words, .size = sizeof(words) / sizeof(words[0])});
+    evm.tier.enabled = true;
+    while(!evm.tier.recording || evm.tier.rec.size < 3){
+        assert(evm_run_budget(&evm, 1) == EVM_ERR_BUDGET);
+    }
+    evm_reset(&evm);
+    Evm_Err err = evm_run_ex(&evm);
+    assert(err == EVM_ERR_OK && evm.stack.size == 1 && evm.stack.items[0] == n);
+    printf("tier reset: ok\n");
+    evm_free(&evm);
+}
+
+/**An outer loop recorded while its inner loop already has a trace must record the inner
+   iterations too, not run past them. Counts outer * inner increments of mem[0]*/
+static void testTierNested(Data outer, Data inner)
+{
+    Data words[] = {
+        EVM_INST_PUSH, 0,       //j
+        EVM_INST_PUSH, 0,       //outer loop
+        EVM_INST_ADD,
+        EVM_INST_PUSH, 0,       //inner loop: mem[0]++
+        EVM_INST_READ64,
+        EVM_INST_PUSH, 1,
+        EVM_INST_ADD,
+        EVM_INST_PUSH, 0,
+        EVM_INST_WRITE64,
+        EVM_INST_PUSH, 1,       //j++ while j < inner
+        EVM_INST_ADD,
+        EVM_INST_PUSH, 5,
+        EVM_INST_DUP, 1,
+        EVM_INST_PUSH, inner,
+        EVM_INST_GT,
+        EVM_INST_JPC,
+        EVM_INST_DUP, 0,        //j = 0
+        EVM_INST_SUB,
+        EVM_INST_PUSH, 2,       //mem[8]++ while mem[8] < outer
+        EVM_INST_PUSH, 8,
+        EVM_INST_READ64,
+        EVM_INST_PUSH, 1,
+        EVM_INST_ADD,
+        EVM_INST_DUP, 0,
+        EVM_INST_PUSH, 8,
+        EVM_INST_WRITE64,
+        EVM_INST_PUSH, outer,
+        EVM_INST_GT,
+        EVM_INST_JPC,
+        EVM_INST_HALT,
+    };
+    Evm evm = {0};
+    evm_init(&evm, (Evm_Insts) {.items = words, .size = sizeof(words) / sizeof(words[0])});
+    evm.tier.enabled = true;
+    Evm_Err err = evm_run_ex(&evm);
+    assert(err == EVM_ERR_OK && evm_load64(&evm, 0) == outer * inner);
+    printf("tier nested %zux%zu: ok\n", outer, inner);
+    evm_free(&evm);
+}
+
+/**Runs a program image written with `easm -o`*/
+static int runImage(const char *filepath, bool perf_stats)
+{
+    FILE *f = fopen(filepath, "rb");
+    if(f == NULL){
+        fprintf(stderr, "Could not open file %s\n", filepath);
+        return 1;
+    }
+    fseek(f, 0, SEEK_END);
+    long n = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    void *image = malloc(n > 0 ? n : 1);
+    assert(image != NULL);
+    size_t m = fread(image, 1, n, f);
+    fclose(f);
+
+    Evm *evm = evm_create(NULL);
+    assert(evm != NULL);
+    Evm_Err err = evm_load_image(evm, image, m);
+    if(err == EVM_ERR_OK){
+        Evm_Perf perf;
+        if(perf_stats) evm_perf_begin(&perf);
+        err = evm_run_ex(evm);
+        if(perf_stats){
+            evm_perf_end(&perf);
+            evm_perf_report(&perf, filepath, evm->retired + evm->children_retired, stderr);
+        }
+    }
+    if(err != EVM_ERR_OK){
+        fprintf(stderr, "%s: %s at ip %zu\n", filepath, evm_err_to_str(err), evm->ip);
+    }
+    evm_destroy(evm);
+    free(image);
+    return err == EVM_ERR_OK ? 0 : 1;
+}
+
+int main(int argc, char **argv)
+{
+    bool perf_stats = false;
+    const char *image = NULL;
+    for(int i = 1; i < argc; ++i){
+        if(strcmp(argv[i], "--perf-stats") == 0) perf_stats = true;
+        else image = argv[i];
+    }
+    if(image) return runImage(image, perf_stats);
+    testFib();
+    testTierReset();
+    testTierNested(200, 100);
+    testTierNested(200, 3);
+    return 0;
+}
+#endif //EVM_DEBUG
@@ -9,15 +9,27 @@
 
 #include <inttypes.h>
 
+/*Bumped when an entry point changes signature or goes away. 2: Evm is opaque, so the
+  caller-allocated evm_init/evm_free of version 1 became evm_create + evm_attach/evm_destroy*/
+#define EVM_API_VERSION (2)
+
 #define DA_INIT_CAP (1024)
 #define EVM_MEM_CAP (64 * 1024)
+#define EVM_STACK_MAX (1024 * 1024)      /*data stack entries before EVM_ERR_STACK_OVERFLOW*/
+#define EVM_CALL_STACK_MAX (64 * 1024)   /*nested calls before EVM_ERR_STACK_OVERFLOW*/
+#define EVM_NATIVES_MAX (256)
+#define EVM_FDS_MAX (64)              /*guest handles fdread/fdwrite can name*/
+#define EVM_THREADS_MAX (256)         /*unjoined children of one VM*/
+#define EVM_TIER_HOT_THRESHOLD (64)   /*backward-branch hits before a loop head gets recorded*/
+#define EVM_TIER_MAX_TRACE_LEN (512)  /*recordings longer than this are abandoned*/
+#define EVM_TIER_MAX_ATTEMPTS (4)     /*failed recordings before a loop head is blacklisted*/
 
 #define da_append(da, item) do {                                                      \
     if((da)->size >= (da)->capacity){                                                 \
         if((da)->capacity == 0) (da)->items = NULL;                                   \
         (da)->capacity = ((da)->capacity == 0) ? DA_INIT_CAP  : (da)->capacity * 2;   \
         (da)->items = realloc((da)->items, (da)->capacity * sizeof(*(da)->items));    \
-        memset((da)->items + (da)->size, 0, (da)->capacity - (da)->size);             \
+        memset((da)->items + (da)->size, 0, ((da)->capacity - (da)->size) * sizeof(*(da)->items)); \
     }                                                                                 \
     (da)->items[(da)->size++] = item;\
 } while (0)
@@ -65,10 +77,60 @@ typedef enum {
     EVM_INST_JR,
     EVM_INST_JRC,
     EVM_INST_HALT,
+    EVM_INST_NATIVE,
+    EVM_INST_MULW,      /*b a -- lo hi      full 64x64->128 product*/
+    EVM_INST_ADDC,      /*b a c -- sum cout add with carry in c*/
+    EVM_INST_DIVU,      /*b a -- b/a*/
+    EVM_INST_MODU,      /*b a -- b%a*/
+    EVM_INST_VADD,      /*dst a b n --      n words dst[i] = a[i] + b[i]*/
+    EVM_INST_VMUL,      /*dst a b n --      n words dst[i] = a[i] * b[i]*/
+    EVM_INST_VSUM,      /*ptr n -- sum      horizontal sum of n words*/
+    EVM_INST_FDREAD,    /*size ptr fd -- n  read(2) into data memory, n < 0 is -errno. fd is a handle from evm_register_fd*/
+    EVM_INST_FDWRITE,   /*size ptr fd -- n  write(2) from data memory, n < 0 is -errno*/
+    EVM_INST_SPAWN,     /*args.. n addr -- handle   child thread at addr with n args, shares memory*/
+    EVM_INST_JOIN,      /*handle -- result  waits for the child, result is its stack top or 0*/
+    EVM_INST_ALOAD,     /*addr -- value     atomic 64 bit load*/
+    EVM_INST_ASTORE,    /*value addr --     atomic 64 bit store*/
+    EVM_INST_CAS,       /*expected desired addr -- old   stores desired if old == expected*/
+    EVM_INST_FADD,      /*delta addr -- old atomic fetch and add*/
+    EVM_INST_ALLOC,     /*size -- ptr       heap block of at least size bytes, 0 when out of heap*/
+    EVM_INST_FREE,      /*ptr --            returns a block to the heap, free of 0 does nothing*/
+    EVM_INST_REALLOC,   /*ptr size -- ptr   resized block (contents kept), 0 when out of heap*/
+    EVM_INST_ENTER,     /*-- locals..       `enter n`: new frame of n zeroed slots on the data stack*/
+    EVM_INST_LEAVE,     /*locals.. results.. -- results..   drops the locals, back to the caller's frame*/
+    EVM_INST_LOAD_LOCAL,    /*-- v          `load_local i`: slot fp + i, negative i reaches the arguments*/
+    EVM_INST_STORE_LOCAL,   /*v --          `store_local i`*/
+    EVM_INST_CALLR,     /*offset --         call ip + offset, ip is the address after callr*/
+    EVM_INST_PUSHR,     /*-- addr           `pushr off`: pushes the address after the instruction + off*/
     EVM_INST_COUNT
 } Evm_Opcode;
 
-static_assert(EVM_INST_COUNT == 24, "Change in EVM_INST_COUNT");
+static_assert(EVM_INST_COUNT == 49, "Change in EVM_INST_COUNT");
+
+/*Result of running a program. Everything after EVM_ERR_IO_PENDING is a fault: evm_ip is left on
+  the faulting instruction and the stack contents are unspecified*/
+typedef enum {
+    EVM_ERR_OK = 0,                 /*the program executed halt*/
+    EVM_ERR_BUDGET,                 /*the instruction budget ran out, running again resumes*/
+    EVM_ERR_IO_PENDING,             /*suspended on evm_io, resume after evm_io_complete*/
+    EVM_ERR_STACK_UNDERFLOW,
+    EVM_ERR_STACK_OVERFLOW,
+    EVM_ERR_CALL_STACK_UNDERFLOW,
+    EVM_ERR_ILLEGAL_INST,
+    EVM_ERR_IP_OUT_OF_BOUNDS,
+    EVM_ERR_MEMORY_OUT_OF_BOUNDS,
+    EVM_ERR_OUT_OF_MEMORY,
+    EVM_ERR_UNKNOWN_NATIVE,
+    EVM_ERR_BAD_IMAGE,
+    EVM_ERR_DIV_BY_ZERO,
+    EVM_ERR_MISALIGNED,             /*atomic access to an address that is not 8 byte aligned*/
+    EVM_ERR_BAD_THREAD,
+    EVM_ERR_THREAD,                 /*spawn failed, or EVM_THREADS_MAX children are running*/
+    EVM_ERR_BAD_POINTER,            /*free/realloc of an address alloc did not return, or a double free*/
+    EVM_ERR_BAD_FD,                 /*evm_register_fd handle out of range*/
+    EVM_ERR_BAD_FRAME,              /*leave on a return address, or ret on an enter frame*/
+    EVM_ERR_COUNT
+} Evm_Err;
 
 
 typedef uint64_t Addr;
@@ -81,26 +143,191 @@ typedef struct {
     size_t capacity;
 } Evm_Insts;
 
+/*Compact encoding: one byte per opcode, PUSH/DUP/NATIVE immediates as zigzag LEB128.
+  Code addresses are byte offsets into the bytecode*/
 typedef struct {
-    Data *items;
+    uint8_t *items;
     size_t size;
     size_t capacity;
-} Stack;
+} Evm_Bytecode;
+
+/*Initial contents of data memory from address 0, copied in whenever the program (re)starts*/
+typedef struct {
+    uint8_t *items;
+    size_t size;
+    size_t capacity;
+} Evm_Segment;
+
+#define EVM_LEB128_MAX (10)
+#define EVM_RELOC_WIDTH (5)  /*label immediates are padded to a fixed width so the layout is known up front*/
+
+/*Heap of the alloc/free/realloc opcodes: data memory from heap_base up, carved on demand.
+  Every block has an 8 byte header in front of it; blocks of up to EVM_HEAP_CLASS_MAX bytes
+  (header included) are rounded up to a power of two size class with its own free list, larger
+  ones go on one first fit list. The lists are threaded through the free blocks themselves.
+  A freed block merges with the free blocks next to it, and back into the uncarved tail at the end*/
+#define EVM_HEAP_CLASSES (9)
+#define EVM_HEAP_MIN_BLOCK (16)
+#define EVM_HEAP_CLASS_MAX (EVM_HEAP_MIN_BLOCK << (EVM_HEAP_CLASSES - 1))
 
 typedef struct {
-    Addr heap_base; /*addresses from the user will be offsets from this address in memeory*/
-    Addr ip;
-    Evm_Insts program;
-    size_t program_size;
-    Stack stack;
-    Data *memory;
-    size_t memory_capacity;
-    Stack call_stack;
-} Evm;
-
-void evm_init(Evm *evm, Evm_Insts program);
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t reallocs;
+    uint64_t failed;            /*alloc and realloc that returned 0*/
+    uint64_t live_bytes;        /*blocks in use, headers included*/
+    uint64_t peak_bytes;
+    uint64_t requested_bytes;   /*asked for by the blocks in use, the rest of live_bytes is internal fragmentation*/
+    uint64_t free_bytes;        /*blocks on the free lists, external fragmentation*/
+    uint64_t heap_bytes;        /*carved so far, live + free*/
+} Evm_Heap_Stats;
+
+/*Every allocation an instance makes goes through its allocator. `new_size == 0` frees `ptr`*/
+typedef struct {
+    void *(*realloc)(void *ctx, void *ptr, size_t old_size, size_t new_size);
+    void *ctx;
+} Evm_Allocator;
+
+/*A VM instance. The layout is private to the library: instances come from evm_create and are
+  only reached through the functions below, so it can change without breaking embedders*/
+typedef struct Evm Evm;
+
+/*I/O request of a VM suspended in async mode. The operands are already popped and bounds checked,
+  `fd` is the host fd the guest handle maps to*/
+typedef enum {
+    EVM_IO_NONE = 0,
+    EVM_IO_READ,
+    EVM_IO_WRITE,
+    EVM_IO_PUTS,    /*a write that has to complete in full and pushes no result*/
+} Evm_Io_Kind;
+
+typedef struct {
+    Evm_Io_Kind kind;
+    int fd;
+    Addr addr;
+    size_t size;
+    size_t done;    /*bytes of a puts already written*/
+} Evm_Io;
+
+/*Host function reached through `native <index>`. It takes its arguments from and leaves its
+  results on the data stack with evm_push/evm_pop; anything but EVM_ERR_OK faults the program*/
+typedef Evm_Err (*Evm_Native_Fn)(Evm *evm, void *user);
+
+/*Called with the result of every evm_run_budget. While one is set evm_run_ex runs `slice`
+  instructions at a time, so the monitor also sees programs that never stop*/
+typedef void (*Evm_Monitor_Fn)(Evm *evm, Evm_Err err, void *user);
+
+typedef struct {
+    Evm_Monitor_Fn fn;
+    void *user;
+    uint64_t slice;     /*0 leaves evm_run_ex unsliced*/
+} Evm_Monitor;
+
+/*Kept up to date by every instance as it runs, cleared by evm_reset*/
+typedef struct {
+    uint64_t call_depth_peak;   /*call_stack high-water mark*/
+    uint64_t memory_peak;       /*one past the highest memory address read or written*/
+    uint64_t io_read_bytes;     /*fdread results*/
+    uint64_t io_write_bytes;    /*fdwrite results and puts*/
+} Evm_Counters;
+
+/*Serialized program: this header followed by `program_size` little-endian instruction words,
+  or `program_size` bytes of compact bytecode when EVM_IMAGE_COMPACT is set, then `data_size`
+  bytes of the data segment. EVM_IMAGE_PIC marks code that only uses relative jumps, calls and
+  code addresses, so it runs unchanged at any base (see evm_region_add)*/
+#define EVM_IMAGE_MAGIC "EVMI"
+#define EVM_IMAGE_VERSION (3)
+#define EVM_IMAGE_COMPACT (1u << 0)
+#define EVM_IMAGE_PIC (1u << 1)
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t data_size;
+    uint64_t program_size;
+} Evm_Image_Header;
+
+extern const Evm_Allocator evm_libc_allocator;
+
+/*Embedding API. Within an EVM_API_VERSION entry points keep their signatures, extensions get new ones*/
+Evm *evm_create(const Evm_Allocator *allocator);  /*NULL uses evm_libc_allocator*/
+void evm_destroy(Evm *evm);
+/**Runs to halt or a fault. Children spawned by the program and not joined by it keep running
+   after either. evm_reset, evm_load_image, evm_attach and evm_destroy wait for them first*/
+Evm_Err evm_run_ex(Evm *evm);
+/**evm_run_ex for version 1 callers: a fault is reported on stderr and exits the process*/
 void evm_run(Evm *evm);
-void evm_free(Evm* evm);
+void evm_reset(Evm *evm);
+Evm_Err evm_load_image(Evm *evm, const void *image, size_t image_size);
+size_t evm_write_image(Evm_Insts program, void *buf, size_t buf_size);  /*returns the full image size*/
+size_t evm_write_compact_image(Evm_Bytecode code, void *buf, size_t buf_size);
+/**With a data segment. `flags` are added to the header, EVM_IMAGE_COMPACT is implied by the compact one*/
+size_t evm_write_image_ex(Evm_Insts program, Evm_Segment data, uint32_t flags, void *buf, size_t buf_size);
+size_t evm_write_compact_image_ex(Evm_Bytecode code, Evm_Segment data, uint32_t flags, void *buf, size_t buf_size);
+/**Copies `data` to address 0 now and on every evm_reset. Larger than memory is EVM_ERR_MEMORY_OUT_OF_BOUNDS*/
+Evm_Err evm_set_data(Evm *evm, const void *data, size_t size);
+Evm_Err evm_run_budget(Evm *evm, uint64_t budget);
+Evm_Err evm_register_native(Evm *evm, size_t index, Evm_Native_Fn fn, void *user);
+/**Lets fdread/fdwrite reach host `fd` through guest `handle`, -1 revokes it. Handles that are not
+   registered get -EBADF, so a guest only touches the fds its host hands out*/
+Evm_Err evm_register_fd(Evm *evm, size_t handle, int fd);
+Evm_Err evm_push(Evm *evm, Data d);
+void evm_io_complete(Evm *evm, int64_t result);  /*result of a read/write, ignored for puts*/
+Evm_Err evm_pop(Evm *evm, Data *d);
+void evm_heap_stats(Evm *evm, Evm_Heap_Stats *stats);
+
+/*Shared code region: the programs of many PIC word images appended into one Evm_Insts that any
+  number of instances run from without copying or relocating it. The region must not grow while
+  an instance is attached, since growing may move it*/
+/**Appends the code of `image` to `region` (grown with realloc). `entry` receives its first
+  address, `data` and `data_size` its data segment, which points into `image`.
+  Compact and non-PIC images are EVM_ERR_BAD_IMAGE*/
+Evm_Err evm_region_add(Evm_Insts *region, const void *image, size_t image_size,
+                       Addr *entry, const uint8_t **data, size_t *data_size);
+/**Runs `region` (or any word program) from `entry` on this instance. It stays owned by the caller*/
+void evm_attach(Evm *evm, Evm_Insts region, Addr entry);
+/**Runs caller owned compact bytecode from offset 0*/
+void evm_attach_compact(Evm *evm, Evm_Bytecode code);
+const char *evm_err_to_str(Evm_Err err);
+
+/*Accessors*/
+Addr evm_ip(const Evm *evm);
+uint64_t evm_retired(const Evm *evm);   /*instructions executed since the last reset*/
+uint64_t evm_children_retired(const Evm *evm);  /*the same for the children it joined, theirs included*/
+size_t evm_stack_depth(const Evm *evm);
+size_t evm_call_depth(const Evm *evm);  /*call_stack entries: return addresses and frames*/
+void evm_counters(const Evm *evm, Evm_Counters *counters);
+uint8_t *evm_memory(Evm *evm, size_t *size);
+Evm_Insts evm_program(const Evm *evm);  /*empty when running compact bytecode*/
+Evm_Segment evm_data(const Evm *evm);
+/**Record hot loops and run them as compiled traces*/
+void evm_set_tiered(Evm *evm, bool enabled);
+/**Caller owned, one execution count per program word while set, NULL stops counting. Word encoding only*/
+void evm_set_profile(Evm *evm, uint64_t *counts);
+/**Suspend on fdread/fdwrite/puts with EVM_ERR_IO_PENDING instead of blocking*/
+void evm_set_io_async(Evm *evm, bool async);
+/**The request of a suspended instance. A host finishing a puts in parts advances `done`*/
+Evm_Io *evm_io(Evm *evm);
+void evm_set_monitor(Evm *evm, const Evm_Monitor *monitor);  /*NULL removes it. Not inherited by spawned children*/
+void evm_monitor(const Evm *evm, Evm_Monitor *monitor);     /*all zero when none is set*/
+void evm_set_user(Evm *evm, void *user);
+void *evm_user(const Evm *evm);
+
+/*Immediate word at `index` holding a signed word distance from the instruction word at `base`*/
+typedef struct {
+    size_t index;
+    size_t base;
+} Evm_Rel_Reloc;
+
+/*Encodes `program` into `out` (allocated with realloc). `relocs` are the indices of the
+  immediate words that hold code addresses, they are rewritten to byte offsets*/
+bool evm_encode_compact(Evm_Insts program, const size_t *relocs, size_t relocs_count, Evm_Bytecode *out);
+/**`rel_relocs` hold code distances, they are rewritten to byte distances*/
+bool evm_encode_compact_ex(Evm_Insts program, const size_t *relocs, size_t relocs_count,
+                           const Evm_Rel_Reloc *rel_relocs, size_t rel_relocs_count, Evm_Bytecode *out);
+size_t evm_leb128_encode(uint64_t value, uint8_t *out);
+bool evm_has_immediate(Evm_Inst inst);  /*the instruction word is followed by an immediate word*/
 
 
 #endif //EVM_H_
\ No newline at end of file
@@ -0,0 +1,134 @@
+#ifndef EVM_INTERNAL_H_
+#define EVM_INTERNAL_H_
+
+#include "evm.h"
+
+/* Layout of an instance, private to libevm. Embedders, and the hosts built on the public API
+   (loop.h, metrics.h), only see the opaque Evm of evm.h */
+
+/*Marks the call_stack entries of enter, return addresses never reach bit 63*/
+#define EVM_FRAME_TAG (1ull << 63)
+
+typedef struct {
+    Data *items;
+    size_t size;
+    size_t capacity;
+} Stack;
+
+/*One step of a compiled trace. Stack operands are resolved at compile time to slots
+  relative to the stack top at trace entry, so running a trace needs no push/pop bookkeeping*/
+typedef struct {
+    Evm_Opcode kind;
+    bool imm_operand;   /*`a` is `imm` instead of a slot (a folded `push imm` before a binary op)*/
+    int32_t a, b, dst;  /*slot offsets from the entry stack top*/
+    int32_t depth;      /*stack depth relative to the entry after this op, used on guard exits*/
+    Data imm;           /*pushed value, dup offset, or the value a guard expects*/
+    bool taken;         /*recorded direction of a conditional branch*/
+    Addr ip;            /*ip of the recorded instruction, reported on faults*/
+    Addr next_ip;       /*fallthrough ip of the recorded instruction*/
+    uint32_t insts;     /*instructions retired by the trace up to and including this op*/
+} Evm_Trace_Op;
+
+typedef struct {
+    Evm_Trace_Op *items;
+    size_t size;
+    size_t capacity;
+    Addr head;
+    size_t min_depth;   /*slots the trace reads below the entry stack top*/
+    size_t max_growth;  /*peak slots the trace writes above the entry stack top*/
+    int32_t net;        /*stack depth change of one iteration*/
+    uint32_t insts;     /*instructions retired by one iteration*/
+} Evm_Trace;
+
+typedef struct {
+    Addr ip;
+    Evm_Inst inst;
+    Data imm;
+    Data target;        /*branch target (or offset) read from the stack when recorded*/
+    bool taken;
+} Evm_Trace_Entry;
+
+typedef struct {
+    Evm_Trace_Entry *items;
+    size_t size;
+    size_t capacity;
+} Evm_Trace_Entries;
+
+typedef struct {
+    uint32_t hits;
+    uint32_t attempts;
+    Evm_Trace *trace;
+} Evm_Hot_Slot;
+
+typedef struct {
+    bool enabled;
+    Evm_Hot_Slot *slots;    /*one per program word, allocated on the first backward branch*/
+    bool recording;
+    Addr rec_head;
+    Evm_Trace_Entries rec;
+    size_t traces_compiled;
+    size_t traces_entered;
+    size_t guard_exits;
+} Evm_Tier;
+
+/*Free lists and bounds of the heap described in evm.h*/
+typedef struct {
+    bool ready;                 /*base/top are set from heap_base on first use*/
+    _Atomic uint32_t lock;      /*spawned children share the heap of their root*/
+    Addr base;
+    Addr top;
+    Addr free_lists[EVM_HEAP_CLASSES + 1];  /*block addresses (never 0), the last list is first fit*/
+    Evm_Heap_Stats stats;
+} Evm_Heap;
+
+/*A child spawned by EVM_INST_SPAWN, the handle pushed by spawn is its index in Evm_Threads*/
+typedef struct Evm_Thread Evm_Thread;
+
+typedef struct {
+    Evm_Thread **items;     /*NULL once joined, the slot is reused*/
+    size_t size;
+    size_t capacity;
+} Evm_Threads;
+
+typedef struct {
+    Evm_Native_Fn fn;
+    void *user;
+} Evm_Native;
+
+struct Evm {
+    Addr heap_base; /*first free address past the data segment, 8 byte aligned*/
+    Addr ip;
+    Addr entry;         /*ip evm_reset starts from, the image base inside a shared region*/
+    Evm_Insts program;
+    Evm_Bytecode code;  /*used instead of `program` when `compact` is set*/
+    Evm_Segment data;   /*owned by the instance*/
+    bool compact;
+    bool owns_program;  /*loaded from an image, freed with the instance. Never set for a shared region*/
+    Stack stack;
+    uint8_t *memory;    /*byte addressed*/
+    size_t memory_capacity;
+    Stack call_stack;   /*return addresses, and EVM_FRAME_TAG | locals << 32 | caller fp for every enter*/
+    size_t fp;          /*data stack index of local 0 of the innermost frame*/
+    Evm_Native *natives;
+    int *fds;           /*EVM_FDS_MAX entries of host fd + 1, 0 for a handle that is not registered*/
+    uint64_t retired;   /*instructions executed so far*/
+    uint64_t children_retired;  /*by joined children, and the children they joined*/
+    Evm_Counters counters;
+    Evm_Monitor monitor;    /*not inherited by spawned children*/
+    void *user;         /*evm_set_user*/
+    uint64_t *profile;  /*caller owned, one execution count per program word while set. Word encoding only*/
+    bool io_async;      /*suspend on fdread/fdwrite/puts instead of blocking*/
+    Evm_Io io;
+    Evm *parent;        /*set on spawned children, which share the parent's memory, program, natives and fds*/
+    Evm_Threads threads;
+    Evm_Heap heap;      /*unused on children*/
+    Evm_Allocator allocator;
+    Evm_Tier tier;
+};
+
+/*Instances embedded in another struct, as spawned children are*/
+void evm_init(Evm *evm, Evm_Insts program);
+void evm_init_compact(Evm *evm, Evm_Bytecode code);
+void evm_free(Evm* evm);
+
+#endif //EVM_INTERNAL_H_
@@ -0,0 +1,109 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+#include <inttypes.h>
+
+#include "metrics.h"
+
+/* Reader for the metrics file of `easm --metrics` (or any host using metrics.h).
+   Every interval it prints one line of key=value pairs per VM: instruction and I/O rates since
+   the previous sample of that VM, then the current depths and high-water marks. age_ms is how
+   long ago the VM last published; a growing age on a running VM means its host stopped */
+
+#define EVMSTAT_INTERVAL_MS (1000)
+
+typedef struct {
+    Evm_Metrics_Sample last;    /*updated_ns 0 until the slot was seen*/
+    double inst_rate;
+    double read_rate;
+    double write_rate;
+} Stat_Slot;
+
+static const char *state_to_str(uint32_t err)
+{
+    if(err == EVM_ERR_BUDGET) return "running";
+    if(err == EVM_ERR_IO_PENDING) return "io";
+    if(err == EVM_ERR_OK) return "halted";
+    return evm_err_to_str((Evm_Err) err);
+}
+
+static double rate(uint64_t now, uint64_t before, uint64_t ns)
+{
+    return ns > 0 ? (double) (now - before) * 1e9 / (double) ns : 0.0;
+}
+
+/**Rates come from the previous sample of the slot, the first one is averaged since the VM started*/
+static void update_rates(Stat_Slot *s, const Evm_Metrics_Sample *sample)
+{
+    bool running = sample->err == EVM_ERR_BUDGET || sample->err == EVM_ERR_IO_PENDING;
+    if(sample->started_ns != s->last.started_ns) s->last = (Evm_Metrics_Sample) {.updated_ns = 0};
+    if(!running){
+        s->inst_rate = s->read_rate = s->write_rate = 0.0;
+    } else if(s->last.updated_ns == 0){
+        uint64_t ns = sample->updated_ns - sample->started_ns;
+        s->inst_rate = rate(sample->retired, 0, ns);
+        s->read_rate = rate(sample->io_read_bytes, 0, ns);
+        s->write_rate = rate(sample->io_write_bytes, 0, ns);
+    } else if(sample->updated_ns != s->last.updated_ns){
+        uint64_t ns = sample->updated_ns - s->last.updated_ns;
+        s->inst_rate = rate(sample->retired, s->last.retired, ns);
+        s->read_rate = rate(sample->io_read_bytes, s->last.io_read_bytes, ns);
+        s->write_rate = rate(sample->io_write_bytes, s->last.io_write_bytes, ns);
+    }
+    s->last = *sample;
+}
+
+int main(int argc, char **argv)
+{
+    if(argc < 2 || argc > 4){
+        fprintf(stderr, "Usage: %s <metrics file> [interval ms] [count]\n", argv[0]);
+        fprintf(stderr, "    prints the counters of every VM publishing to <metrics file> every interval\n");
+        fprintf(stderr, "    (default %d ms), <count> times or until interrupted\n", EVMSTAT_INTERVAL_MS);
+        return 1;
+    }
+    uint64_t interval = argc > 2 ? strtoull(argv[2], NULL, 0) : EVMSTAT_INTERVAL_MS;
+    uint64_t count = argc > 3 ? strtoull(argv[3], NULL, 0) : 0;
+
+    Evm_Metrics *metrics = evm_metrics_open(argv[1]);
+    if(metrics == NULL){
+        fprintf(stderr, "Could not open metrics file %s: %s\n", argv[1], strerror(errno));
+        return 1;
+    }
+    size_t slots = evm_metrics_slots(metrics);
+    Stat_Slot *stats = calloc(slots, sizeof(*stats));
+    if(stats == NULL){
+        fprintf(stderr, "Out of memory\n");
+        return 1;
+    }
+
+    for(uint64_t round = 0; count == 0 || round < count; ++round){
+        if(round > 0){
+            struct timespec ts = {.tv_sec = interval / 1000, .tv_nsec = (interval % 1000) * 1000000};
+            nanosleep(&ts, NULL);
+        }
+        uint64_t now = evm_metrics_now_ns();
+        for(size_t i = 0; i < slots; ++i){
+            Evm_Metrics_Sample sample;
+            if(!evm_metrics_read(metrics, i, &sample)) continue;
+            Stat_Slot *s = &stats[i];
+            update_rates(s, &sample);
+            printf("%s: pid=%" PRIu32 " state=%s inst_per_s=%.0f read_per_s=%.0f write_per_s=%.0f"
+                   " retired=%" PRIu64 " stack=%" PRIu64 " calls=%" PRIu64 " calls_peak=%" PRIu64
+                   " memory_peak=%" PRIu64 " heap_live=%" PRIu64 " read=%" PRIu64 " written=%" PRIu64
+                   " age_ms=%" PRIu64 "\n",
+                   sample.name, sample.pid, state_to_str(sample.err), s->inst_rate, s->read_rate, s->write_rate,
+                   sample.retired, sample.stack_depth, sample.call_depth, sample.call_depth_peak,
+                   sample.memory_peak, sample.heap_live_bytes, sample.io_read_bytes, sample.io_write_bytes,
+                   now > sample.updated_ns ? (now - sample.updated_ns) / 1000000 : 0);
+        }
+        fflush(stdout);
+    }
+
+    free(stats);
+    evm_metrics_close(metrics);
+    return 0;
+}
@@ -0,0 +1,214 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/epoll.h>
+
+#include "loop.h"
+
+#define LOOP_MAX_EVENTS (256)
+
+typedef struct {
+    Evm *evm;
+    int wait_fd;    /*dup of the evm_io fd registered with epoll, so several VMs can wait on one fd*/
+    size_t parked_at;   /*index in Evm_Loop.parked while wait_fd is registered*/
+} Loop_Vm;
+
+typedef struct {
+    Loop_Vm **items;
+    size_t size;
+    size_t capacity;
+} Loop_Vms;
+
+typedef struct {
+    int fd;
+    int flags;      /*flags before the loop set O_NONBLOCK*/
+} Loop_Fd;
+
+typedef struct {
+    Loop_Fd *items;
+    size_t size;
+    size_t capacity;
+} Loop_Fds;
+
+struct Evm_Loop {
+    int epfd;
+    uint64_t slice;
+    Evm_Loop_Exit_Fn on_exit;
+    void *user;
+    Loop_Vms runnable;
+    Loop_Vms parked;    /*waiting on epoll, owned by the loop until they come back*/
+    Loop_Fds owned;
+};
+
+Evm_Loop *evm_loop_create(uint64_t slice, Evm_Loop_Exit_Fn on_exit, void *user)
+{
+    Evm_Loop *loop = calloc(1, sizeof(*loop));
+    if(loop == NULL) return NULL;
+    loop->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if(loop->epfd < 0){
+        free(loop);
+        return NULL;
+    }
+    loop->slice = slice;
+    loop->on_exit = on_exit;
+    loop->user = user;
+    return loop;
+}
+
+void evm_loop_destroy(Evm_Loop *loop)
+{
+    if(loop == NULL) return;
+    for(size_t i = 0; i < loop->owned.size; ++i){
+        fcntl(loop->owned.items[i].fd, F_SETFL, loop->owned.items[i].flags);
+    }
+    for(size_t i = 0; i < loop->runnable.size; ++i) free(loop->runnable.items[i]);
+    for(size_t i = 0; i < loop->parked.size; ++i){
+        close(loop->parked.items[i]->wait_fd);
+        free(loop->parked.items[i]);
+    }
+    free(loop->runnable.items);
+    free(loop->parked.items);
+    free(loop->owned.items);
+    close(loop->epfd);
+    free(loop);
+}
+
+bool evm_loop_add(Evm_Loop *loop, Evm *evm)
+{
+    Loop_Vm *lv = malloc(sizeof(*lv));
+    if(lv == NULL) return false;
+    lv->evm = evm;
+    lv->wait_fd = -1;
+    evm_set_io_async(evm, true);
+    da_append(&loop->runnable, lv);
+    return true;
+}
+
+static void loop_own_fd(Evm_Loop *loop, int fd)
+{
+    for(size_t i = 0; i < loop->owned.size; ++i){
+        if(loop->owned.items[i].fd == fd) return;
+    }
+    int flags = fcntl(fd, F_GETFL);
+    if(flags < 0) return; //the syscall itself will report EBADF
+    if(!(flags & O_NONBLOCK)) fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+    da_append(&loop->owned, ((Loop_Fd) {.fd = fd, .flags = flags}));
+}
+
+/**Attempts the VM's pending I/O without blocking. Returns true once the request completed*/
+static bool loop_try_io(Evm_Loop *loop, Evm *evm)
+{
+    Evm_Io *io = evm_io(evm);
+    loop_own_fd(loop, io->fd);
+    if(io->fd == STDOUT_FILENO && io->kind != EVM_IO_READ) fflush(stdout);
+
+    while(true){
+        uint8_t *buf = evm_memory(evm, NULL) + io->addr + io->done;
+        size_t size = io->size - io->done;
+        ssize_t n = io->kind == EVM_IO_READ ? read(io->fd, buf, size) : write(io->fd, buf, size);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK) return false;
+            evm_io_complete(evm, -errno);
+            return true;
+        }
+        if(io->kind == EVM_IO_PUTS && n > 0 && io->done + n < io->size){
+            io->done += n;
+            continue;
+        }
+        evm_io_complete(evm, n);
+        return true;
+    }
+}
+
+static bool loop_park(Evm_Loop *loop, Loop_Vm *lv)
+{
+    Evm_Io *io = evm_io(lv->evm);
+    lv->wait_fd = fcntl(io->fd, F_DUPFD_CLOEXEC, 0);
+    if(lv->wait_fd < 0) return false;
+
+    struct epoll_event ev = {
+        .events = (io->kind == EVM_IO_READ ? EPOLLIN : EPOLLOUT) | EPOLLONESHOT,
+        .data.ptr = lv,
+    };
+    if(epoll_ctl(loop->epfd, EPOLL_CTL_ADD, lv->wait_fd, &ev) < 0){
+        close(lv->wait_fd);
+        lv->wait_fd = -1;
+        return false;
+    }
+    lv->parked_at = loop->parked.size;
+    da_append(&loop->parked, lv);
+    return true;
+}
+
+static void loop_unpark(Evm_Loop *loop, Loop_Vm *lv)
+{
+    //the registration outlives close() while the original fd is open, so remove it first
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, lv->wait_fd, NULL);
+    close(lv->wait_fd);
+    lv->wait_fd = -1;
+    Loop_Vm *last = loop->parked.items[--loop->parked.size];
+    loop->parked.items[lv->parked_at] = last;
+    last->parked_at = lv->parked_at;
+}
+
+/**Decides where a VM goes after its pending I/O was attempted*/
+static void loop_io(Evm_Loop *loop, Loop_Vm *lv, Loop_Vms *next)
+{
+    if(loop_try_io(loop, lv->evm)){
+        da_append(next, lv);
+    } else if(!loop_park(loop, lv)){
+        evm_io_complete(lv->evm, -errno);
+        da_append(next, lv);
+    }
+}
+
+bool evm_loop_run(Evm_Loop *loop)
+{
+    Loop_Vms current = {0};
+    struct epoll_event events[LOOP_MAX_EVENTS];
+
+    while(loop->runnable.size > 0 || loop->parked.size > 0){
+        Loop_Vms swap = current;
+        current = loop->runnable;
+        loop->runnable = swap;
+        loop->runnable.size = 0;
+
+        for(size_t i = 0; i < current.size; ++i){
+            Loop_Vm *lv = current.items[i];
+            Evm_Err err = evm_run_budget(lv->evm, loop->slice);
+            if(err == EVM_ERR_BUDGET){
+                da_append(&loop->runnable, lv);
+            } else if(err == EVM_ERR_IO_PENDING){
+                loop_io(loop, lv, &loop->runnable);
+            } else {
+                if(loop->on_exit) loop->on_exit(lv->evm, err, loop->user);
+                free(lv);
+            }
+        }
+        current.size = 0;
+
+        if(loop->parked.size == 0) continue;
+        int timeout = loop->runnable.size > 0 ? 0 : -1;
+        int n = epoll_wait(loop->epfd, events, LOOP_MAX_EVENTS, timeout);
+        if(n < 0){
+            if(errno == EINTR) continue;
+            free(current.items);
+            return false;
+        }
+        for(int i = 0; i < n; ++i){
+            Loop_Vm *lv = events[i].data.ptr;
+            loop_unpark(loop, lv);
+            loop_io(loop, lv, &loop->runnable);
+        }
+    }
+
+    free(current.items);
+    return true;
+}
@@ -0,0 +1,29 @@
+#ifndef LOOP_H_
+#define LOOP_H_
+
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "evm.h"
+
+/* Event loop host: many VMs in async I/O mode multiplexed on one OS thread.
+   A VM runs for `slice` instructions at a time; when it suspends on I/O the loop tries the
+   syscall right away and otherwise parks the VM on epoll until its fd is ready.
+   The host fds the VMs reach (see evm_register_fd) are switched to O_NONBLOCK while the loop
+   owns them and restored by evm_loop_destroy. The flag belongs to the open file, not the fd:
+   a terminal or pipe inherited from the shell is nonblocking for every process sharing it
+   until then, register a descriptor of its own (opened again, not dup'ed) to avoid that */
+
+typedef struct Evm_Loop Evm_Loop;
+
+/*Called once per VM when it halts or faults, the loop forgets the VM afterwards*/
+typedef void (*Evm_Loop_Exit_Fn)(Evm *evm, Evm_Err err, void *user);
+
+Evm_Loop *evm_loop_create(uint64_t slice, Evm_Loop_Exit_Fn on_exit, void *user);
+void evm_loop_destroy(Evm_Loop *loop);
+bool evm_loop_add(Evm_Loop *loop, Evm *evm);
+/**Runs until every VM added has exited. Returns false if epoll itself fails, the VMs that did
+   not exit are still the loop's and evm_loop_destroy releases them*/
+bool evm_loop_run(Evm_Loop *loop);
+
+#endif //LOOP_H_
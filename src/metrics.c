@@ -0,0 +1,215 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+
+#include "metrics.h"
+
+/*Spins a reader gives a slot that keeps changing under it before reporting it as unclaimed*/
+#define METRICS_READ_TRIES (1000)
+
+struct Evm_Metrics {
+    Evm_Metrics_Header *header;
+    Evm_Metrics_Slot *slots;
+    size_t size;
+    bool writable;
+};
+
+static size_t metrics_file_size(size_t slots)
+{
+    return sizeof(Evm_Metrics_Slot) + slots * sizeof(Evm_Metrics_Slot);  //the header gets a slot of its own
+}
+
+uint64_t evm_metrics_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000u + (uint64_t) ts.tv_nsec;
+}
+
+/**Whether `fd` holds a metrics file of this version, its size is then metrics_file_size(header->slots)*/
+static bool metrics_valid(int fd, Evm_Metrics_Header *header)
+{
+    struct stat st;
+    return fstat(fd, &st) == 0 && (size_t) st.st_size >= sizeof(Evm_Metrics_Slot)
+        && pread(fd, header, sizeof(*header), 0) == (ssize_t) sizeof(*header)
+        && memcmp(header->magic, EVM_METRICS_MAGIC, sizeof(header->magic)) == 0
+        && header->version == EVM_METRICS_VERSION
+        && (size_t) st.st_size >= metrics_file_size(header->slots);
+}
+
+static Evm_Metrics *metrics_map(int fd, size_t size, bool writable)
+{
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *base = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+    if(base == MAP_FAILED) return NULL;
+    Evm_Metrics *metrics = malloc(sizeof(*metrics));
+    if(metrics == NULL){
+        munmap(base, size);
+        errno = ENOMEM;
+        return NULL;
+    }
+    metrics->header = base;
+    metrics->slots = (Evm_Metrics_Slot *) ((uint8_t *) base + sizeof(Evm_Metrics_Slot));
+    metrics->size = size;
+    metrics->writable = writable;
+    return metrics;
+}
+
+/*Creators take the file lock, so only the first one finds a file that is not a metrics file yet
+  and initialises it. The others map it as it is, next to the VMs already publishing there*/
+Evm_Metrics *evm_metrics_create(const char *path)
+{
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd < 0) return NULL;
+    Evm_Metrics *metrics = NULL;
+    Evm_Metrics_Header header;
+    bool fresh = false;
+    if(flock(fd, LOCK_EX) == 0){
+        if(metrics_valid(fd, &header)){
+            metrics = metrics_map(fd, metrics_file_size(header.slots), true);
+        } else if(ftruncate(fd, 0) == 0 && ftruncate(fd, (off_t) metrics_file_size(EVM_METRICS_SLOTS)) == 0){
+            //the file was emptied first, so every slot reads back as zero (unclaimed)
+            metrics = metrics_map(fd, metrics_file_size(EVM_METRICS_SLOTS), true);
+            fresh = true;
+        }
+        if(metrics != NULL && fresh){
+            metrics->header->version = EVM_METRICS_VERSION;
+            metrics->header->slots = EVM_METRICS_SLOTS;
+            atomic_thread_fence(memory_order_release);
+            memcpy(metrics->header->magic, EVM_METRICS_MAGIC, sizeof(metrics->header->magic));
+        }
+    }
+    int saved = errno;
+    flock(fd, LOCK_UN);     //the mapping keeps the open file alive, so close alone would not
+    close(fd);
+    if(metrics == NULL) errno = saved;
+    return metrics;
+}
+
+Evm_Metrics *evm_metrics_open(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return NULL;
+    Evm_Metrics_Header header;
+    Evm_Metrics *metrics = NULL;
+    if(!metrics_valid(fd, &header)) errno = EINVAL;
+    else metrics = metrics_map(fd, metrics_file_size(header.slots), false);
+    int saved = errno;
+    close(fd);
+    if(metrics == NULL) errno = saved;
+    return metrics;
+}
+
+void evm_metrics_close(Evm_Metrics *metrics)
+{
+    if(metrics == NULL) return;
+    munmap(metrics->header, metrics->size);
+    free(metrics);
+}
+
+size_t evm_metrics_slots(const Evm_Metrics *metrics)
+{
+    return metrics->header->slots;
+}
+
+static void metrics_write(Evm_Metrics_Slot *slot, Evm *evm, Evm_Err err)
+{
+    Evm_Metrics_Sample *sample = &slot->sample;
+    Evm_Heap_Stats heap;
+    evm_heap_stats(evm, &heap);
+    Evm_Counters counters;
+    evm_counters(evm, &counters);
+
+    //only this VM writes the slot, so the relaxed load sees its own last store
+    uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed);
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    sample->updated_ns = evm_metrics_now_ns();
+    sample->retired = evm_retired(evm);
+    sample->stack_depth = evm_stack_depth(evm);
+    sample->call_depth = evm_call_depth(evm);
+    sample->call_depth_peak = counters.call_depth_peak;
+    sample->memory_peak = counters.memory_peak;
+    sample->io_read_bytes = counters.io_read_bytes;
+    sample->io_write_bytes = counters.io_write_bytes;
+    sample->heap_live_bytes = heap.live_bytes;
+    sample->err = err;
+    atomic_store_explicit(&slot->seq, seq + 2, memory_order_release);
+}
+
+/*Hosts like the event loop run short slices, those only publish once EVM_METRICS_SLICE
+  more instructions have retired*/
+static void metrics_publish(Evm *evm, Evm_Err err, void *user)
+{
+    Evm_Metrics_Slot *slot = user;
+    if(err == EVM_ERR_BUDGET && evm_retired(evm) - slot->sample.retired < EVM_METRICS_SLICE) return;
+    metrics_write(slot, evm, err);
+}
+
+/**Takes `slot` if it is free or its owner process is gone. The owner is swapped in with one
+  compare exchange, so of the hosts that found the same dead owner only one gets the slot. It then
+  is the only writer and may find `seq` odd, when the last one died in metrics_write*/
+static bool metrics_claim(Evm_Metrics_Slot *slot)
+{
+    uint32_t owner = atomic_load_explicit(&slot->owner, memory_order_acquire);
+    if(owner != 0 && (kill((pid_t) owner, 0) == 0 || errno != ESRCH)) return false;
+    return atomic_compare_exchange_strong_explicit(&slot->owner, &owner, (uint32_t) getpid(),
+                                                   memory_order_acquire, memory_order_relaxed);
+}
+
+bool evm_metrics_attach(Evm_Metrics *metrics, Evm *evm, const char *name)
+{
+    if(!metrics->writable) return false;
+    Evm_Metrics_Slot *slot = NULL;
+    for(size_t i = 0; slot == NULL && i < metrics->header->slots; ++i){
+        if(metrics_claim(&metrics->slots[i])) slot = &metrics->slots[i];
+    }
+    if(slot == NULL) return false;
+    uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_relaxed) | 1;
+    atomic_store_explicit(&slot->seq, seq, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    Evm_Metrics_Sample *sample = &slot->sample;
+    memset(sample, 0, sizeof(*sample));
+    sample->started_ns = evm_metrics_now_ns();
+    sample->pid = (uint32_t) getpid();
+    snprintf(sample->name, sizeof(sample->name), "%s", name);
+    atomic_store_explicit(&slot->seq, seq + 1, memory_order_release);
+    evm_set_monitor(evm, &(Evm_Monitor) {.fn = metrics_publish, .user = slot, .slice = EVM_METRICS_SLICE});
+    metrics_write(slot, evm, EVM_ERR_BUDGET);
+    return true;
+}
+
+void evm_metrics_detach(Evm *evm)
+{
+    Evm_Monitor monitor;
+    evm_monitor(evm, &monitor);
+    if(monitor.fn != metrics_publish) return;
+    evm_set_monitor(evm, NULL);
+    Evm_Metrics_Slot *slot = monitor.user;
+    atomic_store_explicit(&slot->owner, 0, memory_order_release);
+}
+
+bool evm_metrics_read(const Evm_Metrics *metrics, size_t slot, Evm_Metrics_Sample *sample)
+{
+    if(slot >= metrics->header->slots) return false;
+    Evm_Metrics_Slot *s = &metrics->slots[slot];
+    for(size_t i = 0; i < METRICS_READ_TRIES; ++i){
+        if(atomic_load_explicit(&s->owner, memory_order_acquire) == 0) return false;
+        uint64_t before = atomic_load_explicit(&s->seq, memory_order_acquire);
+        if(before & 1) continue;
+        memcpy(sample, &s->sample, sizeof(*sample));
+        atomic_thread_fence(memory_order_acquire);
+        if(atomic_load_explicit(&s->seq, memory_order_relaxed) == before) return true;
+    }
+    return false;
+}
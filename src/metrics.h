@@ -0,0 +1,73 @@
+#ifndef METRICS_H_
+#define METRICS_H_
+
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <inttypes.h>
+
+#include "evm.h"
+
+/* Live metrics: a file mapped MAP_SHARED into the host, holding one slot per attached VM.
+   An attached VM publishes its counters (evm_retired, evm_counters, stack depths, heap) into its
+   slot every EVM_METRICS_SLICE instructions and whenever it suspends or exits, so any other
+   process can map the file and watch the VMs without stopping them. Each slot is a seqlock:
+   `seq` is odd while its owner writes the sample, readers copy the sample and retry until
+   `seq` was the same even value before and after.
+   Hosts publishing to the same path share the file: slots are claimed with a compare exchange on
+   `owner`, and a slot that was detached or whose owner process has exited is handed out again,
+   even one left with an odd `seq` by a writer that died mid sample */
+
+#define EVM_METRICS_MAGIC "EVMM"
+#define EVM_METRICS_VERSION (3)
+#define EVM_METRICS_SLOTS (64)
+#define EVM_METRICS_NAME_MAX (48)
+#define EVM_METRICS_SLICE (1u << 20)
+
+typedef struct {
+    uint64_t started_ns;        /*CLOCK_MONOTONIC when the slot was claimed*/
+    uint64_t updated_ns;        /*CLOCK_MONOTONIC of this sample*/
+    uint64_t retired;
+    uint64_t stack_depth;
+    uint64_t call_depth;
+    uint64_t call_depth_peak;
+    uint64_t memory_peak;
+    uint64_t io_read_bytes;
+    uint64_t io_write_bytes;
+    uint64_t heap_live_bytes;
+    uint32_t err;               /*result of the last slice: EVM_ERR_BUDGET while running*/
+    uint32_t pid;
+    char name[EVM_METRICS_NAME_MAX];
+} Evm_Metrics_Sample;
+
+typedef struct {
+    _Alignas(64) _Atomic uint64_t seq;
+    _Atomic uint32_t owner;     /*pid of the process publishing here, 0 while the slot is free*/
+    Evm_Metrics_Sample sample;
+} Evm_Metrics_Slot;
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t slots;
+} Evm_Metrics_Header;
+
+typedef struct Evm_Metrics Evm_Metrics;
+
+/**Maps `path` for publishing, next to the hosts already publishing there. It is created, or
+   truncated, only when it does not hold a metrics file of this version. NULL with errno set on failure*/
+Evm_Metrics *evm_metrics_create(const char *path);
+/**Maps an existing metrics file read only. NULL with errno set on failure, EINVAL if it is not one*/
+Evm_Metrics *evm_metrics_open(const char *path);
+/**Unmaps the file, which stays on disk. Detach every VM first*/
+void evm_metrics_close(Evm_Metrics *metrics);
+/**Claims a slot for `evm` and installs the monitor that publishes into it.
+   False when every slot belongs to a live process or on a file opened read only*/
+bool evm_metrics_attach(Evm_Metrics *metrics, Evm *evm, const char *name);
+/**Removes the monitor and frees its slot for the next attach*/
+void evm_metrics_detach(Evm *evm);
+size_t evm_metrics_slots(const Evm_Metrics *metrics);
+/**Consistent copy of `slot`. False if the slot is free*/
+bool evm_metrics_read(const Evm_Metrics *metrics, size_t slot, Evm_Metrics_Sample *sample);
+uint64_t evm_metrics_now_ns(void);
+
+#endif //METRICS_H_
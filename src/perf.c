@@ -0,0 +1,155 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <inttypes.h>
+#include <sys/resource.h>
+
+#if defined(__linux__)
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#endif
+
+#include "perf.h"
+
+typedef struct {
+    const char *name;
+    uint32_t type;
+    uint64_t config;
+} Perf_Event;
+
+#if defined(__linux__)
+#define HW_CACHE(cache, op, result) \
+    ((cache) | ((PERF_COUNT_HW_CACHE_OP_ ## op) << 8) | ((PERF_COUNT_HW_CACHE_RESULT_ ## result) << 16))
+
+static const Perf_Event events[EVM_PERF_COUNT] = {
+    [EVM_PERF_CYCLES]           = {"cycles",           PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    [EVM_PERF_INSTRUCTIONS]     = {"instructions",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    [EVM_PERF_BRANCH_MISSES]    = {"branch_misses",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    [EVM_PERF_L1D_MISSES]       = {"l1d_misses",       PERF_TYPE_HW_CACHE, HW_CACHE(PERF_COUNT_HW_CACHE_L1D, READ, MISS)},
+    [EVM_PERF_L1I_MISSES]       = {"l1i_misses",       PERF_TYPE_HW_CACHE, HW_CACHE(PERF_COUNT_HW_CACHE_L1I, READ, MISS)},
+    [EVM_PERF_LLC_MISSES]       = {"llc_misses",       PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+    [EVM_PERF_TASK_CLOCK]       = {"task_clock_ns",    PERF_TYPE_SOFTWARE, PERF_COUNT_SW_TASK_CLOCK},
+    [EVM_PERF_PAGE_FAULTS]      = {"page_faults",      PERF_TYPE_SOFTWARE, PERF_COUNT_SW_PAGE_FAULTS},
+    [EVM_PERF_CONTEXT_SWITCHES] = {"context_switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+};
+
+static int perf_open(const Perf_Event *event)
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = event->type;
+    attr.config = event->config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.inherit = 1;   //threads started by spawn count towards the VM that started them
+    //counters are opened one by one, so the kernel may multiplex them; scale by enabled/running time
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    return (int) syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+#else
+static const Perf_Event events[EVM_PERF_COUNT] = {
+    [EVM_PERF_CYCLES]           = {"cycles",           0, 0},
+    [EVM_PERF_INSTRUCTIONS]     = {"instructions",     0, 0},
+    [EVM_PERF_BRANCH_MISSES]    = {"branch_misses",    0, 0},
+    [EVM_PERF_L1D_MISSES]       = {"l1d_misses",       0, 0},
+    [EVM_PERF_L1I_MISSES]       = {"l1i_misses",       0, 0},
+    [EVM_PERF_LLC_MISSES]       = {"llc_misses",       0, 0},
+    [EVM_PERF_TASK_CLOCK]       = {"task_clock_ns",    0, 0},
+    [EVM_PERF_PAGE_FAULTS]      = {"page_faults",      0, 0},
+    [EVM_PERF_CONTEXT_SWITCHES] = {"context_switches", 0, 0},
+};
+
+static int perf_open(const Perf_Event *event)
+{
+    (void) event;
+    return -1;
+}
+#endif
+
+static uint64_t now_ns(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+void evm_perf_begin(Evm_Perf *perf)
+{
+    memset(perf, 0, sizeof(*perf));
+    for(size_t i = 0; i < EVM_PERF_COUNT; ++i){
+        perf->fds[i] = perf_open(&events[i]);
+        perf->valid[i] = perf->fds[i] >= 0;
+        if(perf->valid[i] && i < EVM_PERF_TASK_CLOCK) perf->hardware = true;
+    }
+
+    //last resort for the software counters when perf_event_open is not allowed at all
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    perf->start_faults = ru.ru_minflt + ru.ru_majflt;
+    perf->start_switches = ru.ru_nvcsw + ru.ru_nivcsw;
+    perf->start_cpu_ns = now_ns(CLOCK_PROCESS_CPUTIME_ID);
+    perf->start_ns = now_ns(CLOCK_MONOTONIC);
+#if defined(__linux__)
+    for(size_t i = 0; i < EVM_PERF_COUNT; ++i){
+        if(!perf->valid[i]) continue;
+        ioctl(perf->fds[i], PERF_EVENT_IOC_RESET, 0);
+        ioctl(perf->fds[i], PERF_EVENT_IOC_ENABLE, 0);
+    }
+#endif
+}
+
+void evm_perf_end(Evm_Perf *perf)
+{
+#if defined(__linux__)
+    for(size_t i = 0; i < EVM_PERF_COUNT; ++i){
+        if(perf->valid[i]) ioctl(perf->fds[i], PERF_EVENT_IOC_DISABLE, 0);
+    }
+#endif
+    perf->wall_ns = now_ns(CLOCK_MONOTONIC) - perf->start_ns;
+    uint64_t cpu_ns = now_ns(CLOCK_PROCESS_CPUTIME_ID) - perf->start_cpu_ns;
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+
+    for(size_t i = 0; i < EVM_PERF_COUNT; ++i){
+        if(!perf->valid[i]) continue;
+        uint64_t buf[3]; //value, time enabled, time running
+        if(read(perf->fds[i], buf, sizeof(buf)) != sizeof(buf) || buf[2] == 0){
+            perf->valid[i] = false;
+        } else {
+            perf->values[i] = buf[2] < buf[1] ? (uint64_t) ((double) buf[0] * buf[1] / buf[2]) : buf[0];
+        }
+        close(perf->fds[i]);
+    }
+
+    if(!perf->valid[EVM_PERF_TASK_CLOCK]){
+        perf->valid[EVM_PERF_TASK_CLOCK] = true;
+        perf->values[EVM_PERF_TASK_CLOCK] = cpu_ns;
+    }
+    if(!perf->valid[EVM_PERF_PAGE_FAULTS]){
+        perf->valid[EVM_PERF_PAGE_FAULTS] = true;
+        perf->values[EVM_PERF_PAGE_FAULTS] = (ru.ru_minflt + ru.ru_majflt) - perf->start_faults;
+    }
+    if(!perf->valid[EVM_PERF_CONTEXT_SWITCHES]){
+        perf->valid[EVM_PERF_CONTEXT_SWITCHES] = true;
+        perf->values[EVM_PERF_CONTEXT_SWITCHES] = (ru.ru_nvcsw + ru.ru_nivcsw) - perf->start_switches;
+    }
+}
+
+void evm_perf_report(const Evm_Perf *perf, const char *name, uint64_t vm_insts, FILE *out)
+{
+    fprintf(out, "kernel=%s counters=%s vm_insts=%" PRIu64 " ns=%" PRIu64,
+            name, perf->hardware ? "hardware" : "software", vm_insts, perf->wall_ns);
+    for(size_t i = 0; i < EVM_PERF_COUNT; ++i){
+        if(!perf->valid[i]) continue;
+        fprintf(out, " %s=%" PRIu64, events[i].name, perf->values[i]);
+        if(vm_insts > 0) fprintf(out, " %s_per_inst=%.4f", events[i].name, (double) perf->values[i] / vm_insts);
+    }
+    fprintf(out, "\n");
+}
@@ -0,0 +1,44 @@
+#ifndef PERF_H_
+#define PERF_H_
+
+#include <stdio.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+/* Hardware performance counters around a VM run (Linux perf_event_open).
+   Counters the kernel refuses are reported as missing; if no hardware counter opens at all
+   the report falls back to software counters (task clock, page faults, context switches).
+   Threads the measuring thread starts after evm_perf_begin are counted once they exit, so join
+   spawned VM children before evm_perf_end and report their instructions too (evm_children_retired) */
+
+typedef enum {
+    EVM_PERF_CYCLES = 0,
+    EVM_PERF_INSTRUCTIONS,
+    EVM_PERF_BRANCH_MISSES,
+    EVM_PERF_L1D_MISSES,
+    EVM_PERF_L1I_MISSES,
+    EVM_PERF_LLC_MISSES,
+    EVM_PERF_TASK_CLOCK,
+    EVM_PERF_PAGE_FAULTS,
+    EVM_PERF_CONTEXT_SWITCHES,
+    EVM_PERF_COUNT
+} Evm_Perf_Counter;
+
+typedef struct {
+    int fds[EVM_PERF_COUNT];
+    bool valid[EVM_PERF_COUNT];
+    uint64_t values[EVM_PERF_COUNT];
+    bool hardware;          /*at least one hardware counter is live*/
+    uint64_t start_ns;
+    uint64_t wall_ns;
+    uint64_t start_cpu_ns;      /*process wide starting points of the getrusage fallback*/
+    uint64_t start_faults;
+    uint64_t start_switches;
+} Evm_Perf;
+
+void evm_perf_begin(Evm_Perf *perf);
+void evm_perf_end(Evm_Perf *perf);
+/**One line of space separated key=value pairs, the same format build/bench prints*/
+void evm_perf_report(const Evm_Perf *perf, const char *name, uint64_t vm_insts, FILE *out);
+
+#endif //PERF_H_
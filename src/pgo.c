@@ -0,0 +1,423 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pgo.h"
+
+#define PGO_NONE ((size_t) -1)
+
+/*A program being rewritten, with per-word side tables. Reloc words keep the address they had in
+  the input program until pgo_relocate maps them*/
+typedef struct {
+    Evm_Insts words;
+    struct {
+        bool *items;
+        size_t size;
+        size_t capacity;
+    } reloc;
+    struct {
+        uint64_t *items;
+        size_t size;
+        size_t capacity;
+    } counts;
+} Pgo_Code;
+
+typedef enum {
+    PGO_FALL,       /*no terminator, runs into the next block*/
+    PGO_JUMP,       /*ends with `push target; jp`*/
+    PGO_BRANCH,     /*ends with jpc, runs into the next block when not taken*/
+    PGO_STOP,       /*ret, halt or a computed jump*/
+} Pgo_Exit;
+
+typedef struct {
+    size_t start;
+    size_t end;
+    Pgo_Exit exit;
+    size_t jump;        /*start of the `push target; jp` of a PGO_JUMP*/
+    size_t succ;        /*block reached by falling through or by the jump, PGO_NONE if none*/
+    uint64_t weight;    /*executions of the edge to `succ`*/
+    uint64_t heat;      /*executions of the first instruction*/
+    size_t next;        /*chain links*/
+    size_t prev;
+} Pgo_Block;
+
+typedef struct {
+    uint64_t weight;
+    size_t from;
+} Pgo_Edge;
+
+static size_t pgo_width(Evm_Inst inst)
+{
+    return evm_has_immediate(inst) ? 2 : 1;
+}
+
+static void pgo_emit(Pgo_Code *c, Evm_Inst word, bool reloc, uint64_t count)
+{
+    da_append(&c->words, word);
+    da_append(&c->reloc, reloc);
+    da_append(&c->counts, count);
+}
+
+/**Appends the instruction at `ip` of `from`, counted `count` times*/
+static void pgo_copy(Pgo_Code *c, const Pgo_Code *from, size_t ip, uint64_t count)
+{
+    size_t width = pgo_width(from->words.items[ip]);
+    for(size_t i = 0; i < width; ++i){
+        pgo_emit(c, from->words.items[ip + i], from->reloc.items[ip + i], i == 0 ? count : 0);
+    }
+}
+
+static void pgo_free(Pgo_Code *c)
+{
+    free(c->words.items);
+    free(c->reloc.items);
+    free(c->counts.items);
+}
+
+/**Marks instruction starts. False if code addresses can't all be accounted for*/
+static bool pgo_scan(const Pgo_Code *c, bool *starts)
+{
+    const Evm_Inst *w = c->words.items;
+    size_t size = c->words.size;
+    for(size_t ip = 0; ip < size; ip += pgo_width(w[ip])){
+        if(w[ip] >= EVM_INST_COUNT || w[ip] == EVM_INST_JR || w[ip] == EVM_INST_JRC
+           || w[ip] == EVM_INST_CALLR || w[ip] == EVM_INST_PUSHR) return false;
+        if(ip + pgo_width(w[ip]) > size) return false;
+        starts[ip] = true;
+    }
+    for(size_t i = 0; i < size; ++i){
+        if(!c->reloc.items[i]) continue;
+        if(i == 0 || !starts[i - 1] || w[i - 1] != EVM_INST_PUSH) return false;
+        if(w[i] > size || (w[i] < size && !starts[w[i]])) return false;
+    }
+    return true;
+}
+
+/**Rewrites reloc words through `map`, old address to new*/
+static bool pgo_relocate(Pgo_Code *c, const size_t *map)
+{
+    for(size_t i = 0; i < c->words.size; ++i){
+        if(!c->reloc.items[i]) continue;
+        size_t addr = map[c->words.items[i]];
+        if(addr == PGO_NONE) return false;
+        c->words.items[i] = addr;
+    }
+    return true;
+}
+
+static size_t *pgo_map_new(size_t size)
+{
+    size_t *map = malloc((size + 1) * sizeof(*map));
+    memset(map, 0xff, (size + 1) * sizeof(*map));
+    return map;
+}
+
+/**Address of the ret ending the callee at `f` if it can be inlined, PGO_NONE otherwise*/
+static size_t pgo_inline_body(const Pgo_Code *c, const bool *starts, Evm_Inst f)
+{
+    const Evm_Inst *w = c->words.items;
+    size_t size = c->words.size;
+    if(f >= size || !starts[f]) return PGO_NONE;
+    size_t ip = f;
+    for(size_t n = 0; n <= EVM_PGO_INLINE_MAX && ip < size; ++n){
+        if(w[ip] == EVM_INST_RET) return ip;
+        if(w[ip] == EVM_INST_JP || w[ip] == EVM_INST_JPC || w[ip] == EVM_INST_CALL || w[ip] == EVM_INST_HALT) break;
+        ip += pgo_width(w[ip]);
+    }
+    return PGO_NONE;
+}
+
+/**Replaces `push f; call` sites that ran by the body of f. `saved` gets the instructions saved*/
+static bool pgo_inline(const Pgo_Code *in, const bool *starts, Pgo_Code *out, Evm_Pgo_Stats *stats, uint64_t *saved)
+{
+    const Evm_Inst *w = in->words.items;
+    size_t size = in->words.size;
+    size_t *map = pgo_map_new(size);
+    for(size_t ip = 0; ip < size;){
+        map[ip] = out->words.size;
+        size_t ret;
+        if(w[ip] == EVM_INST_PUSH && in->reloc.items[ip + 1] && ip + 2 < size && w[ip + 2] == EVM_INST_CALL
+           && in->counts.items[ip + 2] > 0 && (ret = pgo_inline_body(in, starts, w[ip + 1])) != PGO_NONE){
+            uint64_t calls = in->counts.items[ip + 2];
+            for(size_t f = w[ip + 1]; f < ret; f += pgo_width(w[f])) pgo_copy(out, in, f, calls);
+            stats->inlined++;
+            *saved += 3 * calls;    //push, call and ret
+            ip += 3;
+            continue;
+        }
+        pgo_copy(out, in, ip, in->counts.items[ip]);
+        ip += pgo_width(w[ip]);
+    }
+    map[size] = out->words.size;
+    bool ok = pgo_relocate(out, map);
+    free(map);
+    return ok;
+}
+
+/**Splits `c` into basic blocks. The last one may fall off the end of the program, `succ` is PGO_NONE then*/
+static void pgo_blocks(const Pgo_Code *c, const bool *starts, Pgo_Block **out, size_t *count)
+{
+    const Evm_Inst *w = c->words.items;
+    size_t size = c->words.size;
+    bool *leader = calloc(size + 1, sizeof(*leader));
+    size_t *block_of = malloc((size + 1) * sizeof(*block_of));
+    leader[0] = true;
+    for(size_t ip = 0; ip < size; ++ip){
+        if(c->reloc.items[ip] && w[ip] < size) leader[w[ip]] = true;
+        if(starts[ip] && (w[ip] == EVM_INST_JP || w[ip] == EVM_INST_JPC || w[ip] == EVM_INST_RET || w[ip] == EVM_INST_HALT)){
+            leader[ip + 1] = true;
+        }
+    }
+
+    struct {
+        Pgo_Block *items;
+        size_t size;
+        size_t capacity;
+    } blocks = {0};
+    size_t last = PGO_NONE, before_last = PGO_NONE;
+    for(size_t ip = 0; ; ip += pgo_width(w[ip])){
+        if(ip < size && !leader[ip]){
+            before_last = last;
+            last = ip;
+            continue;
+        }
+        if(blocks.size > 0){
+            Pgo_Block *b = &blocks.items[blocks.size - 1];
+            b->end = ip;
+            b->succ = ip < size ? blocks.size : PGO_NONE;
+            b->weight = c->counts.items[last];
+            if(w[last] == EVM_INST_JP && before_last != PGO_NONE && w[before_last] == EVM_INST_PUSH
+               && c->reloc.items[before_last + 1]){
+                b->exit = PGO_JUMP;
+                b->jump = before_last;
+            } else if(w[last] == EVM_INST_JPC){
+                b->exit = PGO_BRANCH;
+            } else if(w[last] == EVM_INST_JP || w[last] == EVM_INST_RET || w[last] == EVM_INST_HALT){
+                b->exit = PGO_STOP;
+                b->succ = PGO_NONE;
+            } else {
+                b->exit = PGO_FALL;
+            }
+        }
+        if(ip == size) break;
+        block_of[ip] = blocks.size;
+        da_append(&blocks, ((Pgo_Block) {
+            .start = ip,
+            .heat = c->counts.items[ip],
+            .next = PGO_NONE,
+            .prev = PGO_NONE,
+        }));
+        before_last = PGO_NONE;
+        last = ip;
+    }
+    for(size_t i = 0; i < blocks.size; ++i){
+        Pgo_Block *b = &blocks.items[i];
+        if(b->exit == PGO_JUMP){
+            Evm_Inst target = w[b->jump + 1];
+            b->succ = target < size ? block_of[target] : PGO_NONE;
+        }
+        //the not taken side of a branch runs at most as often as the block it falls into
+        if(b->exit == PGO_BRANCH && b->succ != PGO_NONE && blocks.items[b->succ].heat < b->weight){
+            b->weight = blocks.items[b->succ].heat;
+        }
+    }
+    free(leader);
+    free(block_of);
+
+    *out = blocks.items;
+    *count = blocks.size;
+}
+
+static int pgo_by_weight(const void *a, const void *b)
+{
+    const Pgo_Edge *x = a, *y = b;
+    if(x->weight != y->weight) return x->weight < y->weight ? 1 : -1;
+    return (x->from > y->from) - (x->from < y->from);
+}
+
+static size_t pgo_find(size_t *chain, size_t b)
+{
+    while(chain[b] != b){
+        chain[b] = chain[chain[b]];
+        b = chain[b];
+    }
+    return b;
+}
+
+typedef struct {
+    uint64_t heat;
+    size_t head;
+} Pgo_Chain;
+
+static int pgo_by_heat(const void *a, const void *b)
+{
+    const Pgo_Chain *x = a, *y = b;
+    if(x->head == 0 || y->head == 0) return x->head == 0 ? -1 : 1;  //the entry stays first
+    if(x->heat != y->heat) return x->heat < y->heat ? 1 : -1;
+    return (x->head > y->head) - (x->head < y->head);
+}
+
+/**Places the blocks of `in` so the heaviest edges become fall throughs*/
+static bool pgo_layout(const Pgo_Code *in, const bool *starts, Pgo_Code *out, Evm_Pgo_Stats *stats,
+                       uint64_t *removed, uint64_t *added)
+{
+    Pgo_Block *blocks;
+    size_t count;
+    pgo_blocks(in, starts, &blocks, &count);
+    stats->blocks = count;
+
+    Pgo_Edge *edges = malloc(count * sizeof(*edges));
+    size_t edge_count = 0;
+    size_t *chain = malloc(count * sizeof(*chain));
+    for(size_t i = 0; i < count; ++i){
+        chain[i] = i;
+        if(blocks[i].succ != PGO_NONE) edges[edge_count++] = (Pgo_Edge) {.weight = blocks[i].weight, .from = i};
+    }
+    qsort(edges, edge_count, sizeof(*edges), pgo_by_weight);
+    for(size_t i = 0; i < edge_count; ++i){
+        size_t a = edges[i].from, s = blocks[a].succ;
+        if(s == 0 || blocks[a].next != PGO_NONE || blocks[s].prev != PGO_NONE) continue;
+        size_t ca = pgo_find(chain, a), cs = pgo_find(chain, s);
+        if(ca == cs) continue;
+        blocks[a].next = s;
+        blocks[s].prev = a;
+        chain[cs] = ca;
+    }
+
+    Pgo_Chain *chains = malloc(count * sizeof(*chains));
+    size_t chain_count = 0;
+    for(size_t i = 0; i < count; ++i){
+        if(blocks[i].prev != PGO_NONE) continue;
+        Pgo_Chain ch = {.heat = 0, .head = i};
+        for(size_t b = i; b != PGO_NONE; b = blocks[b].next){
+            if(blocks[b].heat > ch.heat) ch.heat = blocks[b].heat;
+        }
+        chains[chain_count++] = ch;
+    }
+    qsort(chains, chain_count, sizeof(*chains), pgo_by_heat);
+
+    size_t *order = malloc(count * sizeof(*order));
+    size_t placed = 0;
+    for(size_t i = 0; i < chain_count; ++i){
+        for(size_t b = chains[i].head; b != PGO_NONE; b = blocks[b].next) order[placed++] = b;
+    }
+    assert(placed == count);
+
+    size_t *map = pgo_map_new(in->words.size);
+    for(size_t i = 0; i < count; ++i){
+        const Pgo_Block *b = &blocks[order[i]];
+        size_t following = i + 1 < count ? order[i + 1] : PGO_NONE;
+        size_t end = b->end;
+        if(b->exit == PGO_JUMP && b->succ == following){
+            end = b->jump;
+            stats->jumps_removed++;
+            *removed += b->weight;
+        }
+        for(size_t ip = b->start; ip < b->end; ip += pgo_width(in->words.items[ip])){
+            map[ip] = out->words.size;
+            if(ip < end) pgo_copy(out, in, ip, in->counts.items[ip]);
+        }
+        bool falls = b->exit == PGO_FALL || b->exit == PGO_BRANCH;
+        if(falls && b->succ != following && (b->succ != PGO_NONE || following != PGO_NONE)){
+            //off the end of the program stays off the end, it faults the same way
+            pgo_emit(out, EVM_INST_PUSH, false, b->weight);
+            pgo_emit(out, b->succ != PGO_NONE ? blocks[b->succ].start : in->words.size, true, 0);
+            pgo_emit(out, EVM_INST_JP, false, b->weight);
+            stats->jumps_added++;
+            *added += b->weight;
+        }
+    }
+    map[in->words.size] = out->words.size;
+    bool ok = pgo_relocate(out, map);
+
+    free(map);
+    free(order);
+    free(chains);
+    free(chain);
+    free(edges);
+    free(blocks);
+    return ok;
+}
+
+bool evm_pgo_optimize(Evm_Insts program, const size_t *relocs, size_t relocs_count, const uint64_t *counts,
+                      Evm_Insts *out, size_t **out_relocs, size_t *out_relocs_count, Evm_Pgo_Stats *stats)
+{
+    *stats = (Evm_Pgo_Stats) {0};
+    Pgo_Code in = {0}, inlined = {0}, laid = {0};
+    for(size_t i = 0; i < program.size; ++i){
+        pgo_emit(&in, program.items[i], false, counts[i]);
+        stats->insts_before += counts[i];
+    }
+    bool ok = program.size > 0;
+    for(size_t i = 0; ok && i < relocs_count; ++i){
+        if(relocs[i] >= program.size) ok = false;
+        else in.reloc.items[relocs[i]] = true;
+    }
+
+    uint64_t saved = 0, removed = 0, added = 0;
+    bool *starts = calloc(program.size + 1, sizeof(*starts));
+    ok = ok && pgo_scan(&in, starts) && pgo_inline(&in, starts, &inlined, stats, &saved);
+    if(ok){
+        starts = realloc(starts, (inlined.words.size + 1) * sizeof(*starts));
+        memset(starts, 0, (inlined.words.size + 1) * sizeof(*starts));
+        ok = pgo_scan(&inlined, starts) && pgo_layout(&inlined, starts, &laid, stats, &removed, &added);
+    }
+    free(starts);
+    pgo_free(&in);
+    pgo_free(&inlined);
+    if(!ok){
+        pgo_free(&laid);
+        return false;
+    }
+
+    //a removed `push; jp` saved two instructions per pass, an added one costs two
+    stats->insts_after = stats->insts_before - saved - 2 * removed + 2 * added;
+    *out_relocs = NULL;
+    *out_relocs_count = 0;
+    for(size_t i = 0; i < laid.reloc.size; ++i){
+        if(!laid.reloc.items[i]) continue;
+        *out_relocs = realloc(*out_relocs, (*out_relocs_count + 1) * sizeof(**out_relocs));
+        (*out_relocs)[(*out_relocs_count)++] = i;
+    }
+    *out = laid.words;
+    free(laid.reloc.items);
+    free(laid.counts.items);
+    return true;
+}
+
+bool evm_pgo_save(const char *path, uint64_t source, const uint64_t *counts, size_t size)
+{
+    FILE *f = fopen(path, "w");
+    if(f == NULL) return false;
+    fprintf(f, "evm-profile %d\nsource %016" PRIx64 "\nwords %zu\n", EVM_PGO_PROFILE_VERSION, source, size);
+    for(size_t i = 0; i < size; ++i){
+        if(counts[i] != 0) fprintf(f, "%zu %" PRIu64 "\n", i, counts[i]);
+    }
+    bool ok = !ferror(f);
+    return fclose(f) == 0 && ok;
+}
+
+uint64_t *evm_pgo_load(const char *path, uint64_t source, size_t size)
+{
+    FILE *f = fopen(path, "r");
+    if(f == NULL) return NULL;
+    int version;
+    uint64_t recorded;
+    size_t words;
+    uint64_t *counts = NULL;
+    if(fscanf(f, "evm-profile %d source %" SCNx64 " words %zu", &version, &recorded, &words) == 3
+       && version == EVM_PGO_PROFILE_VERSION && recorded == source && words == size){
+        counts = calloc(size + 1, sizeof(*counts));
+        size_t addr;
+        uint64_t count;
+        int n;
+        while((n = fscanf(f, "%zu %" SCNu64, &addr, &count)) == 2 && addr < size) counts[addr] = count;
+        if(n != EOF){
+            free(counts);
+            counts = NULL;
+        }
+    }
+    fclose(f);
+    return counts;
+}
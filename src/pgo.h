@@ -0,0 +1,43 @@
+#ifndef PGO_H_
+#define PGO_H_
+
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "evm.h"
+
+/* Profile guided layout of word programs.
+   A profile is the evm_set_profile array of a run: the execution count of every instruction word.
+   evm_pgo_optimize rewrites the program with it in two passes:
+   - `push f; call` sites that ran are replaced by the body of f when f is straight-line code
+     of at most EVM_PGO_INLINE_MAX instructions ending in ret
+   - basic blocks are chained hottest edge first (Pettis-Hansen), so a hot `push l; jp` whose
+     target can be placed right after it disappears and cold blocks sink to the end. Fall
+     throughs that end up apart get an explicit jump
+   Code addresses are only known through `relocs`, the same list evm_encode_compact takes, so
+   programs computing code addresses any other way (or using relative jumps, calls and pushr, as
+   PIC code does) are left untouched */
+
+#define EVM_PGO_INLINE_MAX (8)          /*callee instructions, ret excluded*/
+#define EVM_PGO_PROFILE_VERSION (1)
+
+typedef struct {
+    size_t blocks;
+    size_t inlined;             /*call sites replaced by the callee body*/
+    size_t jumps_removed;       /*unconditional jumps that became fall throughs*/
+    size_t jumps_added;         /*fall throughs that became jumps*/
+    uint64_t insts_before;      /*dynamic instructions of the profiled run*/
+    uint64_t insts_after;       /*the same run on the rewritten program, as predicted from the profile*/
+} Evm_Pgo_Stats;
+
+/**`counts` has one entry per word of `program`. On success `out` and `out_relocs` are allocated
+   with realloc and hold the rewritten program; on failure nothing is allocated*/
+bool evm_pgo_optimize(Evm_Insts program, const size_t *relocs, size_t relocs_count, const uint64_t *counts,
+                      Evm_Insts *out, size_t **out_relocs, size_t *out_relocs_count, Evm_Pgo_Stats *stats);
+
+/*Text file: a header naming the source it was recorded from, then `<addr> <count>` lines*/
+bool evm_pgo_save(const char *path, uint64_t source, const uint64_t *counts, size_t size);
+/**NULL unless the file is a profile of `size` words recorded from `source`. Free the result*/
+uint64_t *evm_pgo_load(const char *path, uint64_t source, size_t size);
+
+#endif //PGO_H_
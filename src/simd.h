@@ -0,0 +1,30 @@
+#ifndef SIMD_H_
+#define SIMD_H_
+
+/* Vector helpers shared by the interpreter (evm.c) and the batch runner (batch.c), private to
+   libevm. Only the widest instruction set the build targets is defined */
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+
+//AVX2 has no 64-bit lane multiply: lo*lo + ((lo*hi + hi*lo) << 32)
+static inline __m256i mul64x4(__m256i a, __m256i b)
+{
+    __m256i lo = _mm256_mul_epu32(a, b);
+    __m256i cross = _mm256_add_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), b),
+                                     _mm256_mul_epu32(a, _mm256_srli_epi64(b, 32)));
+    return _mm256_add_epi64(lo, _mm256_slli_epi64(cross, 32));
+}
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+
+static inline __m128i mul64x2(__m128i a, __m128i b)
+{
+    __m128i lo = _mm_mul_epu32(a, b);
+    __m128i cross = _mm_add_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), b),
+                                  _mm_mul_epu32(a, _mm_srli_epi64(b, 32)));
+    return _mm_add_epi64(lo, _mm_slli_epi64(cross, 32));
+}
+#endif
+
+#endif //SIMD_H_
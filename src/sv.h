@@ -7,6 +7,7 @@
 #include <assert.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <stdint.h>
 
 
 #define SV_FMT "%.*s"
@@ -46,14 +47,73 @@ bool sv_find(Sv haystack, Sv needle, size_t *fst_pos);
 #define MAX(a, b) (a) > (b) ? (a) : (b)
 #define CLAMP(v, min, max) MAX(MIN((v), (max)), min) 
 
-static bool _isspace(char c)
+#define SV_SCALAR_HEAD (8)
+
+#if defined(__GNUC__) && (defined(__AVX2__) || defined(__SSE2__))
+#define SV_SIMD
+#define SV_INLINE __attribute__((always_inline)) inline //also at -O0, where easm is built
+#if defined(__AVX2__)
+#include <immintrin.h>
+#else
+#include <emmintrin.h>
+#endif
+#else
+#define SV_INLINE inline
+#endif
+
+//isspace() of the "C" locale: ' ' and '\t' '\n' '\v' '\f' '\r', without the locale lookup
+static SV_INLINE bool sv__isspace(char c)
 {
-    return isspace(c);
+    return c == ' ' || (unsigned char) (c - '\t') <= '\r' - '\t';
 }
 
-static bool _isnewline(char c)
+#ifdef SV_SIMD
+#if defined(__AVX2__)
+/**Bit i is set when p[i] is whitespace, for 32 bytes*/
+static SV_INLINE uint32_t sv__space_mask32(const char *p)
 {
-    return c == '\n';
+    __m256i v = _mm256_loadu_si256((const __m256i *) p);
+    __m256i ctl = _mm256_sub_epi8(v, _mm256_set1_epi8('\t'));
+    ctl = _mm256_cmpeq_epi8(_mm256_min_epu8(ctl, _mm256_set1_epi8('\r' - '\t')), ctl);
+    __m256i sp = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+    return (uint32_t) _mm256_movemask_epi8(_mm256_or_si256(sp, ctl));
+}
+#endif
+
+/**Bit i is set when p[i] is whitespace, for 16 bytes*/
+static SV_INLINE uint32_t sv__space_mask16(const char *p)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *) p);
+    __m128i ctl = _mm_sub_epi8(v, _mm_set1_epi8('\t'));
+    ctl = _mm_cmpeq_epi8(_mm_min_epu8(ctl, _mm_set1_epi8('\r' - '\t')), ctl);
+    __m128i sp = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+    return (uint32_t) _mm_movemask_epi8(_mm_or_si128(sp, ctl));
+}
+#endif
+
+/**Length of the prefix of p[0..n) that is all whitespace (`space`) or all non-whitespace.
+  Whole vectors are tested while they fit and the tail a byte at a time, never reading past n*/
+static SV_INLINE size_t sv__span(const char *p, size_t n, bool space)
+{
+    //most spans in assembly are a few bytes, settle those before setting up vectors
+    size_t i = 0, head = n < SV_SCALAR_HEAD ? n : SV_SCALAR_HEAD;
+    while(i < head && sv__isspace(p[i]) == space) i++;
+    if(i < head || i == n) return i;
+#ifdef SV_SIMD
+    uint32_t flip = space ? 0xffffffffu : 0;
+#if defined(__AVX2__)
+    for(; i + 32 <= n; i += 32){
+        uint32_t stop = sv__space_mask32(p + i) ^ flip;
+        if(stop) return i + __builtin_ctz(stop);
+    }
+#endif
+    for(; i + 16 <= n; i += 16){
+        uint32_t stop = (sv__space_mask16(p + i) ^ flip) & 0xffff;
+        if(stop) return i + __builtin_ctz(stop);
+    }
+#endif
+    while(i < n && sv__isspace(p[i]) == space) i++;
+    return i;
 }
 
 Sv sv_from_cstr(const char *src)
@@ -79,7 +139,7 @@ Sv sv_clone(Sv sv)
 
 void sv_trim_left(Sv *sv)
 {
-    sv_take_while(sv, _isspace);
+    sv_take(sv, sv__span(sv->data, sv->size, true));
 }
 
 void sv_trim_right(Sv *sv)
@@ -127,23 +187,17 @@ Sv sv_take_until(Sv *sv, bool(*pred)(char))
 
 Sv sv_take_until_char(Sv *sv, char c)
 {
-    size_t i = 0;
-    for(; i < sv->size; ++i){
-        if(sv->data[i] == c) break;
-    }
-    
-    Sv res = sv_from_parts(sv->data, i);
-    sv->data += i;
-    sv->size -= i;
+    //memchr is vectorized by the libc
+    const char *at = sv->size > 0 ? memchr(sv->data, c, sv->size) : NULL;
+    Sv res = sv_take(sv, at ? (size_t) (at - sv->data) : sv->size);
     assert(sv->size == 0 || *sv->data == c);
     return res;
 }
 
 Sv sv_next_line(Sv *sv)
 {
-    Sv res = sv_take_until(sv, _isnewline);
-    assert(sv->size == 0 || *sv->data == '\n');
-    if(sv->size >= 0) sv_take(sv, 1);
+    Sv res = sv_take_until_char(sv, '\n');
+    sv_take(sv, 1);
     return res;
 }
 
@@ -159,18 +213,12 @@ Sv sv_substr(Sv sv, size_t start, size_t end)
 }
 
 Sv sv_chop_left(Sv *sv){
-    return sv_take_until(sv, _isspace);
+    return sv_take(sv, sv__span(sv->data, sv->size, false));
 }
 
 bool sv_eq(const Sv sv1, const Sv sv2)
 {
-    if(sv1.size != sv2.size) return false;
-
-    for(size_t i = 0; i < sv1.size; ++i){
-        if(sv1.data[i] != sv2.data[i]) return false;
-    }
-
-    return true;
+    return sv1.size == sv2.size && (sv1.size == 0 || memcmp(sv1.data, sv2.data, sv1.size) == 0);
 }
 
 bool sv_starts_with(Sv haystack, Sv neddle) 
@@ -216,6 +264,9 @@ bool sv_find(Sv haystack, Sv needle, size_t *fst_pos)
 #undef CLAMP
 #undef MIN
 #undef MAX
+#undef SV_SIMD
+#undef SV_INLINE
+#undef SV_SCALAR_HEAD
 
 #endif // SV_IMPLEMENTATION
 
@@ -0,0 +1,127 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <time.h>
+
+#include <inttypes.h>
+
+#define SV_IMPLEMENTATION
+#include "sv.h"
+
+/* Micro benchmarks for the sv.h scanning primitives on generated assembly.
+   Each primitive runs against a byte-at-a-time reference (the isspace() through a function
+   pointer loops sv.h used to have) and prints one line of key=value pairs per run */
+
+#define REPEATS (5)
+
+static const char *lines[] = {
+    "    push 0x0a",
+    "    push 12345          ; immediate",
+    "loop:",
+    "    dup 1",
+    "\tadd",
+    "    jpc loop",
+    "",
+    "; a comment line that is a bit longer than the instructions around it",
+    "    write64",
+};
+
+/**`indent` extra blanks in front of every line, the case where vectors pay off the most*/
+static Sv generate(size_t bytes, size_t indent)
+{
+    char *data = malloc(bytes + indent + 128);
+    size_t size = 0;
+    for(size_t i = 0; size < bytes; ++i){
+        const char *line = lines[i % (sizeof(lines) / sizeof(lines[0]))];
+        size_t n = strlen(line);
+        memset(data + size, ' ', indent);
+        size += indent;
+        memcpy(data + size, line, n);
+        data[size + n] = '\n';
+        size += n + 1;
+    }
+    return sv_from_parts(data, size);
+}
+
+static bool ref_isspace(char c)
+{
+    return isspace(c);
+}
+
+static bool ref_isnewline(char c)
+{
+    return c == '\n';
+}
+
+static Sv ref_take_while(Sv *sv, bool (*pred)(char), bool expect)
+{
+    size_t i = 0;
+    while(i < sv->size && pred(sv->data[i]) == expect) i++;
+    return sv_take(sv, i);
+}
+
+static Sv ref_next_line(Sv *sv)
+{
+    Sv res = ref_take_while(sv, ref_isnewline, false);
+    sv_take(sv, 1);
+    return res;
+}
+
+/**Splits into lines and every line into at most two tokens, like easm_tokenize does*/
+static size_t scan(Sv src, bool reference, bool tokens)
+{
+    size_t count = 0;
+    while(src.size > 0){
+        Sv line = reference ? ref_next_line(&src) : sv_next_line(&src);
+        count++;
+        if(!tokens) continue;
+        for(int i = 0; i < 2; ++i){
+            if(reference) ref_take_while(&line, ref_isspace, true);
+            else sv_trim_left(&line);
+            Sv token = reference ? ref_take_while(&line, ref_isspace, false) : sv_chop_left(&line);
+            count += token.size;
+        }
+    }
+    return count;
+}
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static void run(const char *bench, const char *corpus, Sv src, bool reference, bool tokens)
+{
+    uint64_t best = UINT64_MAX;
+    size_t check = 0;
+    for(int r = 0; r < REPEATS; ++r){
+        uint64_t start = now_ns();
+        check = scan(src, reference, tokens);
+        uint64_t ns = now_ns() - start;
+        if(ns < best) best = ns;
+    }
+    printf("bench=%s corpus=%s impl=%s bytes=%zu check=%zu ns=%" PRIu64 " mb_per_s=%.1f\n",
+           bench, corpus, reference ? "reference" : "sv", src.size, check, best, src.size * 1e3 / best);
+}
+
+int main(int argc, char **argv)
+{
+    size_t bytes = argc > 1 ? strtoull(argv[1], NULL, 0) : 8 * 1024 * 1024;
+    const struct { const char *name; size_t indent; } corpora[] = {
+        {"easm", 0},
+        {"indented", 48},
+    };
+    for(size_t c = 0; c < sizeof(corpora) / sizeof(corpora[0]); ++c){
+        Sv src = generate(bytes, corpora[c].indent);
+        run("lines", corpora[c].name, src, true, false);
+        run("lines", corpora[c].name, src, false, false);
+        run("tokens", corpora[c].name, src, true, true);
+        run("tokens", corpora[c].name, src, false, true);
+        free((char *) src.data);
+    }
+    return 0;
+}